@@ -0,0 +1,176 @@
+#ifndef BATCHER_HPP_J5RZC2WN
+#define BATCHER_HPP_J5RZC2WN
+
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <kmindex/exceptions.hpp>
+#include <kmindex/query/query.hpp>
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "compute.hpp"
+#include "metrics.hpp"
+#include "registry.hpp"
+
+namespace kmq {
+
+  // Coalesces the lookups of concurrent requests on the same sub-index. The first request of
+  // a window waits up to 'window' (or until 'max_requests' requests joined), then solves all
+  // their sequences as a single batch, so that each partition is walked once, and hands back
+  // to each request the responses of its own sequences. Requests are only coalesced with
+  // requests on the same registry, i.e. started between the same reloads.
+  class request_batcher
+  {
+    using responses_t = std::vector<query_response_t>;
+
+    struct caller
+    {
+      const std::string* name {nullptr};
+      const std::vector<std::string_view>* seqs {nullptr};
+      std::promise<responses_t> result;
+    };
+
+    struct window
+    {
+      std::vector<caller*> callers;
+      bool closed {false};
+      std::condition_variable cv;
+    };
+
+    using window_t = std::shared_ptr<window>;
+    using key_t = std::pair<const kindex_registry*, std::string>;
+
+    public:
+      request_batcher(compute_pool& compute,
+                      std::chrono::microseconds window,
+                      std::size_t max_requests)
+        : m_compute(compute), m_window(window), m_max_requests(max_requests) {}
+
+      // Responses of 'seqs' in sub-index 'index', in order. Sequences shorter than the s-mer
+      // size are rejected before joining a window, so that they only fail their own request.
+      responses_t submit(const kindex_registry& registry,
+                         const std::string& index,
+                         const std::string& name,
+                         const std::vector<std::string_view>& seqs)
+      {
+        std::size_t smer_size = registry.infos(index).smer_size();
+        for (auto& s : seqs)
+          if (s.size() < smer_size)
+            throw kmq_invalid_request(
+                fmt::format("Sequence too small: {}, min size is {}.", s.size(), smer_size));
+
+        caller c;
+        c.name = &name;
+        c.seqs = &seqs;
+        auto result = c.result.get_future();
+
+        key_t key(&registry, index);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto& current = m_windows[key];
+        if (!current)
+          current = std::make_shared<window>();
+        window_t w = current;
+        w->callers.push_back(&c);
+
+        if (w->callers.size() == 1)
+        {
+          auto deadline = std::chrono::steady_clock::now() + m_window;
+          w->cv.wait_until(lock, deadline, [&w](){ return w->closed; });
+          close(key, w);
+          lock.unlock();
+          solve(registry, index, *w);
+        }
+        else
+        {
+          if (w->callers.size() >= m_max_requests)
+          {
+            close(key, w);
+            w->cv.notify_one();
+          }
+          lock.unlock();
+        }
+
+        return result.get();
+      }
+
+    private:
+      void close(const key_t& key, const window_t& w)
+      {
+        w->closed = true;
+        auto it = m_windows.find(key);
+        if (it != m_windows.end() && it->second == w)
+          m_windows.erase(it);
+      }
+
+      void solve(const kindex_registry& registry, const std::string& index, window& w)
+      {
+        std::vector<responses_t> results(w.callers.size());
+        try
+        {
+          const index_infos& infos = registry.infos(index);
+
+          std::optional<stage_timer> timer(stage::hash);
+          auto smers = std::make_shared<smer_batch>(infos.nb_partitions(),
+                                                    infos.smer_size(),
+                                                    infos.get_repartition(),
+                                                    infos.get_hash_w(),
+                                                    infos.minim_size());
+          for (auto* c : w.callers)
+            for (auto& s : *c->seqs)
+              smers->add_query(*c->name, s);
+
+          batch_query bq(infos.nb_samples(), 0, infos.bw(), smers);
+
+          timer.emplace(stage::lookup);
+          m_compute.run_with<lookup_faults>(infos.nb_partitions(), [&](lookup_faults& faults, std::size_t p) {
+            registry.solve(index, bq, p, faults);
+          });
+          timer.reset();
+
+          spdlog::debug("'{}': {} requests coalesced ({} sequences)", index, w.callers.size(), bq.size());
+
+          auto& responses = bq.response();
+          std::size_t q = 0;
+          for (std::size_t i = 0; i < w.callers.size(); ++i)
+          {
+            results[i].reserve(w.callers[i]->seqs->size());
+            for (std::size_t n = 0; n < w.callers[i]->seqs->size(); ++n)
+              results[i].push_back(std::move(responses[q++]));
+          }
+        }
+        catch (...)
+        {
+          for (auto* c : w.callers)
+            c->result.set_exception(std::current_exception());
+          return;
+        }
+
+        // A caller may return as soon as it is served, it is not accessed afterwards.
+        for (std::size_t i = 0; i < w.callers.size(); ++i)
+          w.callers[i]->result.set_value(std::move(results[i]));
+      }
+
+    private:
+      compute_pool& m_compute;
+      std::chrono::microseconds m_window;
+      std::size_t m_max_requests {0};
+
+      std::mutex m_mutex;
+      std::map<key_t, window_t> m_windows;
+  };
+
+}
+
+#endif /* end of include guard: BATCHER_HPP_J5RZC2WN */
@@ -0,0 +1,345 @@
+#ifndef BULK_HPP_H6NQW4CS
+#define BULK_HPP_H6NQW4CS
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <kmindex/exceptions.hpp>
+#include <kmindex/fastx.hpp>
+#include <kmindex/query/format.hpp>
+#include <kmindex/query/query.hpp>
+#include <kmindex/query/query_results.hpp>
+
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+#include <simdjson.h>
+
+#include "compute.hpp"
+#include "metrics.hpp"
+#include "registry.hpp"
+#include "utils.hpp"
+
+using json = nlohmann::json;
+
+namespace kmq {
+
+  // Many independent named queries in a single request, given as NDJSON ({"id": .., "seq": ..}
+  // per line) or FASTA/FASTQ. Parameters come from the query string: 'index' (repeated or
+  // comma-separated), 'z', and optionally 'r' and 'format' (jsonl or jsonl_vec).
+  // Queries are solved by chunks, each chunk as a single batch per sub-index, and the JSONL
+  // lines of a chunk are emitted as soon as it is done.
+  class bulk_request
+  {
+    public:
+      // Queries per batch, i.e. per emitted chunk.
+      static constexpr std::size_t chunk_size = 1024;
+
+      using emit_t = std::function<bool(std::string&&)>;
+
+      // Sequences are views into 'content', FASTA/FASTQ records are parsed in place.
+      bulk_request(const SimpleWeb::CaseInsensitiveMultimap& params, simdjson::padded_string&& content)
+        : m_content(std::move(content))
+      {
+        parse_params(params);
+        parse_content();
+      }
+
+      bulk_request(const bulk_request&) = delete;
+      bulk_request& operator=(const bulk_request&) = delete;
+
+      std::size_t size() const
+      {
+        return m_seqs.size();
+      }
+
+      // Estimated work, see request::cost.
+      std::uint64_t cost(const kindex_registry& registry) const
+      {
+        std::uint64_t bp = 0;
+        for (auto& s : m_seqs)
+          bp += s.size();
+
+        std::uint64_t samples = 0;
+        for (auto& i : m_index)
+          samples += registry.infos(i).nb_samples();
+
+        return bp * samples;
+      }
+
+      const std::vector<std::string>& indexes() const
+      {
+        return m_index;
+      }
+
+      // Throws on unknown sub-indexes, to be reported before anything is sent.
+      void check(const kindex_registry& registry) const
+      {
+        for (auto& i : m_index)
+          registry.infos(i);
+      }
+
+      // Emits the results of each chunk, stops early when 'emit' returns false.
+      void solve(const kindex_registry& registry, compute_pool& compute, const emit_t& emit) const
+      {
+        for (std::size_t begin = 0; begin < m_seqs.size(); begin += chunk_size)
+        {
+          std::size_t end = std::min(m_seqs.size(), begin + chunk_size);
+          if (!emit(solve_chunk(registry, compute, begin, end)))
+            return;
+        }
+      }
+
+    private:
+      struct batch
+      {
+        smer_batch_t smers {nullptr};
+        std::vector<std::string> errors;
+      };
+
+      std::string solve_chunk(const kindex_registry& registry,
+                              compute_pool& compute,
+                              std::size_t begin,
+                              std::size_t end) const
+      {
+        std::unordered_map<std::string, batch> batches;
+        std::vector<std::unique_ptr<batch_query>> bqs;
+        std::vector<std::pair<std::size_t, std::size_t>> units;
+
+        std::optional<stage_timer> timer(stage::hash);
+        for (std::size_t i = 0; i < m_index.size(); ++i)
+        {
+          const index_infos& infos = registry.infos(m_index[i]);
+          auto& b = batches[infos.sha1()];
+          if (!b.smers)
+          {
+            b.smers = std::make_shared<smer_batch>(infos.nb_partitions(),
+                                                   infos.smer_size(),
+                                                   infos.get_repartition(),
+                                                   infos.get_hash_w(),
+                                                   infos.minim_size());
+            for (std::size_t q = begin; q < end; ++q)
+            {
+              // A query too small does not fail the others.
+              if (m_seqs[q].size() < infos.smer_size() + m_z)
+              {
+                json e;
+                e["query"] = std::string(m_names[q]);
+                e["error"] = fmt::format("Sequence too small: {}, min size is {}.",
+                                         m_seqs[q].size(), infos.smer_size() + m_z);
+                b.errors.push_back(e.dump());
+              }
+              else
+              {
+                b.smers->add_query(std::string(m_names[q]), m_seqs[q]);
+              }
+            }
+          }
+
+          bqs.push_back(std::make_unique<batch_query>(infos.nb_samples(), m_z, infos.bw(), b.smers));
+          for (std::size_t p = 0; p < infos.nb_partitions(); ++p)
+            units.emplace_back(i, p);
+        }
+
+        timer.emplace(stage::lookup);
+        compute.run_with<lookup_faults>(units.size(), [&](lookup_faults& faults, std::size_t u) {
+          auto [i, p] = units[u];
+          registry.solve(m_index[i], *bqs[i], p, faults);
+        });
+
+        timer.emplace(stage::reduce);
+        std::vector<std::vector<query_result>> results(m_index.size());
+        compute.run(m_index.size(), [&](std::size_t i) {
+          const index_infos& infos = registry.infos(m_index[i]);
+          results[i].reserve(bqs[i]->response().size());
+          for (auto&& r : bqs[i]->response())
+            results[i].emplace_back(std::move(r), m_z, infos, m_format == format::jsonl_with_positions);
+        });
+
+        timer.emplace(stage::serialize);
+        std::vector<std::stringstream> outputs(m_index.size());
+        compute.run(m_index.size(), [&](std::size_t i) {
+          const index_infos& infos = registry.infos(m_index[i]);
+          auto formatter = make_formatter(m_format, m_r, infos.bw());
+          for (auto& r : results[i])
+            formatter->format(infos, r, outputs[i]);
+        });
+
+        std::string out;
+        for (auto& [_, b] : batches)
+          for (auto& e : b.errors)
+            (out += e) += '\n';
+        for (auto& o : outputs)
+          out += o.str();
+        return out;
+      }
+
+      void parse_params(const SimpleWeb::CaseInsensitiveMultimap& params)
+      {
+        auto [first, last] = params.equal_range("index");
+        for (auto it = first; it != last; ++it)
+        {
+          std::string_view v = it->second;
+          while (!v.empty())
+          {
+            auto pos = v.find(',');
+            if (pos)
+              m_index.emplace_back(v.substr(0, pos));
+            if (pos == std::string_view::npos)
+              break;
+            v.remove_prefix(pos + 1);
+          }
+        }
+
+        if (m_index.empty())
+          throw kmq_invalid_request("'index' parameter is missing.");
+
+        auto z = params.find("z");
+        if (z == params.end())
+          throw kmq_invalid_request("'z' parameter is missing.");
+        m_z = parse_number<std::size_t>("z", z->second);
+
+        auto r = params.find("r");
+        if (r != params.end())
+        {
+          m_r = parse_number<double>("r", r->second);
+          if (m_r < 0.0 || m_r > 1.0)
+            throw kmq_invalid_request(fmt::format("'r': {}, should be in [0.0, 1.0]", m_r));
+        }
+
+        auto f = params.find("format");
+        if (f != params.end())
+        {
+          if (f->second == "jsonl")
+            m_format = format::jsonl;
+          else if (f->second == "jsonl_vec")
+            m_format = format::jsonl_with_positions;
+          else
+            throw kmq_invalid_request(
+              fmt::format("'format':'{}' not supported, should be 'jsonl' or 'jsonl_vec'.", f->second));
+        }
+      }
+
+      template<typename T>
+      static T parse_number(const std::string& name, const std::string& value)
+      {
+        try
+        {
+          std::size_t n = 0;
+          T v;
+          if constexpr (std::is_floating_point_v<T>)
+            v = std::stod(value, &n);
+          else
+            v = std::stoull(value, &n);
+          if (n == value.size())
+            return v;
+        }
+        catch (const std::exception&) {}
+        throw kmq_invalid_request(fmt::format("'{}': '{}' is not a valid number.", name, value));
+      }
+
+      void parse_content()
+      {
+        std::string_view content(m_content.data(), m_content.size());
+        auto start = content.find_first_not_of(" \t\r\n");
+        if (start == std::string_view::npos)
+          throw kmq_invalid_request("No query found.");
+
+        if (content[start] == '{')
+          parse_ndjson();
+        else if (content[start] == '>' || content[start] == '@')
+          parse_fastx_content();
+        else
+          throw kmq_invalid_request("Unknown content, expected NDJSON or FASTA/FASTQ.");
+      }
+
+      // One document per line. Lines are parsed from the request buffer, whose padding
+      // covers the end of the last one. Strings are unescaped in the parser buffer, reused by
+      // the next line, and kept in m_strings.
+      void parse_ndjson()
+      {
+        using namespace simdjson;
+
+        ondemand::parser parser;
+        const char* end = m_content.data() + m_content.size();
+        std::string_view v(m_content.data(), m_content.size());
+        std::size_t line = 0;
+
+        while (!v.empty())
+        {
+          auto pos = v.find('\n');
+          std::string_view l = v.substr(0, pos);
+          v.remove_prefix(pos == std::string_view::npos ? v.size() : pos + 1);
+          ++line;
+
+          if (l.find_first_not_of(" \t\r") == std::string_view::npos)
+            continue;
+
+          std::size_t capacity = (end - l.data()) + SIMDJSON_PADDING;
+          ondemand::document doc = parser.iterate(padded_string_view(l.data(), l.size(), capacity));
+          ondemand::object q = doc.get_object();
+
+          std::string_view id, seq;
+          bool has_id = false, has_seq = false;
+          for (ondemand::field f : q)
+          {
+            std::string_view key = f.unescaped_key().value();
+            if (key == "id")
+            {
+              id = f.value().get_string();
+              has_id = true;
+            }
+            else if (key == "seq")
+            {
+              seq = f.value().get_string();
+              has_seq = true;
+            }
+          }
+
+          if (!has_id || !has_seq)
+            throw kmq_invalid_request(fmt::format("Line {}: 'id' and 'seq' entries are required.", line));
+
+          m_names.push_back(m_strings.emplace_back(id));
+          m_seqs.push_back(m_strings.emplace_back(seq));
+        }
+      }
+
+      void parse_fastx_content()
+      {
+        char* begin = m_content.data();
+        char* end = begin + m_content.size();
+
+        std::vector<fastx_record_view> records;
+        parse_fastx(begin, end, guess_fastx_type(begin, end), records, true);
+
+        m_names.reserve(records.size());
+        m_seqs.reserve(records.size());
+        for (auto& r : records)
+        {
+          m_names.push_back(r.name);
+          m_seqs.push_back(r.seq);
+        }
+      }
+
+    private:
+      simdjson::padded_string m_content;
+      std::deque<std::string> m_strings;
+
+      std::vector<std::string> m_index;
+      std::vector<std::string_view> m_names;
+      std::vector<std::string_view> m_seqs;
+      std::size_t m_z {0};
+      double m_r {0.0};
+      enum format m_format {format::jsonl};
+  };
+
+}
+
+#endif /* end of include guard: BULK_HPP_H6NQW4CS */
@@ -1,49 +1,208 @@
-#include <sstream>
-#include <stdexcept>
+#include <algorithm>
+#include <cctype>
 #include <cstring>
+#include <map>
+#include <stdexcept>
+
+#include <fmt/format.h>
+
 #include "compress.hpp"
 
 namespace kmq {
 
-  // Source: https://panthema.net/2007/0328-ZLibString.html
-  std::string compress_string(const std::string& str,
-                              int compressionlevel)
+  compression_options& response_compression()
   {
-      z_stream zs;                        // z_stream is zlib's control structure
-      memset(&zs, 0, sizeof(zs));
+    static compression_options opt;
+    return opt;
+  }
 
-      if (deflateInit(&zs, compressionlevel) != Z_OK)
-          throw(std::runtime_error("deflateInit failed while compressing."));
+  content_encoding negotiate_encoding(const std::string& accept_encoding)
+  {
+    // q-value of each coding, 'identity' and '*' included.
+    std::map<std::string, double> q;
+    std::string_view v = accept_encoding;
+    while (!v.empty())
+    {
+      auto pos = v.find(',');
+      std::string_view item = v.substr(0, pos);
+      v.remove_prefix(pos == std::string_view::npos ? v.size() : pos + 1);
 
-      zs.next_in = (Bytef*)str.data();
-      zs.avail_in = str.size();           // set the z_stream's input
+      auto semi = item.find(';');
+      std::string_view coding = item.substr(0, semi);
+      auto b = coding.find_first_not_of(" \t");
+      auto e = coding.find_last_not_of(" \t");
+      if (b == std::string_view::npos)
+        continue;
+      coding = coding.substr(b, e - b + 1);
 
-      int ret;
-      char outbuffer[32768];
-      std::string outstring;
+      double value = 1.0;
+      if (semi != std::string_view::npos)
+      {
+        std::string params(item.substr(semi + 1));
+        auto qp = params.find("q=");
+        if (qp != std::string::npos)
+        {
+          try {
+            value = std::stod(params.substr(qp + 2));
+          } catch (const std::exception&) {
+            value = 0.0;
+          }
+        }
+      }
 
-      // retrieve the compressed bytes blockwise
-      do {
-          zs.next_out = reinterpret_cast<Bytef*>(outbuffer);
-          zs.avail_out = sizeof(outbuffer);
+      std::string key(coding);
+      for (auto& c : key)
+        c = std::tolower(static_cast<unsigned char>(c));
+      q[key] = value;
+    }
 
-          ret = deflate(&zs, Z_FINISH);
+    auto accepted = [&q](const std::string& coding) {
+      auto it = q.find(coding);
+      if (it != q.end())
+        return it->second;
+      auto any = q.find("*");
+      return any != q.end() ? any->second : 0.0;
+    };
 
-          if (outstring.size() < zs.total_out) {
-              // append the block to the output string
-              outstring.append(outbuffer,
-                               zs.total_out - outstring.size());
-          }
-      } while (ret == Z_OK);
+    content_encoding best = content_encoding::identity;
+    double best_q = 0.0;
+    for (auto e : {
+#ifdef KMINDEX_WITH_COMPRESSION
+           content_encoding::zstd,
+#endif
+           content_encoding::gzip,
+           content_encoding::deflate })
+    {
+      double value = accepted(encoding_name(e));
+      if (value > best_q)
+      {
+        best = e;
+        best_q = value;
+      }
+    }
+    return best;
+  }
+
+  const char* encoding_name(content_encoding e)
+  {
+    switch (e)
+    {
+      case content_encoding::deflate:
+        return "deflate";
+      case content_encoding::gzip:
+        return "gzip";
+      case content_encoding::zstd:
+        return "zstd";
+      default:
+        return "identity";
+    }
+  }
 
-      deflateEnd(&zs);
+  stream_compressor::stream_compressor(content_encoding e, const compression_options& opt)
+  {
+    std::memset(&m_zs, 0, sizeof(m_zs));
 
-      if (ret != Z_STREAM_END) {          // an error occurred that was not EOF
-          std::ostringstream oss;
-          oss << "Exception during zlib compression: (" << ret << ") " << zs.msg;
-          throw(std::runtime_error(oss.str()));
+    switch (e)
+    {
+      case content_encoding::deflate:
+      case content_encoding::gzip:
+      {
+        // 15 bits window, +16 for a gzip header and trailer instead of zlib's.
+        int bits = e == content_encoding::gzip ? 15 + 16 : 15;
+        if (deflateInit2(&m_zs, opt.zlib_level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+          throw std::runtime_error("deflateInit failed while compressing.");
+        break;
       }
+      case content_encoding::zstd:
+#ifdef KMINDEX_WITH_COMPRESSION
+        m_zstd = ZSTD_createCStream();
+        if (!m_zstd || ZSTD_isError(ZSTD_CCtx_setParameter(m_zstd, ZSTD_c_compressionLevel, opt.zstd_level)))
+          throw std::runtime_error("ZSTD_createCStream failed while compressing.");
+        break;
+#endif
+      default:
+        throw std::runtime_error(fmt::format("'{}' is not a supported encoding.", encoding_name(e)));
+    }
+  }
+
+  stream_compressor::~stream_compressor()
+  {
+#ifdef KMINDEX_WITH_COMPRESSION
+    if (m_zstd)
+    {
+      ZSTD_freeCStream(m_zstd);
+      return;
+    }
+#endif
+    deflateEnd(&m_zs);
+  }
+
+  void stream_compressor::write(std::string_view data, std::string& out, bool flush)
+  {
+#ifdef KMINDEX_WITH_COMPRESSION
+    if (m_zstd)
+    {
+      zstd_step(data, out, flush ? ZSTD_e_flush : ZSTD_e_continue);
+      return;
+    }
+#endif
+    zlib_step(data, out, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+  }
+
+  void stream_compressor::finish(std::string& out)
+  {
+#ifdef KMINDEX_WITH_COMPRESSION
+    if (m_zstd)
+    {
+      zstd_step({}, out, ZSTD_e_end);
+      return;
+    }
+#endif
+    zlib_step({}, out, Z_FINISH);
+  }
+
+  // Output is written in place at the end of 'out', grown as needed.
+  void stream_compressor::zlib_step(std::string_view data, std::string& out, int mode)
+  {
+    m_zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    m_zs.avail_in = data.size();
+
+    int ret = Z_OK;
+    do {
+      std::size_t start = out.size();
+      std::size_t room = std::max<std::size_t>(deflateBound(&m_zs, m_zs.avail_in), 1 << 12);
+      out.resize(start + room);
+      m_zs.next_out = reinterpret_cast<Bytef*>(out.data() + start);
+      m_zs.avail_out = room;
+
+      ret = deflate(&m_zs, mode);
+      out.resize(start + room - m_zs.avail_out);
+
+      if (ret == Z_STREAM_ERROR)
+        throw std::runtime_error(fmt::format("Exception during zlib compression: ({}) {}",
+                                             ret, m_zs.msg ? m_zs.msg : ""));
+    } while (m_zs.avail_in > 0 || (mode != Z_NO_FLUSH && m_zs.avail_out == 0) ||
+             (mode == Z_FINISH && ret != Z_STREAM_END));
+  }
+
+#ifdef KMINDEX_WITH_COMPRESSION
+  void stream_compressor::zstd_step(std::string_view data, std::string& out, ZSTD_EndDirective mode)
+  {
+    ZSTD_inBuffer in {data.data(), data.size(), 0};
+    std::size_t remaining = 0;
+    do {
+      std::size_t start = out.size();
+      std::size_t room = ZSTD_CStreamOutSize();
+      out.resize(start + room);
+      ZSTD_outBuffer o {out.data() + start, room, 0};
+
+      remaining = ZSTD_compressStream2(m_zstd, &o, &in, mode);
+      out.resize(start + o.pos);
 
-      return outstring;
+      if (ZSTD_isError(remaining))
+        throw std::runtime_error(fmt::format("Exception during zstd compression: {}",
+                                             ZSTD_getErrorName(remaining)));
+    } while (in.pos < in.size || (mode != ZSTD_e_continue && remaining > 0));
   }
+#endif
 }
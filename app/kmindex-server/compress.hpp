@@ -2,11 +2,68 @@
 #define COMPRESS_HPP_YEZUVILH
 
 #include <string>
+#include <string_view>
 #include <zlib.h>
 
+#ifdef KMINDEX_WITH_COMPRESSION
+  #include <zstd.h>
+#endif
+
 namespace kmq {
 
-  std::string compress_string(const std::string& s, int level = Z_BEST_COMPRESSION);
+  enum class content_encoding
+  {
+    identity,
+    deflate,
+    gzip,
+    zstd
+  };
+
+  struct compression_options
+  {
+    // deflate and gzip.
+    int zlib_level {Z_DEFAULT_COMPRESSION};
+    int zstd_level {3};
+    // Smaller responses are sent uncompressed.
+    std::size_t min_size {1024};
+  };
+
+  // Set at startup, read by send_response.
+  compression_options& response_compression();
+
+  // Best encoding accepted by an Accept-Encoding header: highest q-value, then zstd, gzip and
+  // deflate in that order. zstd requires a build with compression features.
+  content_encoding negotiate_encoding(const std::string& accept_encoding);
+
+  const char* encoding_name(content_encoding e);
+
+  // Compresses a response piece by piece. Each write appends the compressed bytes available
+  // so far to 'out', a flush makes everything written decodable by the client (for streamed
+  // responses), and finish ends the stream.
+  class stream_compressor
+  {
+    public:
+      stream_compressor(content_encoding e, const compression_options& opt);
+      ~stream_compressor();
+
+      stream_compressor(const stream_compressor&) = delete;
+      stream_compressor& operator=(const stream_compressor&) = delete;
+
+      void write(std::string_view data, std::string& out, bool flush = false);
+      void finish(std::string& out);
+
+    private:
+      void zlib_step(std::string_view data, std::string& out, int mode);
+#ifdef KMINDEX_WITH_COMPRESSION
+      void zstd_step(std::string_view data, std::string& out, ZSTD_EndDirective mode);
+#endif
+
+    private:
+      z_stream m_zs;
+#ifdef KMINDEX_WITH_COMPRESSION
+      ZSTD_CStream* m_zstd {nullptr};
+#endif
+  };
 
 }
 
@@ -0,0 +1,84 @@
+#ifndef COMPUTE_HPP_R3TWK8ZB
+#define COMPUTE_HPP_R3TWK8ZB
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#include <kmindex/threadpool.hpp>
+
+namespace kmq {
+
+  // Workers solving the lookups of all the requests, separate from the threads handling the
+  // connections. A request runs at most 'max_per_request' tasks at the same time, so that a
+  // request on many sub-indexes does not take all the workers.
+  class compute_pool
+  {
+    public:
+      compute_pool(std::size_t threads, std::size_t max_per_request)
+        : m_max_per_request(std::max<std::size_t>(max_per_request, 1))
+      {
+        if (threads > 0)
+          m_pool = std::make_unique<ThreadPool>(threads);
+      }
+
+      // Call f(i) for each i in [0, n) and wait for completion. Without workers, or for a
+      // single unit, f is called by the calling thread.
+      template<typename Callable>
+      void run(std::size_t n, Callable&& f)
+      {
+        run_with<no_state>(n, [&f](no_state&, std::size_t i) { f(i); });
+      }
+
+      // As run(), calls f(state, i) with a State created for each task and destroyed when the
+      // task is done, e.g. to sample per-thread counters once per task instead of once per unit.
+      template<typename State, typename Callable>
+      void run_with(std::size_t n, Callable&& f)
+      {
+        if (!m_pool || n <= 1)
+        {
+          State state;
+          for (std::size_t i = 0; i < n; ++i)
+            f(state, i);
+          return;
+        }
+
+        // Each task takes the next unit until none is left, the number of tasks bounds the
+        // parallelism of the request.
+        std::atomic<std::size_t> next {0};
+        std::size_t nb_tasks = std::min({n, m_max_per_request, static_cast<std::size_t>(m_pool->size())});
+
+        task_group group;
+        for (std::size_t t = 0; t < nb_tasks; ++t)
+        {
+          m_pool->add_task(group, [&next, n, &f](int) {
+            State state;
+            for (std::size_t i = next++; i < n; i = next++)
+              f(state, i);
+          });
+        }
+        m_pool->wait(group);
+      }
+
+      std::size_t threads() const
+      {
+        return m_pool ? m_pool->size() : 0;
+      }
+
+      std::size_t max_per_request() const
+      {
+        return m_max_per_request;
+      }
+
+    private:
+      struct no_state {};
+
+    private:
+      std::unique_ptr<ThreadPool> m_pool {nullptr};
+      std::size_t m_max_per_request {1};
+  };
+
+}
+
+#endif /* end of include guard: COMPUTE_HPP_R3TWK8ZB */
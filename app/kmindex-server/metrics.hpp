@@ -0,0 +1,424 @@
+#ifndef METRICS_HPP_T2PLX9EA
+#define METRICS_HPP_T2PLX9EA
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+
+namespace kmq {
+
+  // Metrics are updated from many threads on the hot path: values are spread over shards,
+  // a thread always updates the same shard with relaxed atomics, and shards are only summed
+  // when the metrics are exported.
+  constexpr std::size_t metric_shards = 16;
+
+  inline std::size_t metric_shard()
+  {
+    static std::atomic<std::size_t> next {0};
+    thread_local std::size_t shard = next++ % metric_shards;
+    return shard;
+  }
+
+  class counter
+  {
+    struct alignas(64) slot
+    {
+      std::atomic<std::uint64_t> value {0};
+    };
+
+    public:
+      void add(std::uint64_t n = 1)
+      {
+        m_slots[metric_shard()].value.fetch_add(n, std::memory_order_relaxed);
+      }
+
+      std::uint64_t value() const
+      {
+        std::uint64_t v = 0;
+        for (auto& s : m_slots)
+          v += s.value.load(std::memory_order_relaxed);
+        return v;
+      }
+
+    private:
+      std::array<slot, metric_shards> m_slots;
+  };
+
+  class gauge
+  {
+    public:
+      void add(std::int64_t n = 1)
+      {
+        m_value.fetch_add(n, std::memory_order_relaxed);
+      }
+
+      void sub(std::int64_t n = 1)
+      {
+        m_value.fetch_sub(n, std::memory_order_relaxed);
+      }
+
+      std::int64_t value() const
+      {
+        return m_value.load(std::memory_order_relaxed);
+      }
+
+    private:
+      std::atomic<std::int64_t> m_value {0};
+  };
+
+  // Integer observations (nanoseconds, bytes) counted in buckets of increasing upper bounds.
+  // Exported values are multiplied by 'scale' (e.g. 1e-9 for seconds).
+  class histogram
+  {
+    struct alignas(64) shard
+    {
+      std::unique_ptr<std::atomic<std::uint64_t>[]> counts;
+      std::atomic<std::uint64_t> sum {0};
+    };
+
+    public:
+      histogram(std::vector<std::uint64_t> bounds, double scale = 1.0)
+        : m_bounds(std::move(bounds)), m_scale(scale)
+      {
+        for (auto& s : m_shards)
+        {
+          s.counts = std::make_unique<std::atomic<std::uint64_t>[]>(m_bounds.size() + 1);
+          for (std::size_t b = 0; b <= m_bounds.size(); ++b)
+            s.counts[b].store(0, std::memory_order_relaxed);
+        }
+      }
+
+      void observe(std::uint64_t v)
+      {
+        std::size_t b = 0;
+        while (b < m_bounds.size() && v > m_bounds[b])
+          ++b;
+        auto& s = m_shards[metric_shard()];
+        s.counts[b].fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add(v, std::memory_order_relaxed);
+      }
+
+      // Prometheus text format, 'labels' without braces, possibly empty.
+      void write(std::ostream& os, const std::string& name, const std::string& labels) const
+      {
+        std::string sep = labels.empty() ? "" : ",";
+        std::uint64_t cumulative = 0, sum = 0;
+
+        for (std::size_t b = 0; b <= m_bounds.size(); ++b)
+        {
+          for (auto& s : m_shards)
+            cumulative += s.counts[b].load(std::memory_order_relaxed);
+
+          std::string le = b < m_bounds.size() ? fmt::format("{}", m_bounds[b] * m_scale) : "+Inf";
+          os << fmt::format("{}_bucket{{{}{}le=\"{}\"}} {}\n", name, labels, sep, le, cumulative);
+        }
+
+        for (auto& s : m_shards)
+          sum += s.sum.load(std::memory_order_relaxed);
+
+        std::string l = labels.empty() ? "" : fmt::format("{{{}}}", labels);
+        os << fmt::format("{}_sum{} {}\n", name, l, sum * m_scale);
+        os << fmt::format("{}_count{} {}\n", name, l, cumulative);
+      }
+
+    private:
+      std::vector<std::uint64_t> m_bounds;
+      double m_scale {1.0};
+      std::array<shard, metric_shards> m_shards;
+  };
+
+  enum class stage
+  {
+    parse,
+    hash,
+    lookup,
+    reduce,
+    serialize,
+    compress
+  };
+
+  inline constexpr std::array<const char*, 6> stage_names {
+    "parse", "hash", "lookup", "reduce", "serialize", "compress"
+  };
+
+  enum class endpoint
+  {
+    query,
+    bulk
+  };
+
+  inline constexpr std::array<const char*, 2> endpoint_names {
+    "query", "bulk"
+  };
+
+  enum class lane
+  {
+    small,
+    large
+  };
+
+  inline constexpr std::array<const char*, 2> lane_names {
+    "small", "large"
+  };
+
+  // 10us to ~10s, in ns.
+  inline std::vector<std::uint64_t> latency_bounds()
+  {
+    std::vector<std::uint64_t> b;
+    for (std::uint64_t ns = 10000; ns <= 10000000000; ns *= 4)
+      b.push_back(ns);
+    return b;
+  }
+
+  struct lane_metrics
+  {
+    histogram wait {latency_bounds(), 1e-9};
+    gauge depth;
+    counter rejected;
+    counter expired;
+  };
+
+  // Lookups in the partitions of a sub-index. Page faults are those of the threads during
+  // the lookups, bytes are the rows fetched.
+  struct index_metrics
+  {
+    counter lookups;
+    counter bytes_read;
+    counter minor_faults;
+    counter major_faults;
+  };
+
+  struct endpoint_metrics
+  {
+    counter requests;
+    counter errors;
+    histogram request_bytes {size_bounds()};
+    histogram response_bytes {size_bounds()};
+
+    static std::vector<std::uint64_t> size_bounds()
+    {
+      std::vector<std::uint64_t> b;
+      for (std::uint64_t s = 256; s <= (std::uint64_t{1} << 30); s *= 4)
+        b.push_back(s);
+      return b;
+    }
+  };
+
+  class server_metrics
+  {
+    public:
+      server_metrics()
+      {
+        for (auto& s : m_stages)
+          s = std::make_unique<histogram>(latency_bounds(), 1e-9);
+      }
+
+      histogram& stage(enum stage s)
+      {
+        return *m_stages[static_cast<std::size_t>(s)];
+      }
+
+      endpoint_metrics& endpoint(enum endpoint e)
+      {
+        return m_endpoints[static_cast<std::size_t>(e)];
+      }
+
+      gauge& inflight()
+      {
+        return m_inflight;
+      }
+
+      lane_metrics& lane(enum lane l)
+      {
+        return m_lanes[static_cast<std::size_t>(l)];
+      }
+
+      counter& partial()
+      {
+        return m_partial;
+      }
+
+      counter& cancelled()
+      {
+        return m_cancelled;
+      }
+
+      // Sub-indexes are registered at startup and on reloads, metrics of removed sub-indexes
+      // are kept.
+      void add_index(const std::string& name)
+      {
+        std::unique_lock<std::shared_mutex> lock(m_indexes_mutex);
+        if (!m_indexes.count(name))
+          m_indexes.emplace(name, std::make_unique<index_metrics>());
+      }
+
+      index_metrics* index(const std::string& name)
+      {
+        std::shared_lock<std::shared_mutex> lock(m_indexes_mutex);
+        auto it = m_indexes.find(name);
+        return it == m_indexes.end() ? nullptr : it->second.get();
+      }
+
+      void write(std::ostream& os) const
+      {
+        os << "# HELP kmindex_requests_total Requests received.\n"
+              "# TYPE kmindex_requests_total counter\n";
+        for (std::size_t e = 0; e < m_endpoints.size(); ++e)
+          os << fmt::format("kmindex_requests_total{{endpoint=\"{}\"}} {}\n",
+                            endpoint_names[e], m_endpoints[e].requests.value());
+
+        os << "# HELP kmindex_request_errors_total Requests rejected or failed.\n"
+              "# TYPE kmindex_request_errors_total counter\n";
+        for (std::size_t e = 0; e < m_endpoints.size(); ++e)
+          os << fmt::format("kmindex_request_errors_total{{endpoint=\"{}\"}} {}\n",
+                            endpoint_names[e], m_endpoints[e].errors.value());
+
+        os << "# HELP kmindex_request_bytes Size of the request bodies.\n"
+              "# TYPE kmindex_request_bytes histogram\n";
+        for (std::size_t e = 0; e < m_endpoints.size(); ++e)
+          m_endpoints[e].request_bytes.write(
+            os, "kmindex_request_bytes", fmt::format("endpoint=\"{}\"", endpoint_names[e]));
+
+        os << "# HELP kmindex_response_bytes Size of the responses, before compression.\n"
+              "# TYPE kmindex_response_bytes histogram\n";
+        for (std::size_t e = 0; e < m_endpoints.size(); ++e)
+          m_endpoints[e].response_bytes.write(
+            os, "kmindex_response_bytes", fmt::format("endpoint=\"{}\"", endpoint_names[e]));
+
+        os << "# HELP kmindex_inflight_requests Requests being solved, queued requests excluded.\n"
+              "# TYPE kmindex_inflight_requests gauge\n";
+        os << fmt::format("kmindex_inflight_requests {}\n", m_inflight.value());
+
+        os << "# HELP kmindex_partial_responses_total Responses cut by their deadline.\n"
+              "# TYPE kmindex_partial_responses_total counter\n";
+        os << fmt::format("kmindex_partial_responses_total {}\n", m_partial.value());
+
+        os << "# HELP kmindex_cancelled_requests_total Requests cancelled after a connection error.\n"
+              "# TYPE kmindex_cancelled_requests_total counter\n";
+        os << fmt::format("kmindex_cancelled_requests_total {}\n", m_cancelled.value());
+
+        os << "# HELP kmindex_queue_depth Requests waiting in the scheduler queues.\n"
+              "# TYPE kmindex_queue_depth gauge\n";
+        for (std::size_t l = 0; l < m_lanes.size(); ++l)
+          os << fmt::format("kmindex_queue_depth{{lane=\"{}\"}} {}\n", lane_names[l], m_lanes[l].depth.value());
+
+        os << "# HELP kmindex_queue_rejected_total Requests rejected because the queue was full (429).\n"
+              "# TYPE kmindex_queue_rejected_total counter\n";
+        for (std::size_t l = 0; l < m_lanes.size(); ++l)
+          os << fmt::format("kmindex_queue_rejected_total{{lane=\"{}\"}} {}\n", lane_names[l], m_lanes[l].rejected.value());
+
+        os << "# HELP kmindex_queue_expired_total Requests dropped after waiting too long (503).\n"
+              "# TYPE kmindex_queue_expired_total counter\n";
+        for (std::size_t l = 0; l < m_lanes.size(); ++l)
+          os << fmt::format("kmindex_queue_expired_total{{lane=\"{}\"}} {}\n", lane_names[l], m_lanes[l].expired.value());
+
+        os << "# HELP kmindex_queue_wait_seconds Time spent by requests in the scheduler queues.\n"
+              "# TYPE kmindex_queue_wait_seconds histogram\n";
+        for (std::size_t l = 0; l < m_lanes.size(); ++l)
+          m_lanes[l].wait.write(os, "kmindex_queue_wait_seconds", fmt::format("lane=\"{}\"", lane_names[l]));
+
+        os << "# HELP kmindex_stage_seconds Time spent in each stage of the requests.\n"
+              "# TYPE kmindex_stage_seconds histogram\n";
+        for (std::size_t s = 0; s < m_stages.size(); ++s)
+          m_stages[s]->write(os, "kmindex_stage_seconds", fmt::format("stage=\"{}\"", stage_names[s]));
+
+        write_index_counter(os, "kmindex_index_lookups_total", "S-mers looked up.",
+                            &index_metrics::lookups);
+        write_index_counter(os, "kmindex_index_bytes_read_total", "Bytes of the rows fetched.",
+                            &index_metrics::bytes_read);
+        write_index_counter(os, "kmindex_index_minor_faults_total", "Minor page faults during lookups.",
+                            &index_metrics::minor_faults);
+        write_index_counter(os, "kmindex_index_major_faults_total", "Major page faults during lookups.",
+                            &index_metrics::major_faults);
+      }
+
+    private:
+      void write_index_counter(std::ostream& os,
+                               const std::string& name,
+                               const std::string& help,
+                               counter index_metrics::* c) const
+      {
+        os << fmt::format("# HELP {} {}\n# TYPE {} counter\n", name, help, name);
+        std::shared_lock<std::shared_mutex> lock(m_indexes_mutex);
+        for (auto& [index, m] : m_indexes)
+          os << fmt::format("{}{{index=\"{}\"}} {}\n", name, index, ((*m).*c).value());
+      }
+
+    private:
+      std::array<std::unique_ptr<histogram>, stage_names.size()> m_stages;
+      std::array<endpoint_metrics, endpoint_names.size()> m_endpoints;
+      gauge m_inflight;
+      counter m_partial;
+      counter m_cancelled;
+      std::array<lane_metrics, lane_names.size()> m_lanes;
+      mutable std::shared_mutex m_indexes_mutex;
+      std::map<std::string, std::unique_ptr<index_metrics>> m_indexes;
+  };
+
+  inline server_metrics& metrics()
+  {
+    static server_metrics m;
+    return m;
+  }
+
+  // Adds the lifetime of the timer, or the time until stop(), to a stage.
+  class stage_timer
+  {
+    public:
+      stage_timer(enum stage s)
+        : m_histogram(metrics().stage(s)), m_start(std::chrono::steady_clock::now()) {}
+
+      ~stage_timer()
+      {
+        stop();
+      }
+
+      stage_timer(const stage_timer&) = delete;
+      stage_timer& operator=(const stage_timer&) = delete;
+
+      void stop()
+      {
+        if (m_stopped)
+          return;
+        m_stopped = true;
+        m_histogram.observe(std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - m_start).count());
+      }
+
+    private:
+      histogram& m_histogram;
+      std::chrono::steady_clock::time_point m_start;
+      bool m_stopped {false};
+  };
+
+  // Counts a request as in flight during its lifetime.
+  class inflight_scope
+  {
+    public:
+      inflight_scope()
+      {
+        metrics().inflight().add();
+      }
+
+      ~inflight_scope()
+      {
+        metrics().inflight().sub();
+      }
+
+      inflight_scope(const inflight_scope&) = delete;
+      inflight_scope& operator=(const inflight_scope&) = delete;
+  };
+
+}
+
+#endif /* end of include guard: METRICS_HPP_T2PLX9EA */
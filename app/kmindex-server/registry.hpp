@@ -0,0 +1,324 @@
+#ifndef REGISTRY_HPP_Q8MWX3TD
+#define REGISTRY_HPP_Q8MWX3TD
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+
+#include <sys/resource.h>
+
+#include <kmindex/exceptions.hpp>
+#include <kmindex/index/index.hpp>
+#include <kmindex/index/kindex.hpp>
+#include <kmindex/index/partition_cache.hpp>
+#include <kmindex/threadpool.hpp>
+#include <kmindex/utils.hpp>
+
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "metrics.hpp"
+
+namespace fs = std::filesystem;
+
+namespace kmq {
+
+  // Page faults of the calling thread during lookups, attributed to the sub-index looked up.
+  // Sampled when the sub-index changes and when the task is done, not for each partition.
+  class lookup_faults
+  {
+    public:
+      lookup_faults() = default;
+      lookup_faults(const lookup_faults&) = delete;
+      lookup_faults& operator=(const lookup_faults&) = delete;
+
+      ~lookup_faults()
+      {
+        flush();
+      }
+
+      void enter(index_metrics* m)
+      {
+        if (m == m_current)
+          return;
+        flush();
+        m_current = m;
+#ifdef RUSAGE_THREAD
+        if (m_current)
+          getrusage(RUSAGE_THREAD, &m_before);
+#endif
+      }
+
+    private:
+      void flush()
+      {
+#ifdef RUSAGE_THREAD
+        if (m_current)
+        {
+          rusage after;
+          getrusage(RUSAGE_THREAD, &after);
+          m_current->minor_faults.add(after.ru_minflt - m_before.ru_minflt);
+          m_current->major_faults.add(after.ru_majflt - m_before.ru_majflt);
+        }
+#endif
+        m_current = nullptr;
+      }
+
+    private:
+      index_metrics* m_current {nullptr};
+#ifdef RUSAGE_THREAD
+      rusage m_before;
+#endif
+  };
+
+  // Sub-indexes of the server, shared by all the requests. Without a cache budget, long-lived
+  // kindex instances map the uncompressed partitions once at startup, optionally loaded in
+  // memory. Compressed sub-indexes keep opening their partitions on each lookup.
+  // With a budget, partitions of all the sub-indexes are opened on demand in a partition_cache.
+  // A registry is immutable, reloads build a new one from the previous: unchanged sub-indexes
+  // keep their kindex instances, and the partition cache is shared.
+  class kindex_registry
+  {
+    public:
+      kindex_registry(index& global,
+                      bool prefault,
+                      std::size_t cache_budget,
+                      cache_policy policy,
+                      std::size_t nb_threads,
+                      const kindex_registry* previous = nullptr)
+      {
+        Timer timer;
+
+        m_generation = previous ? previous->m_generation + 1 : 0;
+        load_infos(global.path());
+
+        for (auto& [name, infos] : global)
+          m_stamps.emplace(name, stamp(infos));
+
+        if (cache_budget > 0)
+        {
+          if (prefault && !previous)
+            spdlog::warn("--prefault is ignored with --cache-budget.");
+
+          if (previous && previous->m_cache)
+            m_cache = previous->m_cache;
+          else
+            m_cache = std::make_shared<partition_cache>(cache_budget, policy);
+
+          for (auto& [name, infos] : global)
+          {
+            m_infos.emplace(name, infos);
+            metrics().add_index(name);
+          }
+
+          // Partitions of the sub-indexes changed or removed are not valid anymore.
+          if (previous)
+            for (auto& [name, infos] : previous->m_infos)
+              if (!unchanged(*previous, name))
+                m_cache->drop(infos);
+
+          resolve();
+          spdlog::info("{} sub-indexes registered, partitions cached within {} MB.",
+                       m_infos.size(), cache_budget >> 20);
+          return;
+        }
+
+        std::vector<kindex*> kis;
+        std::size_t kept = 0;
+        for (auto& [name, infos] : global)
+        {
+          if (previous && unchanged(*previous, name))
+          {
+            m_indexes.emplace(name, previous->m_indexes.at(name));
+            kept++;
+            continue;
+          }
+
+          auto& ki = m_indexes.emplace(name, std::make_shared<kindex>(infos, true)).first->second;
+          kis.push_back(ki.get());
+          metrics().add_index(name);
+        }
+
+        if (prefault)
+        {
+          ThreadPool pool(nb_threads);
+          pool.parallel_for(0, kis.size(), [&kis](int, std::size_t i){
+            kis[i]->prefault();
+          });
+        }
+
+        resolve();
+        spdlog::info("{} sub-indexes mapped{}, {} kept warm ({}).",
+                     kis.size(), prefault ? " and prefaulted" : "", kept, timer.formatted());
+      }
+
+      // Instances point into the registry.
+      kindex_registry(const kindex_registry&) = delete;
+      kindex_registry& operator=(const kindex_registry&) = delete;
+
+      const index_infos& infos(const std::string& name) const
+      {
+        return *get(name).infos;
+      }
+
+      // Lookups of partition p of sub-index 'name'. Page faults are sampled by 'faults', shared
+      // by the lookups of a task.
+      void solve(const std::string& name, batch_query& bq, std::size_t p, lookup_faults& faults) const
+      {
+        const instance& in = get(name);
+        faults.enter(in.metrics);
+
+        if (m_cache)
+          m_cache->solve(*in.infos, bq, p);
+        else
+          in.ki->solve_partition(bq, p);
+
+        if (in.metrics)
+        {
+          std::size_t n = bq.partition(p).size();
+          in.metrics->lookups.add(n);
+          in.metrics->bytes_read.add(n * in.row_bytes);
+        }
+      }
+
+      // nullptr without a cache budget.
+      const partition_cache* cache() const
+      {
+        return m_cache.get();
+      }
+
+      std::size_t size() const
+      {
+        return m_stamps.size();
+      }
+
+      // Incremented by each reload, results computed on a previous generation are stale.
+      std::uint64_t generation() const
+      {
+        return m_generation;
+      }
+
+      // Content of 'index.json' without local paths, served by /kmindex/infos.
+      const std::string& infos_json() const
+      {
+        return m_infos_json;
+      }
+
+    private:
+      // Resolved once per registry, found for each partition lookup.
+      struct instance
+      {
+        const index_infos* infos {nullptr};
+        kindex* ki {nullptr};
+        index_metrics* metrics {nullptr};
+        std::size_t row_bytes {0};
+      };
+
+      const instance& get(const std::string& name) const
+      {
+        auto it = m_instances.find(name);
+        if (it == m_instances.end())
+          throw_unknown(name);
+        return it->second;
+      }
+
+      void resolve()
+      {
+        auto add = [this](const std::string& name, const index_infos& infos, kindex* ki) {
+          m_instances.emplace(name, instance {
+            &infos, ki, metrics().index(name), (infos.nb_samples() * infos.bw() + 7) / 8 });
+        };
+
+        for (auto& [name, infos] : m_infos)
+          add(name, infos, nullptr);
+        for (auto& [name, ki] : m_indexes)
+          add(name, ki->infos(), ki.get());
+      }
+
+      [[noreturn]] static void throw_unknown(const std::string& name)
+      {
+        throw kmq_invalid_index(fmt::format("'{}' is not registered by this instance", name));
+      }
+
+      // Identifies the files of a sub-index: same location, configuration, samples and
+      // partitions last written at the same time.
+      struct index_stamp
+      {
+        std::string path;
+        std::string sha1;
+        std::vector<std::string> samples;
+        fs::file_time_type mtime;
+
+        bool operator==(const index_stamp& other) const
+        {
+          return path == other.path && sha1 == other.sha1 &&
+                 samples == other.samples && mtime == other.mtime;
+        }
+      };
+
+      static index_stamp stamp(const index_infos& infos)
+      {
+        std::error_code ec;
+        auto mtime = fs::last_write_time(infos.get_partition(0), ec);
+        return {infos.path(), infos.sha1(), infos.samples(), ec ? fs::file_time_type::min() : mtime};
+      }
+
+      // True if 'name' is registered by both registries with the same files.
+      bool unchanged(const kindex_registry& previous, const std::string& name) const
+      {
+        auto prev = previous.m_stamps.find(name);
+        auto curr = m_stamps.find(name);
+        return prev != previous.m_stamps.end() && curr != m_stamps.end() && prev->second == curr->second;
+      }
+
+      void load_infos(const std::string& index_path)
+      {
+        std::ifstream inf(fmt::format("{}/index.json", index_path), std::ios::in);
+        nlohmann::json data = nlohmann::json::parse(inf);
+        data.erase("path");
+        m_infos_json = data.dump(4);
+      }
+
+    private:
+      std::map<std::string, std::shared_ptr<kindex>> m_indexes;
+      std::map<std::string, index_infos> m_infos;
+      std::unordered_map<std::string, instance> m_instances;
+      std::map<std::string, index_stamp> m_stamps;
+      std::shared_ptr<partition_cache> m_cache {nullptr};
+      std::string m_infos_json;
+      std::uint64_t m_generation {0};
+  };
+
+  using registry_t = std::shared_ptr<const kindex_registry>;
+
+  // Current registry of the server. Requests take a reference to the registry when they start
+  // and keep it until they are done, a reload swaps the registry without waiting for them.
+  class registry_handle
+  {
+    public:
+      registry_handle(registry_t registry)
+        : m_registry(std::move(registry)) {}
+
+      registry_t get() const
+      {
+        return std::atomic_load(&m_registry);
+      }
+
+      void set(registry_t registry)
+      {
+        std::atomic_store(&m_registry, std::move(registry));
+      }
+
+    private:
+      registry_t m_registry {nullptr};
+  };
+
+}
+
+#endif /* end of include guard: REGISTRY_HPP_Q8MWX3TD */
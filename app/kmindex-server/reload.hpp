@@ -0,0 +1,151 @@
+#ifndef RELOAD_HPP_C6XBN2QE
+#define RELOAD_HPP_C6XBN2QE
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+  #include <poll.h>
+  #include <sys/inotify.h>
+  #include <unistd.h>
+#endif
+
+#include <kmindex/index/index.hpp>
+#include <kmindex/index/partition_cache.hpp>
+#include <kmindex/utils.hpp>
+
+#include <spdlog/spdlog.h>
+
+#include "registry.hpp"
+
+namespace kmq {
+
+  struct reload_options
+  {
+    std::string index_path;
+    bool prefault {false};
+    std::size_t cache_budget {0};
+    cache_policy policy {cache_policy::lru};
+    std::size_t nb_threads {1};
+  };
+
+  // Builds a new registry from 'index.json' and swaps it in, on demand or when the file is
+  // written (Linux only). The new registry is built while the current one keeps serving.
+  class registry_reloader
+  {
+    public:
+      registry_reloader(registry_handle& handle, const reload_options& opt)
+        : m_handle(handle), m_opt(opt) {}
+
+      ~registry_reloader()
+      {
+        m_stop = true;
+        if (m_watcher.joinable())
+          m_watcher.join();
+#ifdef __linux__
+        if (m_fd >= 0)
+          ::close(m_fd);
+#endif
+      }
+
+      registry_reloader(const registry_reloader&) = delete;
+      registry_reloader& operator=(const registry_reloader&) = delete;
+
+      // Throws if the index cannot be loaded, the current registry is then kept.
+      registry_t reload()
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        Timer timer;
+
+        registry_t current = m_handle.get();
+        index global(m_opt.index_path);
+        auto next = std::make_shared<const kindex_registry>(
+          global, m_opt.prefault, m_opt.cache_budget, m_opt.policy, m_opt.nb_threads, current.get());
+        m_handle.set(next);
+
+        spdlog::info("Registry reloaded, {} sub-indexes ({}).", next->size(), timer.formatted());
+        return next;
+      }
+
+      // Reloads when 'index.json' is written or replaced. Events within 'delay' are merged,
+      // an index update usually writes the file more than once.
+      void watch(std::chrono::milliseconds delay = std::chrono::milliseconds(200))
+      {
+#ifdef __linux__
+        m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_fd < 0 || inotify_add_watch(m_fd, m_opt.index_path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        {
+          spdlog::warn("Unable to watch {} ({}), use /kmindex/reload.", m_opt.index_path, std::strerror(errno));
+          return;
+        }
+
+        m_watcher = std::thread([this, delay]() {
+          bool pending = false;
+          auto last = std::chrono::steady_clock::now();
+          while (!m_stop)
+          {
+            pollfd pfd {m_fd, POLLIN, 0};
+            if (::poll(&pfd, 1, 100) > 0 && changed())
+            {
+              pending = true;
+              last = std::chrono::steady_clock::now();
+            }
+
+            if (pending && std::chrono::steady_clock::now() - last >= delay)
+            {
+              pending = false;
+              try {
+                reload();
+              } catch (const std::exception& e) {
+                spdlog::error("Reload failed, previous registry kept -> {}", e.what());
+              }
+            }
+          }
+        });
+        spdlog::info("Watching {}/index.json.", m_opt.index_path);
+#else
+        (void)delay;
+        spdlog::warn("--watch is only supported on Linux, use /kmindex/reload.");
+#endif
+      }
+
+    private:
+#ifdef __linux__
+      // Drains the pending events, true if one of them is about 'index.json'.
+      bool changed()
+      {
+        alignas(inotify_event) char buffer[4096];
+        bool found = false;
+        ssize_t n = 0;
+        while ((n = ::read(m_fd, buffer, sizeof(buffer))) > 0)
+        {
+          for (char* p = buffer; p < buffer + n;)
+          {
+            auto* e = reinterpret_cast<inotify_event*>(p);
+            if (e->len > 0 && std::strcmp(e->name, "index.json") == 0)
+              found = true;
+            p += sizeof(inotify_event) + e->len;
+          }
+        }
+        return found;
+      }
+#endif
+
+    private:
+      registry_handle& m_handle;
+      reload_options m_opt;
+
+      std::mutex m_mutex;
+      std::thread m_watcher;
+      std::atomic<bool> m_stop {false};
+      int m_fd {-1};
+  };
+
+}
+
+#endif /* end of include guard: RELOAD_HPP_C6XBN2QE */
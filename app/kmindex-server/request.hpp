@@ -2,15 +2,30 @@
 #define REQUEST_HPP_NZPDLF91
 
 #include <kmindex/exceptions.hpp>
+#include <kmindex/fastx.hpp>
 #include <kmindex/index/index.hpp>
 #include <kmindex/index/kindex.hpp>
 #include <kmindex/query/format.hpp>
 #include <kmindex/query/query_results.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+
 #include <nlohmann/json.hpp>
+#include <simdjson.h>
+#include <xxhash.h>
 
 #include <spdlog/spdlog.h>
 
+#include "batcher.hpp"
+#include "compute.hpp"
+#include "metrics.hpp"
+#include "registry.hpp"
+#include "result_cache.hpp"
 #include "utils.hpp"
 
 using json = nlohmann::json;
@@ -20,52 +35,122 @@ namespace kmq {
   class request
   {
     public:
-      request(const json& data)
+      // Sequences are views into the parser buffers and into the unescaped 'fastx' payload, both
+      // owned by the request. 'buffer' is the raw body. 'deadline_ms' applies when the body has
+      // no 'deadline_ms' entry, 0 = none. Deadlines count from the construction.
+      request(simdjson::padded_string&& buffer, std::size_t deadline_ms = 0)
+        : m_buffer(std::move(buffer)),
+          m_received(std::chrono::steady_clock::now()),
+          m_deadline_ms(deadline_ms)
+      {
+        parse_json();
+      }
+
+      request(const request&) = delete;
+      request& operator=(const request&) = delete;
+
+      // Identifies the response of a request: the same normalized request gives the same
+      // response on the same registry generation. Must be called before solve(), which parses
+      // 'fastx' in place. Only complete responses are cached, requests with a deadline only
+      // differ by the 'coverage' entry.
+      result_key cache_hash() const
+      {
+        std::unique_ptr<XXH3_state_t, decltype(&XXH3_freeState)> state(XXH3_createState(), XXH3_freeState);
+        XXH3_128bits_reset(state.get());
+        normalize([&state](std::string_view s){
+          XXH3_128bits_update(state.get(), s.data(), s.size());
+        });
+        XXH128_hash_t h = XXH3_128bits_digest(state.get());
+        return {h.low64, h.high64};
+      }
+
+      // Normalized request, kept by the cache to tell hash collisions apart.
+      std::string cache_key() const
       {
-        parse_json(data);
+        std::string key;
+        normalize([&key](std::string_view s){
+          key.append(s);
+        });
+        return key;
       }
 
-      std::string solve(const index& gindex) const
+      // Compares to a normalized request without building it.
+      bool same_cache_key(std::string_view key) const
       {
-        return m_json ? solve_json(gindex) : solve_tsv(gindex);
+        bool same = true;
+        normalize([&same, &key](std::string_view s){
+          same = same && key.compare(0, s.size(), s) == 0;
+          if (same)
+            key.remove_prefix(s.size());
+        });
+        return same && key.empty();
       }
 
-      std::string solve_json(const index& gindex) const
+      // Estimated work: sequence length x samples, summed over the sub-indexes. The 'fastx'
+      // payload size stands for the sequence length before it is parsed.
+      std::uint64_t cost(const kindex_registry& registry) const
       {
-        std::vector<json> responses;
+        std::uint64_t bp = m_fastx.size();
+        for (auto& s : m_seq)
+          bp += s.size();
 
+        std::uint64_t samples = 0;
         for (auto& i : m_index)
-        {
-          auto infos = gindex.get(i);
-          kindex ki(infos);
-          //smer_hasher sh(infos.get_repartition(), infos.get_hash_w(), infos.minim_size());
-
-          batch_query bq(
-            infos.nb_samples(),
-            infos.nb_partitions(),
-            infos.smer_size(),
-            m_z,
-            infos.bw(),
-            infos.get_repartition(),
-            infos.get_hash_w(),
-            infos.minim_size());
-
-          for (auto& s : m_seq)
-          {
-            if (s.size() < (infos.smer_size() + m_z))
-              throw kmq_invalid_request(
-                  fmt::format(
-                    "Sequence too small: {}, min size is {}.", s.size(), infos.smer_size() + m_z));
-            bq.add_query(m_name, s);
-          }
+          samples += registry.infos(i).nb_samples();
+
+        return bp * samples;
+      }
+
+      const std::string& name() const
+      {
+        return m_name;
+      }
+
+      const std::vector<std::string>& indexes() const
+      {
+        return m_index;
+      }
+
+      // Stops the lookups of the request as soon as possible, solve() then throws.
+      void cancel()
+      {
+        m_cancelled = true;
+      }
+
+      // False if the deadline was reached before all the partitions were looked up.
+      bool complete() const
+      {
+        return m_complete;
+      }
+
+      // Fraction of the k-mers covered by the results, for each sub-index. Set by solve().
+      const std::vector<double>& coverage() const
+      {
+        return m_coverage;
+      }
+
+      // Without a compute pool, the request is solved by the calling thread.
+      std::string solve(const kindex_registry& registry,
+                        request_batcher* batcher = nullptr,
+                        compute_pool* compute = nullptr)
+      {
+        if (!m_fastx.empty() && m_seq.empty())
+          parse_fastx_payload();
+        return m_json ? solve_json(registry, batcher, compute) : solve_tsv(registry, batcher, compute);
+      }
 
-          for (std::size_t p = 0; p < infos.nb_partitions(); ++p)
-            ki.solve_one(bq, p);
+      std::string solve_json(const kindex_registry& registry,
+                             request_batcher* batcher,
+                             compute_pool* compute)
+      {
+        auto aggs = reduce(registry, compute, lookup(registry, batcher, compute, true),
+                           m_format != format::json);
 
-          query_result_agg agg;
-          for (auto&& r : bq.response())
-            agg.add(query_result(std::move(r), m_z, infos, (m_format == format::json) ? false: true));
+        stage_timer timer(stage::serialize);
+        std::vector<json> responses(m_index.size());
 
+        run(compute, m_index.size(), [&](std::size_t i) {
+          const index_infos& infos = registry.infos(m_index[i]);
 
           std::ofstream nullstream; nullstream.setstate(std::ios_base::badbit);
 
@@ -74,140 +159,376 @@ namespace kmq {
                 make_formatter(m_format, m_r, infos.bw()));
 
           if (m_seq.size() == 1)
-            jformat->format(infos, agg.results()[0], nullstream);
+            jformat->format(infos, aggs[i].results()[0], nullstream);
           else
-            jformat->merge_format(infos, m_name, agg.results(), nullstream);
+            jformat->merge_format(infos, m_name, aggs[i].results(), nullstream);
 
-          responses.push_back(jformat->get_json());
-        }
+          responses[i] = jformat->get_json();
+        });
 
         json response;
         for (auto& r : responses)
           response.update(r);
 
+        if (m_deadline_ms > 0)
+        {
+          json& coverage = response["coverage"];
+          for (std::size_t i = 0; i < m_index.size(); ++i)
+            coverage[m_index[i]] = m_coverage[i];
+        }
+
         return response.dump(4);
       }
 
-      std::string solve_tsv(const index& gindex) const
+      std::string solve_tsv(const kindex_registry& registry,
+                            request_batcher* batcher,
+                            compute_pool* compute)
       {
-        std::stringstream ss;
+        auto aggs = reduce(registry, compute, lookup(registry, batcher, compute, false), false);
 
-        for (auto& i : m_index)
-        {
-          auto infos = gindex.get(i);
-          kindex ki(infos);
-          //smer_hasher sh(infos.get_repartition(), infos.get_hash_w(), infos.minim_size());
-
-          batch_query bq(
-            infos.nb_samples(),
-            infos.nb_partitions(),
-            infos.smer_size(),
-            m_z,
-            infos.bw(),
-            infos.get_repartition(),
-            infos.get_hash_w(),
-            infos.minim_size());
-
-          for (auto& s : m_seq)
-            bq.add_query(m_name, s);
-
-          for (std::size_t p = 0; p < infos.nb_partitions(); ++p)
-            ki.solve_one(bq, p);
-
-          query_result_agg agg;
-          for (auto&& r : bq.response())
-            agg.add(query_result(std::move(r), m_z, infos));
+        stage_timer timer(stage::serialize);
+        std::vector<std::stringstream> outputs(m_index.size());
 
+        run(compute, m_index.size(), [&](std::size_t i) {
+          const index_infos& infos = registry.infos(m_index[i]);
           auto tformat = make_formatter(format::matrix, m_r, infos.bw());
-          tformat->merge_format(infos, m_name, agg.results(), ss);
-          ss << '\n';
-        }
+          tformat->merge_format(infos, m_name, aggs[i].results(), outputs[i]);
+          outputs[i] << '\n';
+        });
+
+        std::stringstream ss;
+        for (auto& o : outputs)
+          ss << o.rdbuf();
 
         return ss.str();
       }
 
     private:
+      using batch_map = std::unordered_map<std::string, smer_batch_t>;
 
-      void parse_json(const json& data)
+      template<typename F>
+      void normalize(F&& append) const
       {
-        if (!data.contains("index"))
-          throw kmq_invalid_request("'index' entry is missing.");
-        if (!data.contains("id"))
-          throw kmq_invalid_request("'id' entry is missing.");
-        if (!data.contains("seq") && !data.contains("fastx"))
-          throw kmq_invalid_request("'seq' or 'fastx' should be specified.");
-        if (data.contains("seq") && data.contains("fastx"))
-          throw kmq_invalid_request("'seq' and 'fastx' are mutually exclusive.");
+        append(m_name);
+        append("\n");
+        for (auto& i : m_index)
+        {
+          append(i);
+          append(",");
+        }
+        append("\n");
+        for (auto& s : m_seq)
+        {
+          append(s);
+          append(",");
+        }
+        append("\n");
+        append(m_fastx);
+        append("\n");
+        append(fmt::format("{}\n{}\n{}\n{}", m_z, m_r, m_json ? static_cast<int>(m_format) : -1, m_deadline_ms > 0));
+      }
 
-        if (!data.contains("z"))
-          throw kmq_invalid_request("'z' entry is missing.");
+      template<typename Callable>
+      static void run(compute_pool* compute, std::size_t n, Callable&& f)
+      {
+        if (compute)
+          compute->run(n, std::forward<Callable>(f));
+        else
+          for (std::size_t i = 0; i < n; ++i)
+            f(i);
+      }
 
-        if (!data.contains("format"))
+      template<typename State, typename Callable>
+      static void run_with(compute_pool* compute, std::size_t n, Callable&& f)
+      {
+        if (compute)
         {
-          m_json = true;
-          m_format = format::json;
+          compute->run_with<State>(n, std::forward<Callable>(f));
+          return;
         }
-        else
+        State state;
+        for (std::size_t i = 0; i < n; ++i)
+          f(state, i);
+      }
+
+      std::vector<query_result_agg> reduce(const kindex_registry& registry,
+                                           compute_pool* compute,
+                                           std::vector<std::vector<query_response_t>>&& lookups,
+                                           bool pos)
+      {
+        stage_timer timer(stage::reduce);
+        std::vector<query_result_agg> aggs(m_index.size());
+
+        run(compute, m_index.size(), [&](std::size_t i) {
+          const index_infos& infos = registry.infos(m_index[i]);
+          for (auto&& r : lookups[i])
+            aggs[i].add(query_result(std::move(r), m_z, infos, pos));
+        });
+
+        m_coverage.assign(m_index.size(), 1.0);
+        for (std::size_t i = 0; i < m_index.size(); ++i)
         {
-          if (data["format"] == "json" || data["format"] == "json_vec")
+          std::size_t resolved = 0, total = 0;
+          for (auto& r : aggs[i].results())
           {
-            m_json = true;
-            m_format = str_to_format(data["format"]);
+            resolved += r.nbk();
+            total += r.nbk_total();
           }
-          else if (data["format"] == "tsv")
-            m_json = false;
-          else
-            throw kmq_invalid_request(
-              fmt::format("'format':'{}' not supported, should be 'json' or 'tsv'.", data["format"]));
+          if (total > 0)
+            m_coverage[i] = resolved / static_cast<double>(total);
         }
 
-        if (data.contains("r"))
+        return aggs;
+      }
+
+      bool expired() const
+      {
+        return m_cancelled.load(std::memory_order_relaxed) ||
+               (m_deadline_ms > 0 &&
+                std::chrono::steady_clock::now() >= m_received + std::chrono::milliseconds(m_deadline_ms));
+      }
+
+      // Responses of the request sequences, for each sub-index of the request. The lookups of
+      // all the (sub-index, partition) pairs are independent and run on the compute pool.
+      // With a batcher, the lookups are shared with the concurrent requests on the same
+      // sub-index, and the sub-indexes are processed in turn. Requests with a deadline are not
+      // batched: their partitions are looked up largest first, until the deadline is reached.
+      std::vector<std::vector<query_response_t>> lookup(const kindex_registry& registry,
+                                                        request_batcher* batcher,
+                                                        compute_pool* compute,
+                                                        bool check)
+      {
+        std::vector<std::vector<query_response_t>> lookups(m_index.size());
+
+        if (batcher && m_deadline_ms == 0)
         {
-          if (!data["r"].is_number())
-            throw kmq_invalid_request(
-              fmt::format("'r' should be a float in [0.0, 1.0]"));
-          m_r = data["r"].get<double>();
-          if (m_r < 0.0 || m_r > 1.0)
-            throw kmq_invalid_request(
-              fmt::format("'r': {}, should be in [0.0, 1.0]", data["r"].get<double>()));
+          for (std::size_t i = 0; i < m_index.size(); ++i)
+          {
+            const index_infos& infos = registry.infos(m_index[i]);
+            for (auto& s : m_seq)
+              check_size(infos, s, check);
+            lookups[i] = batcher->submit(registry, m_index[i], m_name, m_seq);
+          }
+          return lookups;
         }
 
-        m_name = data["id"];
+        batch_map batches;
+        std::vector<std::unique_ptr<batch_query>> bqs;
+        std::vector<std::pair<std::size_t, std::size_t>> units;
 
-        for (auto& i : data["index"])
-          m_index.push_back(i);
+        {
+          stage_timer timer(stage::hash);
+          for (std::size_t i = 0; i < m_index.size(); ++i)
+          {
+            const index_infos& infos = registry.infos(m_index[i]);
+            bqs.push_back(std::make_unique<batch_query>(
+              infos.nb_samples(), m_z, infos.bw(), get_smers(infos, batches, check)));
+            for (std::size_t p = 0; p < infos.nb_partitions(); ++p)
+              units.emplace_back(i, p);
+          }
+        }
 
-        if (data.contains("seq"))
+        if (m_deadline_ms > 0)
+          order_by_coverage(bqs, units);
+
+        stage_timer timer(stage::lookup);
+        std::vector<std::uint8_t> done(units.size(), 0);
+        run_with<lookup_faults>(compute, units.size(), [&](lookup_faults& faults, std::size_t u) {
+          if (expired())
+            return;
+          auto [i, p] = units[u];
+          registry.solve(m_index[i], *bqs[i], p, faults);
+          done[u] = 1;
+        });
+        timer.stop();
+
+        if (m_cancelled)
+          throw kmq_error("Request cancelled.");
+
+        // S-mers of the partitions left out are not counted in the ratios.
+        for (std::size_t u = 0; u < units.size(); ++u)
         {
-          for (auto& i : data["seq"])
-            m_seq.push_back(i);
+          if (done[u])
+            continue;
+          m_complete = false;
+          auto [i, p] = units[u];
+          auto& responses = bqs[i]->response();
+          for (auto& [mer, qid] : bqs[i]->partition(p))
+            responses[qid]->unresolve(mer.i);
         }
-        else
+
+        for (std::size_t i = 0; i < m_index.size(); ++i)
+          lookups[i] = std::move(bqs[i]->response());
+
+        return lookups;
+      }
+
+      // Partitions holding the largest share of the s-mers of their sub-index first. The s-mers
+      // of a k-mer mostly share a minimizer, so this resolves the most k-mers early, and the
+      // sub-indexes progress together.
+      static void order_by_coverage(const std::vector<std::unique_ptr<batch_query>>& bqs,
+                                    std::vector<std::pair<std::size_t, std::size_t>>& units)
+      {
+        std::vector<double> totals(bqs.size(), 0);
+        for (auto [i, p] : units)
+          totals[i] += bqs[i]->smers()->partition_size(p);
+
+        auto share = [&](const std::pair<std::size_t, std::size_t>& u) {
+          return totals[u.first] > 0 ? bqs[u.first]->smers()->partition_size(u.second) / totals[u.first] : 0.0;
+        };
+
+        std::stable_sort(units.begin(), units.end(), [&](const auto& lhs, const auto& rhs) {
+          return share(lhs) > share(rhs);
+        });
+      }
+
+      // S-mers of the request for the configuration of 'infos', computed once for all
+      // the compatible indexes of the request.
+      smer_batch_t get_smers(const index_infos& infos, batch_map& batches, bool check) const
+      {
+        auto& smers = batches[infos.sha1()];
+        if (smers)
+          return smers;
+
+        smers = std::make_shared<smer_batch>(infos.nb_partitions(),
+                                             infos.smer_size(),
+                                             infos.get_repartition(),
+                                             infos.get_hash_w(),
+                                             infos.minim_size());
+        for (auto& s : m_seq)
         {
-          klibpp::KSeq record;
+          check_size(infos, s, check);
+          smers->add_query(m_name, s);
+        }
+        return smers;
+      }
+
+      // A sequence needs at least one s-mer, and s+z bases when 'check' is set.
+      void check_size(const index_infos& infos, std::string_view s, bool check) const
+      {
+        std::size_t min_size = infos.smer_size() + (check ? m_z : 0);
+        if (s.size() < min_size)
+          throw kmq_invalid_request(
+              fmt::format("Sequence too small: {}, min size is {}.", s.size(), min_size));
+      }
+
+      void parse_json()
+      {
+        using namespace simdjson;
 
-          std::string fastx_str = data["fastx"];
+        ondemand::document doc = m_parser.iterate(m_buffer);
+        ondemand::object data = doc.get_object();
 
-          string_iterator_wrapper it(fastx_str);
-          SeqStreamString iss(&it);
+        bool has_index = false, has_id = false, has_seq = false, has_fastx = false, has_z = false;
 
-          while (iss >> record)
+        // Single pass over the fields, in any order. Strings are unescaped in the parser
+        // buffer, which lives as long as the request.
+        for (ondemand::field f : data)
+        {
+          std::string_view key = f.unescaped_key().value();
+          ondemand::value v = f.value();
+
+          if (key == "index")
+          {
+            has_index = true;
+            ondemand::array arr = v.get_array();
+            for (ondemand::value i : arr)
+              m_index.emplace_back(std::string_view(i));
+          }
+          else if (key == "id")
+          {
+            has_id = true;
+            m_name = std::string(std::string_view(v.get_string()));
+          }
+          else if (key == "seq")
+          {
+            has_seq = true;
+            ondemand::array arr = v.get_array();
+            for (ondemand::value i : arr)
+              m_seq.push_back(std::string_view(i));
+          }
+          else if (key == "fastx")
           {
-            m_seq.emplace_back(std::move(record.seq));
+            has_fastx = true;
+            m_fastx = std::string(std::string_view(v.get_string()));
+          }
+          else if (key == "z")
+          {
+            has_z = true;
+            m_z = v.get_uint64();
+          }
+          else if (key == "format")
+          {
+            std::string_view fmt_str = v.get_string();
+            if (fmt_str == "json" || fmt_str == "json_vec")
+              m_format = str_to_format(std::string(fmt_str));
+            else if (fmt_str == "tsv")
+              m_json = false;
+            else
+              throw kmq_invalid_request(
+                fmt::format("'format':'{}' not supported, should be 'json' or 'tsv'.", fmt_str));
+          }
+          else if (key == "deadline_ms")
+          {
+            m_deadline_ms = v.get_uint64();
+          }
+          else if (key == "r")
+          {
+            ondemand::json_type type = v.type();
+            if (type != ondemand::json_type::number)
+              throw kmq_invalid_request(
+                fmt::format("'r' should be a float in [0.0, 1.0]"));
+            m_r = v.get_double();
+            if (m_r < 0.0 || m_r > 1.0)
+              throw kmq_invalid_request(
+                fmt::format("'r': {}, should be in [0.0, 1.0]", m_r));
           }
         }
 
-        m_z = data["z"];
+        if (!has_index)
+          throw kmq_invalid_request("'index' entry is missing.");
+        if (!has_id)
+          throw kmq_invalid_request("'id' entry is missing.");
+        if (!has_seq && !has_fastx)
+          throw kmq_invalid_request("'seq' or 'fastx' should be specified.");
+        if (has_seq && has_fastx)
+          throw kmq_invalid_request("'seq' and 'fastx' are mutually exclusive.");
+        if (!has_z)
+          throw kmq_invalid_request("'z' entry is missing.");
+      }
+
+      // Records are parsed in place, multi-line sequences are joined within the payload.
+      void parse_fastx_payload()
+      {
+        char* begin = m_fastx.data();
+        char* end = begin + m_fastx.size();
+
+        std::vector<fastx_record_view> records;
+        parse_fastx(begin, end, guess_fastx_type(begin, end), records, true);
+
+        m_seq.reserve(records.size());
+        for (auto& r : records)
+          m_seq.push_back(r.seq);
       }
 
     public:
+      simdjson::padded_string m_buffer;
+      simdjson::ondemand::parser m_parser;
+      std::string m_fastx;
+
       std::string m_name;
       std::vector<std::string> m_index;
-      std::vector<std::string> m_seq;
+      std::vector<std::string_view> m_seq;
       std::size_t m_z {0};
       double m_r {0.0};
       bool m_json {true};
-      enum format m_format;
+      enum format m_format {format::json};
+
+      std::chrono::steady_clock::time_point m_received;
+      std::size_t m_deadline_ms {0};
+      std::atomic<bool> m_cancelled {false};
+      bool m_complete {true};
+      std::vector<double> m_coverage;
   };
 
 }
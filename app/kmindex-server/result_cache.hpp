@@ -0,0 +1,170 @@
+#ifndef RESULT_CACHE_HPP_V7QHD2XM
+#define RESULT_CACHE_HPP_V7QHD2XM
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+namespace kmq {
+
+  // 128-bit hash of a normalized request.
+  struct result_key
+  {
+    std::uint64_t low {0};
+    std::uint64_t high {0};
+
+    bool operator==(const result_key& other) const
+    {
+      return low == other.low && high == other.high;
+    }
+  };
+
+  struct result_key_hash
+  {
+    std::size_t operator()(const result_key& k) const
+    {
+      return k.low;
+    }
+  };
+
+  struct result_cache_stats
+  {
+    std::uint64_t hits {0};
+    std::uint64_t misses {0};
+    std::uint64_t evictions {0};
+    std::uint64_t invalidations {0};
+    std::size_t bytes {0};
+    std::size_t capacity {0};
+    std::size_t entries {0};
+  };
+
+  // Formatted responses of previous requests within a byte budget, least recently used
+  // evicted first. Entries are indexed by the hash of the normalized request, which is kept
+  // to tell collisions apart. The whole cache is dropped when the registry is reloaded.
+  class result_cache
+  {
+    struct entry
+    {
+      std::string key;
+      std::string value;
+      std::list<result_key>::iterator pos;
+
+      std::size_t bytes() const
+      {
+        return key.size() + value.size() + sizeof(entry);
+      }
+    };
+
+    public:
+      result_cache(std::size_t capacity)
+        : m_capacity(capacity) {}
+
+      // 'same' compares the request to the normalized request of an entry with the same hash.
+      // 'generation' is the one of the registry the request is solved on.
+      template<typename Match>
+      bool get(const result_key& h, std::uint64_t generation, Match&& same, std::string& value)
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        check_generation(generation);
+
+        auto it = m_entries.find(h);
+        if (generation != m_generation || it == m_entries.end() || !same(it->second.key))
+        {
+          m_misses++;
+          return false;
+        }
+
+        m_order.splice(m_order.begin(), m_order, it->second.pos);
+        value = it->second.value;
+        m_hits++;
+        return true;
+      }
+
+      void put(const result_key& h, std::uint64_t generation, std::string key, const std::string& value)
+      {
+        if (key.size() + value.size() + sizeof(entry) > m_capacity)
+          return;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        check_generation(generation);
+
+        // Solved on a registry replaced meanwhile.
+        if (generation != m_generation)
+          return;
+
+        auto it = m_entries.find(h);
+        if (it != m_entries.end())
+          erase(it);
+
+        entry& e = m_entries[h];
+        e.key = std::move(key);
+        e.value = value;
+        m_order.push_front(h);
+        e.pos = m_order.begin();
+        m_bytes += e.bytes();
+
+        while (m_bytes > m_capacity)
+        {
+          erase(m_entries.find(m_order.back()));
+          m_evictions++;
+        }
+      }
+
+      result_cache_stats stats() const
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        result_cache_stats s;
+        s.hits = m_hits;
+        s.misses = m_misses;
+        s.evictions = m_evictions;
+        s.invalidations = m_invalidations;
+        s.bytes = m_bytes;
+        s.capacity = m_capacity;
+        s.entries = m_entries.size();
+        return s;
+      }
+
+    private:
+      void check_generation(std::uint64_t generation)
+      {
+        if (generation <= m_generation)
+          return;
+
+        spdlog::info("Registry reloaded, {} cached results dropped.", m_entries.size());
+        m_entries.clear();
+        m_order.clear();
+        m_bytes = 0;
+        m_generation = generation;
+        m_invalidations++;
+      }
+
+      void erase(std::unordered_map<result_key, entry, result_key_hash>::iterator it)
+      {
+        m_bytes -= it->second.bytes();
+        m_order.erase(it->second.pos);
+        m_entries.erase(it);
+      }
+
+    private:
+      std::size_t m_capacity {0};
+      std::uint64_t m_generation {0};
+
+      mutable std::mutex m_mutex;
+      std::unordered_map<result_key, entry, result_key_hash> m_entries;
+      // Most recently used first.
+      std::list<result_key> m_order;
+      std::size_t m_bytes {0};
+
+      std::uint64_t m_hits {0};
+      std::uint64_t m_misses {0};
+      std::uint64_t m_evictions {0};
+      std::uint64_t m_invalidations {0};
+  };
+
+}
+
+#endif /* end of include guard: RESULT_CACHE_HPP_V7QHD2XM */
@@ -0,0 +1,388 @@
+#ifndef ROUTER_HPP_M9TQF4HW
+#define ROUTER_HPP_M9TQF4HW
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <kmindex/exceptions.hpp>
+
+#include <client_http.hpp>
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "utils.hpp"
+
+using json = nlohmann::json;
+
+namespace kmq {
+
+  using http_client_t = SimpleWeb::Client<SimpleWeb::HTTP>;
+
+  struct backend_reply
+  {
+    std::string status;
+    std::string content;
+    SimpleWeb::CaseInsensitiveMultimap header;
+
+    bool ok() const
+    {
+      return !status.empty() && status[0] == '2';
+    }
+  };
+
+  // A kmindex-server queried by the router. Each client keeps its connections alive and
+  // serves one request at a time, idle clients are reused by the next requests.
+  class backend
+  {
+    public:
+      backend(const std::string& address)
+        : m_address(address) {}
+
+      const std::string& address() const
+      {
+        return m_address;
+      }
+
+      // Throws on connection errors.
+      backend_reply request(const std::string& method, const std::string& path, const std::string& body = "")
+      {
+        std::unique_ptr<http_client_t> client = acquire();
+        auto r = client->request(method, path, body, { { "Content-type", "application/json" } });
+        backend_reply reply {r->status_code, r->content.string(), r->header};
+
+        // A client whose request failed is dropped, with its connections.
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.push_back(std::move(client));
+        return reply;
+      }
+
+    private:
+      std::unique_ptr<http_client_t> acquire()
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_idle.empty())
+          return std::make_unique<http_client_t>(m_address);
+        auto client = std::move(m_idle.back());
+        m_idle.pop_back();
+        return client;
+      }
+
+    private:
+      std::string m_address;
+      std::mutex m_mutex;
+      std::vector<std::unique_ptr<http_client_t>> m_idle;
+  };
+
+  // Scatter-gather over several kmindex-server instances, each one serving some of the
+  // sub-indexes. A sub-index served by several backends (replicas) is queried on one of them in
+  // turn, others are tried if it is unreachable. Multi-sequence queries on a replicated
+  // presence/absence sub-index are split over its replicas, and the ratios are merged weighted
+  // by the number of k-mers of each part.
+  class query_router
+  {
+    struct route
+    {
+      json infos;
+      std::vector<backend*> replicas;
+      mutable std::atomic<std::size_t> next {0};
+    };
+
+    using table_t = std::map<std::string, std::unique_ptr<route>>;
+
+    // A sub-request: some sub-indexes, and possibly a part of the sequences, on one backend.
+    struct unit
+    {
+      std::vector<backend*> candidates;
+      json body;
+      // Set when the sequences of a sub-index are split over its replicas.
+      const std::string* split {nullptr};
+      std::size_t nb_kmers {0};
+      backend_reply reply;
+    };
+
+    public:
+      query_router(const std::vector<std::string>& addresses)
+      {
+        for (auto& a : addresses)
+          m_backends.push_back(std::make_unique<backend>(a));
+      }
+
+      // Sub-indexes of each backend, from their /kmindex/infos. Replicas of a sub-index must
+      // have the same configuration and samples.
+      void discover()
+      {
+        auto table = std::make_shared<table_t>();
+        json all;
+        all["index"] = json::object();
+
+        for (auto& b : m_backends)
+        {
+          backend_reply r = b->request("GET", "/kmindex/infos");
+          if (!r.ok())
+            throw kmq_error(fmt::format("Backend {}: {}", b->address(), r.status));
+
+          json data = json::parse(r.content);
+          for (auto& [name, infos] : data["index"].items())
+          {
+            auto& e = (*table)[name];
+            if (!e)
+            {
+              e = std::make_unique<route>();
+              e->infos = infos;
+              all["index"][name] = infos;
+            }
+            else if (e->infos.value("sha1", "") != infos.value("sha1", "") ||
+                     e->infos["samples"] != infos["samples"])
+            {
+              throw kmq_error(fmt::format("'{}' differs on {} and {}.",
+                                          name, e->replicas[0]->address(), b->address()));
+            }
+            e->replicas.push_back(b.get());
+          }
+          spdlog::info("Backend {}: {} sub-indexes.", b->address(), data["index"].size());
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_table = std::move(table);
+        m_infos_json = all.dump(4);
+      }
+
+      std::string infos_json() const
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_infos_json;
+      }
+
+      // Answers a /kmindex/query body. Errors of the backends are forwarded.
+      backend_reply query(const std::string& content) const
+      {
+        std::shared_ptr<const table_t> table;
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          table = m_table;
+        }
+
+        json rq = json::parse(content);
+        if (!rq.contains("index") || !rq["index"].is_array())
+          throw kmq_invalid_request("'index' entry is missing.");
+
+        std::vector<unit> units = plan(*table, rq);
+
+        if (units.size() == 1)
+        {
+          send(units[0]);
+        }
+        else
+        {
+          std::vector<std::future<void>> pending;
+          for (auto& u : units)
+            pending.push_back(std::async(std::launch::async, [&u]() { send(u); }));
+          for (auto& p : pending)
+            p.get();
+        }
+
+        for (auto& u : units)
+          if (!u.reply.ok())
+            return u.reply;
+
+        if (rq.value("format", "json") == "tsv")
+          return merge_tsv(units);
+        return merge_json(rq, units);
+      }
+
+    private:
+      std::vector<unit> plan(const table_t& table, const json& rq) const
+      {
+        std::vector<unit> units;
+        std::map<backend*, std::size_t> by_backend;
+
+        bool json_format = rq.value("format", "json") == "json";
+        std::size_t nb_seqs = rq.contains("seq") ? rq["seq"].size() : 0;
+
+        for (auto& i : rq["index"])
+        {
+          auto it = table.find(i.get<std::string>());
+          if (it == table.end())
+            throw kmq_invalid_index(fmt::format("'{}' is not served by any backend", i.get<std::string>()));
+          const std::string& name = it->first;
+          const route& r = *it->second;
+
+          std::size_t first = r.next++;
+          auto candidates = [&](std::size_t shift) {
+            std::vector<backend*> c;
+            for (std::size_t n = 0; n < r.replicas.size(); ++n)
+              c.push_back(r.replicas[(first + shift + n) % r.replicas.size()]);
+            return c;
+          };
+
+          std::size_t parts = std::min(r.replicas.size(), nb_seqs);
+          if (json_format && parts > 1 && r.infos.value("bw", 1) == 1)
+          {
+            split(rq, name, r.infos.value("smer_size", 0) + rq.value("z", 0), parts, candidates, units);
+            continue;
+          }
+
+          auto c = candidates(0);
+          auto [b, inserted] = by_backend.emplace(c[0], units.size());
+          if (inserted)
+          {
+            units.emplace_back();
+            units.back().candidates = std::move(c);
+            units.back().body = rq;
+            units.back().body["index"] = json::array();
+          }
+          units[b->second].body["index"].push_back(name);
+        }
+        return units;
+      }
+
+      // Sequences split in 'parts' contiguous parts of about the same size.
+      template<typename Candidates>
+      static void split(const json& rq,
+                        const std::string& name,
+                        std::size_t k,
+                        std::size_t parts,
+                        Candidates&& candidates,
+                        std::vector<unit>& units)
+      {
+        const json& seqs = rq["seq"];
+        std::size_t total = 0;
+        for (auto& s : seqs)
+          total += s.get_ref<const std::string&>().size();
+
+        std::size_t s = 0, size = 0;
+        for (std::size_t p = 0; p < parts; ++p)
+        {
+          unit u;
+          u.candidates = candidates(p);
+          u.split = &name;
+          u.body = rq;
+          u.body["index"] = json::array({name});
+          u.body["seq"] = json::array();
+          // Ratios are thresholded after the merge.
+          u.body["r"] = 0.0;
+
+          // Each part takes at least one sequence and leaves one for each of the next parts.
+          std::size_t target = total * (p + 1) / parts;
+          while (s < seqs.size() && seqs.size() - s > parts - p - 1)
+          {
+            auto& seq = seqs[s].get_ref<const std::string&>();
+            if (!u.body["seq"].empty() && size + seq.size() / 2 > target)
+              break;
+            size += seq.size();
+            u.nb_kmers += seq.size() >= k ? seq.size() - k + 1 : 0;
+            u.body["seq"].push_back(seq);
+            ++s;
+          }
+          if (p == parts - 1)
+          {
+            for (; s < seqs.size(); ++s)
+            {
+              auto& seq = seqs[s].get_ref<const std::string&>();
+              u.nb_kmers += seq.size() >= k ? seq.size() - k + 1 : 0;
+              u.body["seq"].push_back(seq);
+            }
+          }
+          units.push_back(std::move(u));
+        }
+      }
+
+      static void send(unit& u)
+      {
+        std::string body = u.body.dump();
+        for (auto* b : u.candidates)
+        {
+          try {
+            u.reply = b->request("POST", "/kmindex/query", body);
+            return;
+          } catch (const std::system_error& e) {
+            spdlog::warn("Backend {} unreachable -> {}", b->address(), e.what());
+          }
+        }
+        u.reply = {"502 Bad Gateway", json_error("No backend available").dump(), {}};
+      }
+
+      static backend_reply merge_tsv(const std::vector<unit>& units)
+      {
+        backend_reply reply {"200 OK", "", { { "Content-type", "text/csv" } }};
+        for (auto& u : units)
+          reply.content += u.reply.content;
+        return reply;
+      }
+
+      static backend_reply merge_json(const json& rq, const std::vector<unit>& units)
+      {
+        json response = json::object();
+
+        // Sum of the ratios weighted by the k-mers resolved in each part, per sub-index.
+        struct weighted
+        {
+          std::map<std::string, double> ratios;
+          double resolved {0};
+          double total {0};
+        };
+        std::map<std::string, weighted> splits;
+
+        for (auto& u : units)
+        {
+          json sub = json::parse(u.reply.content);
+          if (!u.split)
+          {
+            for (auto& [key, value] : sub.items())
+            {
+              if (key == "coverage")
+                response["coverage"].update(value);
+              else
+                response[key] = value;
+            }
+            continue;
+          }
+
+          double coverage = sub.contains("coverage") ? sub["coverage"].value(*u.split, 1.0) : 1.0;
+          double w = u.nb_kmers * coverage;
+          auto& m = splits[*u.split];
+          m.resolved += w;
+          m.total += u.nb_kmers;
+          for (auto& [query, samples] : sub[*u.split].items())
+            for (auto& [sample, ratio] : samples.items())
+              m.ratios[sample] += w * ratio.get<double>();
+        }
+
+        std::string id = rq.value("id", "");
+        double threshold = rq.value("r", 0.0);
+        for (auto& [name, m] : splits)
+        {
+          json& samples = response[name][id];
+          samples = json::object();
+          for (auto& [sample, sum] : m.ratios)
+          {
+            double ratio = m.resolved > 0 ? sum / m.resolved : 0.0;
+            if (ratio >= threshold)
+              samples[sample] = ratio;
+          }
+          if (rq.contains("deadline_ms"))
+            response["coverage"][name] = m.total > 0 ? m.resolved / m.total : 0.0;
+        }
+
+        return {"200 OK", response.dump(4), { { "Content-type", "application/json" } }};
+      }
+
+    private:
+      std::vector<std::unique_ptr<backend>> m_backends;
+
+      mutable std::mutex m_mutex;
+      std::shared_ptr<const table_t> m_table {std::make_shared<table_t>()};
+      std::string m_infos_json;
+  };
+
+}
+
+#endif /* end of include guard: ROUTER_HPP_M9TQF4HW */
@@ -0,0 +1,209 @@
+#ifndef SCHEDULER_HPP_K4DMS8VA
+#define SCHEDULER_HPP_K4DMS8VA
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <kmindex/exceptions.hpp>
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "metrics.hpp"
+
+namespace kmq {
+
+  // Thrown when a request cannot be queued, to be answered with 429 and Retry-After.
+  class kmq_overloaded : public kmq_error
+  {
+    public:
+      kmq_overloaded(const std::string& msg, std::size_t retry_after) noexcept
+        : kmq_error(msg), m_retry_after(retry_after) {}
+
+      virtual std::string name() const noexcept override { return "kmq_overloaded"; }
+
+      // Seconds.
+      std::size_t retry_after() const noexcept { return m_retry_after; }
+
+    private:
+      std::size_t m_retry_after {1};
+  };
+
+  struct scheduler_options
+  {
+    std::size_t small_workers {1};
+    std::size_t large_workers {1};
+    // Max number of waiting requests per lane.
+    std::size_t queue_size {0};
+    // Requests with a larger cost go to the large lane.
+    std::uint64_t large_cost {0};
+    // Queued requests not started after this delay are dropped, 0 = never.
+    std::chrono::milliseconds timeout {0};
+  };
+
+  // Requests are solved by the workers of two lanes, small and large, depending on their
+  // estimated cost, so that large requests cannot delay small ones beyond their own lane.
+  // Each lane has a bounded queue: a request is rejected when the queue of its lane is full.
+  class request_scheduler
+  {
+    public:
+      // Called with the time spent in the queue.
+      using job_t = std::function<void(std::chrono::nanoseconds)>;
+      // Called instead of the job when the request expired in the queue, with a retry delay
+      // in seconds.
+      using expire_t = std::function<void(std::size_t)>;
+
+    private:
+      struct entry
+      {
+        job_t job;
+        expire_t expire;
+        std::chrono::steady_clock::time_point submitted;
+      };
+
+      struct lane_state
+      {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<entry> queue;
+        std::vector<std::thread> workers;
+        // Moving average of the service time, in ns.
+        std::atomic<std::uint64_t> service {0};
+      };
+
+    public:
+      request_scheduler(const scheduler_options& opt)
+        : m_opt(opt)
+      {
+        start(lane::small, std::max<std::size_t>(opt.small_workers, 1));
+        start(lane::large, std::max<std::size_t>(opt.large_workers, 1));
+      }
+
+      ~request_scheduler()
+      {
+        m_stop = true;
+        for (auto& l : m_lanes)
+        {
+          {
+            std::unique_lock<std::mutex> lock(l.mutex);
+            l.cv.notify_all();
+          }
+          for (auto& w : l.workers)
+            w.join();
+        }
+      }
+
+      request_scheduler(const request_scheduler&) = delete;
+      request_scheduler& operator=(const request_scheduler&) = delete;
+
+      enum lane lane_of(std::uint64_t cost) const
+      {
+        return cost > m_opt.large_cost ? lane::large : lane::small;
+      }
+
+      // Queues 'job' in the lane of 'cost', throws kmq_overloaded if the lane is full.
+      enum lane submit(std::uint64_t cost, job_t job, expire_t expire)
+      {
+        enum lane l = lane_of(cost);
+        auto& s = m_lanes[static_cast<std::size_t>(l)];
+        auto& m = metrics().lane(l);
+
+        {
+          std::unique_lock<std::mutex> lock(s.mutex);
+          if (s.queue.size() >= m_opt.queue_size)
+          {
+            m.rejected.add();
+            throw kmq_overloaded(
+              fmt::format("Too many pending requests ({} lane).", lane_names[static_cast<std::size_t>(l)]),
+              retry_after(l, s.queue.size()));
+          }
+          s.queue.push_back({std::move(job), std::move(expire), std::chrono::steady_clock::now()});
+          m.depth.add();
+        }
+        s.cv.notify_one();
+        return l;
+      }
+
+    private:
+      void start(enum lane l, std::size_t n)
+      {
+        auto& s = m_lanes[static_cast<std::size_t>(l)];
+        for (std::size_t i = 0; i < n; ++i)
+          s.workers.emplace_back(&request_scheduler::worker, this, l);
+      }
+
+      // Expected time to drain 'queued' requests, at least one second.
+      std::size_t retry_after(enum lane l, std::size_t queued) const
+      {
+        auto& s = m_lanes[static_cast<std::size_t>(l)];
+        double service = s.service.load(std::memory_order_relaxed) * 1e-9;
+        double drain = service * (queued + 1) / s.workers.size();
+        return std::max<std::size_t>(1, static_cast<std::size_t>(std::ceil(drain)));
+      }
+
+      void worker(enum lane l)
+      {
+        auto& s = m_lanes[static_cast<std::size_t>(l)];
+        auto& m = metrics().lane(l);
+
+        while (true)
+        {
+          entry e;
+          std::size_t queued = 0;
+          {
+            std::unique_lock<std::mutex> lock(s.mutex);
+            s.cv.wait(lock, [this, &s]() { return m_stop || !s.queue.empty(); });
+            if (m_stop)
+              return;
+            e = std::move(s.queue.front());
+            s.queue.pop_front();
+            queued = s.queue.size();
+            m.depth.sub();
+          }
+
+          auto start = std::chrono::steady_clock::now();
+          auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(start - e.submitted);
+          m.wait.observe(waited.count());
+
+          try
+          {
+            if (m_opt.timeout.count() > 0 && waited > m_opt.timeout)
+            {
+              m.expired.add();
+              e.expire(retry_after(l, queued));
+              continue;
+            }
+
+            e.job(waited);
+          }
+          catch (const std::exception& ex)
+          {
+            spdlog::warn("scheduled request failure -> {}", ex.what());
+          }
+
+          std::uint64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+          std::uint64_t prev = s.service.load(std::memory_order_relaxed);
+          s.service.store(prev ? (prev * 7 + t) / 8 : t, std::memory_order_relaxed);
+        }
+      }
+
+    private:
+      scheduler_options m_opt;
+      std::array<lane_state, 2> m_lanes;
+      std::atomic<bool> m_stop {false};
+  };
+
+}
+
+#endif /* end of include guard: SCHEDULER_HPP_K4DMS8VA */
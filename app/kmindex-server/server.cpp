@@ -1,6 +1,12 @@
 #include "server.hpp"
 
+#include <algorithm>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <kmindex/query/query.hpp>
 #include <kmindex/index/index.hpp>
 #include <kmindex/query/format.hpp>
@@ -11,8 +17,18 @@
 
 #include <server_http.hpp>
 #include <nlohmann/json.hpp>
-
+#include <simdjson.h>
+
+#include "batcher.hpp"
+#include "bulk.hpp"
+#include "compute.hpp"
+#include "metrics.hpp"
+#include "registry.hpp"
+#include "reload.hpp"
 #include "request.hpp"
+#include "result_cache.hpp"
+#include "router.hpp"
+#include "scheduler.hpp"
 #include "compress.hpp"
 #include "utils.hpp"
 
@@ -28,8 +44,9 @@ namespace kmq {
       );
     };
 
-    parser->add_param("-i/--index", "Index path.")
+    parser->add_param("-i/--index", "Index path (not used with --router).")
        ->meta("STR")
+       ->def("")
        ->checker(bc::check::is_dir)
        ->checker(is_kmq_index)
        ->setter(options->index_path);
@@ -56,6 +73,119 @@ namespace kmq {
           ->as_flag()
           ->setter(options->no_stderr);
 
+    parser->add_param("--prefault", "Load the partitions of all sub-indexes in memory at startup.")
+          ->as_flag()
+          ->setter(options->prefault);
+
+    parser->add_param("--cache-budget", "Max size of the partitions kept open, in MB (0=all, see doc for details).")
+          ->meta("INT")
+          ->def("0")
+          ->checker(bc::check::is_number)
+          ->setter(options->cache_budget);
+
+    parser->add_param("--cache-policy", "Eviction policy of the partition cache [lru|lfu].")
+          ->meta("STR")
+          ->def("lru")
+          ->checker(bc::check::f::in("lru|lfu"))
+          ->setter(options->cache_policy);
+
+    parser->add_param("--batch-window", "Time window to coalesce concurrent requests, in microseconds (0=disabled).")
+          ->meta("INT")
+          ->def("0")
+          ->checker(bc::check::is_number)
+          ->setter(options->batch_window);
+
+    parser->add_param("--batch-max", "Max number of requests coalesced in a window.")
+          ->meta("INT")
+          ->def("64")
+          ->checker(bc::check::is_number)
+          ->setter(options->batch_max);
+
+    parser->add_param("--result-cache", "Max size of the cached responses, in MB (0=disabled).")
+          ->meta("INT")
+          ->def("0")
+          ->checker(bc::check::is_number)
+          ->setter(options->result_cache);
+
+    parser->add_param("--compute-threads", "Number of threads solving the requests (0=connection threads).")
+          ->meta("INT")
+          ->def(std::to_string(std::thread::hardware_concurrency()))
+          ->checker(bc::check::is_number)
+          ->setter(options->compute_threads);
+
+    parser->add_param("--request-parallelism", "Max number of compute threads used by a single request.")
+          ->meta("INT")
+          ->def(std::to_string(std::max(1u, std::thread::hardware_concurrency() / 4)))
+          ->checker(bc::check::is_number)
+          ->setter(options->request_parallelism);
+
+    parser->add_param("--queue-size", "Max number of pending requests per lane (0=no scheduling).")
+          ->meta("INT")
+          ->def("128")
+          ->checker(bc::check::is_number)
+          ->setter(options->queue_size);
+
+    parser->add_param("--small-workers", "Number of requests solved concurrently in the small lane.")
+          ->meta("INT")
+          ->def(std::to_string(std::max(2u, std::thread::hardware_concurrency())))
+          ->checker(bc::check::is_number)
+          ->setter(options->small_workers);
+
+    parser->add_param("--large-workers", "Number of requests solved concurrently in the large lane.")
+          ->meta("INT")
+          ->def("1")
+          ->checker(bc::check::is_number)
+          ->setter(options->large_workers);
+
+    parser->add_param("--large-cost", "Cost (bases x samples) above which a request goes to the large lane.")
+          ->meta("INT")
+          ->def("100000000")
+          ->checker(bc::check::is_number)
+          ->setter(options->large_cost);
+
+    parser->add_param("--queue-timeout", "Max time in queue before a request is dropped, in ms (0=none).")
+          ->meta("INT")
+          ->def("0")
+          ->checker(bc::check::is_number)
+          ->setter(options->queue_timeout);
+
+    parser->add_param("--deadline", "Default deadline of the requests, in ms, partial results beyond (0=none).")
+          ->meta("INT")
+          ->def("0")
+          ->checker(bc::check::is_number)
+          ->setter(options->deadline);
+
+    parser->add_param("--gzip-level", "Compression level of gzip/deflate responses, in [1, 9].")
+          ->meta("INT")
+          ->def("6")
+          ->checker(bc::check::f::range(1, 9))
+          ->setter(options->zlib_level);
+
+    parser->add_param("--zstd-level", "Compression level of zstd responses, in [1, 19].")
+          ->meta("INT")
+          ->def("3")
+          ->checker(bc::check::f::range(1, 19))
+          ->setter(options->zstd_level);
+
+    parser->add_param("--compress-min-size", "Responses smaller than this are not compressed, in bytes.")
+          ->meta("INT")
+          ->def("1024")
+          ->checker(bc::check::is_number)
+          ->setter(options->compress_min_size);
+
+    parser->add_param("--watch", "Reload the index when index.json changes (Linux only).")
+          ->as_flag()
+          ->setter(options->watch);
+
+    parser->add_param("--router", "Route the requests to --backends instead of serving an index.")
+          ->as_flag()
+          ->setter(options->router);
+
+    parser->add_param("--backends", "Comma-separated backend servers (host:port), for --router.")
+          ->meta("STR")
+          ->def("")
+          ->setter(options->backends);
+
     parser->add_group("common", "");
 
     parser->add_param("-t/--threads", "Max number of parallel connections.")
@@ -98,73 +228,593 @@ namespace kmq {
     });
   }
 
-  void accept_request(response_t& response,
-                      const request_t& request,
-                      const std::function<std::string(const std::string&)>& callback)
+  // The body is read once into a buffer padded for simdjson, parsers keep views into it.
+  simdjson::padded_string read_content(const request_t& request)
   {
-    std::string content = request->content.string();
+    std::size_t size = request->content.size();
+    simdjson::padded_string buffer(size);
+    request->content.read(buffer.data(), size);
+    return buffer;
+  }
 
-    spdlog::info("POST {} from {}", request->path, request->remote_endpoint().address().to_string());
+  // Requests queued or being solved, by connection, to cancel them when their connection fails.
+  class inflight_requests
+  {
+    public:
+      // The request is tracked as long as the returned handle lives.
+      std::shared_ptr<void> track(const void* connection, const std::shared_ptr<kmq::request>& rq)
+      {
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_requests[connection] = rq;
+        }
+        return std::shared_ptr<void>(nullptr, [this, connection](void*) {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_requests.erase(connection);
+        });
+      }
+
+      void cancel(const void* connection)
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto it = m_requests.find(connection);
+        if (it == m_requests.end())
+          return;
+        if (auto rq = it->second.lock())
+        {
+          rq->cancel();
+          metrics().cancelled().add();
+        }
+        m_requests.erase(it);
+      }
+
+    private:
+      std::mutex m_mutex;
+      std::unordered_map<const void*, std::weak_ptr<kmq::request>> m_requests;
+  };
+
+  // Max number of bulk streams waiting for a worker per lane, when no scheduler is configured.
+  constexpr std::size_t bulk_queue_size = 16;
+
+  // State shared by the request handlers, optional parts are nullptr when disabled.
+  struct server_state
+  {
+    registry_handle& registry;
+    compute_pool& compute;
+    request_batcher* batcher {nullptr};
+    result_cache* results {nullptr};
+    request_scheduler* scheduler {nullptr};
+    // Runs the bulk streams, the scheduler when enabled.
+    request_scheduler& streams;
+    std::size_t deadline {0};
+    inflight_requests inflight {};
+  };
+
+  void reply_overloaded(const response_t& response, SimpleWeb::StatusCode code, const std::string& msg, std::size_t retry_after)
+  {
+    response->write(code,
+                    json_error(msg).dump(),
+                    { { "Content-type", "application/json" },
+                      { "Retry-After", std::to_string(retry_after) } });
+  }
 
+  // Runs 'f', failures are answered with an error status.
+  template<typename Callable>
+  void guarded(response_t response, endpoint_metrics& m, Callable&& f)
+  {
     try {
-      send_response(response, request, callback(content));
-
+      f();
     } catch (const nlohmann::detail::exception& e) {
+      m.errors.add();
       spdlog::info("json parsing failure -> {}", e.what());
       response->write(SimpleWeb::StatusCode::client_error_bad_request,
                       json_error("json parsing failure, check your inputs").dump());
-    }
-      catch (const std::exception& e) {
+    } catch (const simdjson::simdjson_error& e) {
+      m.errors.add();
+      spdlog::info("json parsing failure -> {}", e.what());
+      response->write(SimpleWeb::StatusCode::client_error_bad_request,
+                      json_error("json parsing failure, check your inputs").dump());
+    } catch (const kmq_overloaded& e) {
+      m.errors.add();
+      spdlog::info("request rejected -> {}", e.what());
+      reply_overloaded(response, SimpleWeb::StatusCode::client_error_too_many_requests, e.what(), e.retry_after());
+    } catch (const std::exception& e) {
+      m.errors.add();
       spdlog::info("bad client request -> {}", e.what());
       response->write(SimpleWeb::StatusCode::client_error_bad_request,
                       json_error(e.what()).dump());
     } catch (...) {
+      m.errors.add();
       spdlog::warn("internal server error");
       response->write(SimpleWeb::StatusCode::server_error_internal_server_error,
                      json_error("Internal server error").dump());
     }
+  }
 
+  // Requests expired in the scheduler queue.
+  request_scheduler::expire_t expire_request(response_t response, endpoint_metrics& m)
+  {
+    return [response, &m](std::size_t retry_after) {
+      m.errors.add();
+      spdlog::info("request expired in queue");
+      reply_overloaded(response, SimpleWeb::StatusCode::server_error_service_unavailable,
+                       "Request expired in queue", retry_after);
+    };
   }
 
   void accept_get_request(response_t& response,
                           const request_t& request,
-                          const std::string& p)
+                          const kindex_registry& registry)
   {
     spdlog::info("GET {} from {}", request->path, request->remote_endpoint().address().to_string());
+    send_response(response, request, std::string(registry.infos_json()));
+  }
+
+  void accept_reload_request(response_t& response, const request_t& request, registry_reloader& reloader)
+  {
+    spdlog::info("POST {} from {}", request->path, request->remote_endpoint().address().to_string());
+
+    try {
+      auto registry = reloader.reload();
+      json data;
+      data["indexes"] = registry->size();
+      send_response(response, request, data.dump(4));
+    } catch (const std::exception& e) {
+      spdlog::error("Reload failed, previous registry kept -> {}", e.what());
+      response->write(SimpleWeb::StatusCode::server_error_internal_server_error,
+                      json_error(e.what()).dump());
+    }
+  }
+
+  // Results are sent with chunked transfer encoding, one chunk per batch of queries. Runs on
+  // its own thread: each chunk is handed to the connection threads and waited for before
+  // computing the next one. With a compressed encoding, each chunk is compressed and flushed
+  // as soon as it is serialized, the client can decode the lines already received.
+  void stream_bulk(response_t response,
+                   std::shared_ptr<const bulk_request> bulk,
+                   registry_t registry,
+                   compute_pool& compute,
+                   content_encoding encoding)
+  {
+    SimpleWeb::CaseInsensitiveMultimap head {
+      { "Content-type", "application/x-ndjson" },
+      { "Transfer-Encoding", "chunked" } };
+
+    std::unique_ptr<stream_compressor> compressor {nullptr};
+    if (encoding != content_encoding::identity)
+    {
+      compressor = std::make_unique<stream_compressor>(encoding, response_compression());
+      head.emplace("Content-Encoding", encoding_name(encoding));
+      head.emplace("Vary", "Accept-Encoding");
+    }
+    response->write(SimpleWeb::StatusCode::success_ok, head);
 
-    std::ifstream inf(fmt::format("{}/index.json", p), std::ios::in);
-    json data = json::parse(inf);
-    data.erase("path");
+    inflight_scope inflight;
+    auto& m = metrics().endpoint(endpoint::bulk);
+    std::size_t bytes = 0;
 
-    send_response(response, request, data.dump(4));
+    auto send_raw = [&response](const std::string& data) {
+      if (data.empty())
+        return true;
+      *response << fmt::format("{:x}\r\n", data.size()) << data << "\r\n";
+
+      std::promise<bool> sent;
+      auto done = sent.get_future();
+      response->send([&sent](const SimpleWeb::error_code& ec) {
+        sent.set_value(!ec);
+      });
+      return done.get();
+    };
+
+    auto send_chunk = [&](std::string&& data) {
+      if (data.empty())
+        return true;
+      bytes += data.size();
+      if (!compressor)
+        return send_raw(data);
+
+      std::string out;
+      {
+        stage_timer timer(stage::compress);
+        compressor->write(data, out, true);
+      }
+      return send_raw(out);
+    };
+
+    Timer timer;
+    try {
+      bulk->solve(*registry, compute, send_chunk);
+    } catch (const std::exception& e) {
+      m.errors.add();
+      spdlog::warn("bulk request failure -> {}", e.what());
+      send_chunk(json_error(e.what()).dump() + "\n");
+    }
+
+    if (compressor)
+    {
+      std::string out;
+      compressor->finish(out);
+      if (!out.empty())
+        *response << fmt::format("{:x}\r\n", out.size()) << out << "\r\n";
+    }
+    *response << "0\r\n\r\n";
+    response->send();
+    m.response_bytes.observe(bytes);
+    spdlog::info("bulk -> {} queries done ({})", bulk->size(), timer.formatted());
   }
 
-  std::string perform_query(const std::string& content, index& global)
+  void accept_bulk_request(response_t& response, const request_t& request, server_state& st)
   {
-    auto j = json::parse(content);
+    spdlog::info("POST {} from {}", request->path, request->remote_endpoint().address().to_string());
+
+    auto& m = metrics().endpoint(endpoint::bulk);
+    m.requests.add();
+
+    guarded(response, m, [&]() {
+      simdjson::padded_string content = read_content(request);
+      m.request_bytes.observe(content.size());
+
+      stage_timer timer(stage::parse);
+      auto bulk = std::make_shared<const bulk_request>(request->parse_query_string(), std::move(content));
+      timer.stop();
+
+      registry_t registry = st.registry.get();
+      bulk->check(*registry);
+
+      spdlog::info("bulk -> search {} queries in {}", bulk->size(), json(bulk->indexes()).dump());
 
-    request rq(j);
-    spdlog::info("request -> search {} in {}", j["id"], j["index"].dump());
+      // The size of a stream is unknown, it is compressed whenever the client accepts it.
+      auto ec = request->header.find("Accept-Encoding");
+      content_encoding encoding =
+        ec != request->header.end() ? negotiate_encoding(ec->second) : content_encoding::identity;
 
-    return rq.solve(global);
+      // Streamed by a worker of the scheduler, which bounds the number of concurrent streams.
+      st.streams.submit(
+        bulk->cost(*registry),
+        [response, bulk, registry, encoding, &st](std::chrono::nanoseconds waited) {
+          spdlog::info("bulk -> {} queries, {:.3f} ms in queue", bulk->size(), waited.count() * 1e-6);
+          stream_bulk(response, bulk, registry, st.compute, encoding);
+        },
+        expire_request(response, m));
+    });
   }
 
-  void main_server(kmq_server_options_t opt)
+  void accept_request(response_t& response, const request_t& request, server_state& st)
   {
-    index global(opt->index_path);
+    spdlog::info("POST {} from {}", request->path, request->remote_endpoint().address().to_string());
+
+    auto& m = metrics().endpoint(endpoint::query);
+    m.requests.add();
+
+    guarded(response, m, [&]() {
+      simdjson::padded_string content = read_content(request);
+      m.request_bytes.observe(content.size());
+
+      stage_timer timer(stage::parse);
+      auto rq = std::make_shared<kmq::request>(std::move(content), st.deadline);
+      timer.stop();
+
+      // Solved on the registry current at arrival, even if a reload happens meanwhile.
+      registry_t registry = st.registry.get();
+
+      result_key hash;
+      std::string key;
+      if (st.results)
+      {
+        hash = rq->cache_hash();
+        std::string cached;
+        auto same = [&rq](const std::string& k){ return rq->same_cache_key(k); };
+        if (st.results->get(hash, registry->generation(), same, cached))
+        {
+          spdlog::info("request -> {} served from cache", rq->name());
+          m.response_bytes.observe(cached.size());
+          send_response(response, request, std::move(cached));
+          return;
+        }
+        key = rq->cache_key();
+      }
+
+      spdlog::info("request -> search {} in {}", rq->name(), json(rq->indexes()).dump());
+
+      auto tracked = st.inflight.track(request.get(), rq);
+
+      auto solve = [rq, hash, key, response, request, tracked, registry, &st, &m](std::chrono::nanoseconds waited) mutable {
+        guarded(response, m, [&]() {
+          inflight_scope inflight;
+          std::string msg = rq->solve(*registry, st.batcher, &st.compute);
+
+          SimpleWeb::CaseInsensitiveMultimap head {
+            { "X-Queue-Wait-Ms", fmt::format("{:.3f}", waited.count() * 1e-6) } };
+
+          // Partial results depend on the load, they are not cached.
+          if (!rq->complete())
+          {
+            std::vector<std::string> coverage;
+            for (std::size_t i = 0; i < rq->indexes().size(); ++i)
+              coverage.push_back(fmt::format("{}={:.4f}", rq->indexes()[i], rq->coverage()[i]));
+
+            metrics().partial().add();
+            head.emplace("X-Coverage", fmt::format("{}", fmt::join(coverage, ",")));
+            spdlog::info("request -> {} cut by its deadline ({})", rq->name(), fmt::join(coverage, ", "));
+          }
+          else if (st.results)
+          {
+            st.results->put(hash, registry->generation(), std::move(key), msg);
+          }
+
+          m.response_bytes.observe(msg.size());
+          send_response(response, request, std::move(msg), head);
+        });
+      };
+
+      if (!st.scheduler)
+      {
+        solve(std::chrono::nanoseconds(0));
+        return;
+      }
+
+      auto expire = [expire = expire_request(response, m), tracked](std::size_t retry_after) {
+        expire(retry_after);
+      };
+      auto lane = st.scheduler->submit(rq->cost(*registry), std::move(solve), std::move(expire));
+      spdlog::debug("request -> {} queued in {} lane", rq->name(), lane_names[static_cast<std::size_t>(lane)]);
+    });
+  }
+
+  json cache_stats(const kindex_registry& registry, const result_cache* results)
+  {
+    json data;
+    auto cache = registry.cache();
+    data["enabled"] = cache != nullptr;
+    if (cache)
+    {
+      auto s = cache->stats();
+      data["hits"] = s.hits;
+      data["misses"] = s.misses;
+      data["evictions"] = s.evictions;
+      data["bytes"] = s.bytes;
+      data["capacity"] = s.capacity;
+      data["partitions"] = s.entries;
+    }
+
+    json& r = data["results"];
+    r["enabled"] = results != nullptr;
+    if (results)
+    {
+      auto s = results->stats();
+      r["hits"] = s.hits;
+      r["misses"] = s.misses;
+      r["evictions"] = s.evictions;
+      r["invalidations"] = s.invalidations;
+      r["bytes"] = s.bytes;
+      r["capacity"] = s.capacity;
+      r["entries"] = s.entries;
+    }
+    return data;
+  }
+
+  // Prometheus text format.
+  std::string export_metrics(const kindex_registry& registry, const result_cache* results)
+  {
+    std::stringstream ss;
+    metrics().write(ss);
+
+    std::vector<std::pair<std::string, partition_cache_stats>> caches;
+    if (auto cache = registry.cache())
+      caches.emplace_back("partition", cache->stats());
+    if (results)
+    {
+      auto s = results->stats();
+      partition_cache_stats c;
+      c.hits = s.hits;
+      c.misses = s.misses;
+      c.evictions = s.evictions;
+      c.bytes = s.bytes;
+      caches.emplace_back("result", c);
+    }
+
+    ss << "# HELP kmindex_cache_hits_total Cache hits.\n# TYPE kmindex_cache_hits_total counter\n";
+    for (auto& [name, c] : caches)
+      ss << fmt::format("kmindex_cache_hits_total{{cache=\"{}\"}} {}\n", name, c.hits);
+    ss << "# HELP kmindex_cache_misses_total Cache misses.\n# TYPE kmindex_cache_misses_total counter\n";
+    for (auto& [name, c] : caches)
+      ss << fmt::format("kmindex_cache_misses_total{{cache=\"{}\"}} {}\n", name, c.misses);
+    ss << "# HELP kmindex_cache_evictions_total Cache evictions.\n# TYPE kmindex_cache_evictions_total counter\n";
+    for (auto& [name, c] : caches)
+      ss << fmt::format("kmindex_cache_evictions_total{{cache=\"{}\"}} {}\n", name, c.evictions);
+    ss << "# HELP kmindex_cache_bytes Bytes held by the cache.\n# TYPE kmindex_cache_bytes gauge\n";
+    for (auto& [name, c] : caches)
+      ss << fmt::format("kmindex_cache_bytes{{cache=\"{}\"}} {}\n", name, c.bytes);
+    ss << "# HELP kmindex_cache_hit_ratio Hits over accesses since startup.\n# TYPE kmindex_cache_hit_ratio gauge\n";
+    for (auto& [name, c] : caches)
+    {
+      std::uint64_t n = c.hits + c.misses;
+      ss << fmt::format("kmindex_cache_hit_ratio{{cache=\"{}\"}} {}\n", name, n ? c.hits / static_cast<double>(n) : 0.0);
+    }
+
+    return ss.str();
+  }
+
+  // Requests are forwarded to the backends serving the sub-indexes, see query_router.
+  void main_router(kmq_server_options_t opt)
+  {
+    std::vector<std::string> addresses;
+    for (auto& a : split(opt->backends, ','))
+      if (!a.empty())
+        addresses.push_back(a);
+
+    if (addresses.empty())
+      throw kmq_error("--router requires --backends.");
+
+    query_router router(addresses);
+    router.discover();
 
     http_server_t server;
 
     server.resource["^/kmindex/query"]["POST"] = [&](response_t response, request_t request) {
+      spdlog::info("POST {} from {}", request->path, request->remote_endpoint().address().to_string());
+
+      auto& m = metrics().endpoint(endpoint::query);
+      m.requests.add();
+
+      guarded(response, m, [&]() {
+        std::string content = request->content.string();
+        m.request_bytes.observe(content.size());
+
+        backend_reply reply = router.query(content);
+        if (!reply.ok())
+        {
+          m.errors.add();
+          response->write(SimpleWeb::status_code(reply.status), reply.content, reply.header);
+          return;
+        }
 
-      accept_request(response, request, [&](const std::string& content) {
-        return perform_query(content, global);
+        m.response_bytes.observe(reply.content.size());
+        send_response(response, request, std::move(reply.content));
       });
+    };
+
+    server.resource["^/kmindex/bulk"]["POST"] = [&](response_t response, request_t) {
+      response->write(SimpleWeb::StatusCode::server_error_not_implemented,
+                      json_error("Bulk queries are not routed, query the backends.").dump());
+    };
+
+    server.resource["^/kmindex/infos"]["GET"] = [&](response_t response, request_t request) {
+      spdlog::info("GET {} from {}", request->path, request->remote_endpoint().address().to_string());
+      send_response(response, request, router.infos_json());
+    };
+
+    server.resource["^/kmindex/reload$"]["POST"] = [&](response_t response, request_t request) {
+      spdlog::info("POST {} from {}", request->path, request->remote_endpoint().address().to_string());
+      try {
+        router.discover();
+        send_response(response, request, router.infos_json());
+      } catch (const std::exception& e) {
+        spdlog::error("Backend discovery failed, previous routes kept -> {}", e.what());
+        response->write(SimpleWeb::StatusCode::server_error_internal_server_error,
+                        json_error(e.what()).dump());
+      }
+    };
+
+    server.resource["^/metrics$"]["GET"] = [&](response_t response, request_t) {
+      std::stringstream ss;
+      metrics().write(ss);
+      response->write(SimpleWeb::StatusCode::success_ok,
+                      ss.str(),
+                      { { "Content-type", "text/plain; version=0.0.4" } });
+    };
+
+    spdlog::info("Routing requests to {} backends.", addresses.size());
+    auto s = start_server(server, opt->address, opt->port, opt->nb_threads);
+    s.join();
+  }
+
+  void main_server(kmq_server_options_t opt)
+  {
+    compression_options& copt = response_compression();
+    copt.zlib_level = opt->zlib_level;
+    copt.zstd_level = opt->zstd_level;
+    copt.min_size = opt->compress_min_size;
+
+    if (opt->router)
+    {
+      main_router(opt);
+      return;
+    }
+
+    if (opt->index_path.empty())
+      throw kmq_error("-i/--index is required, unless --router is used.");
 
+    reload_options ropt;
+    ropt.index_path = opt->index_path;
+    ropt.prefault = opt->prefault;
+    ropt.cache_budget = opt->cache_budget * 1024 * 1024;
+    ropt.policy = str_to_cache_policy(opt->cache_policy);
+    ropt.nb_threads = opt->nb_threads;
+
+    index global(opt->index_path);
+    registry_handle registry(std::make_shared<const kindex_registry>(
+      global, ropt.prefault, ropt.cache_budget, ropt.policy, ropt.nb_threads));
+
+    registry_reloader reloader(registry, ropt);
+    if (opt->watch)
+      reloader.watch();
+
+    compute_pool compute(opt->compute_threads, opt->request_parallelism);
+    if (compute.threads() > 0)
+      spdlog::info("Requests solved by {} compute threads, at most {} per request.",
+                   compute.threads(), compute.max_per_request());
+
+    std::unique_ptr<request_batcher> batcher {nullptr};
+    if (opt->batch_window > 0)
+    {
+      batcher = std::make_unique<request_batcher>(
+        compute, std::chrono::microseconds(opt->batch_window), std::max<std::size_t>(opt->batch_max, 1));
+      spdlog::info("Concurrent requests coalesced within {} us (max {}).", opt->batch_window, opt->batch_max);
+    }
+
+    std::unique_ptr<result_cache> results {nullptr};
+    if (opt->result_cache > 0)
+      results = std::make_unique<result_cache>(opt->result_cache * 1024 * 1024);
+
+    http_server_t server;
+
+    std::unique_ptr<request_scheduler> scheduler {nullptr};
+    if (opt->queue_size > 0)
+    {
+      scheduler_options sopt;
+      sopt.small_workers = opt->small_workers;
+      sopt.large_workers = opt->large_workers;
+      sopt.queue_size = opt->queue_size;
+      sopt.large_cost = opt->large_cost;
+      sopt.timeout = std::chrono::milliseconds(opt->queue_timeout);
+      scheduler = std::make_unique<request_scheduler>(sopt);
+      spdlog::info("Requests scheduled in two lanes ({} small, {} large workers), {} pending max per lane.",
+                   opt->small_workers, opt->large_workers, opt->queue_size);
+    }
+
+    // Without scheduler, bulk streams still run on a few workers with a bounded queue.
+    std::unique_ptr<request_scheduler> bulk_scheduler {nullptr};
+    if (!scheduler)
+    {
+      scheduler_options bopt;
+      bopt.queue_size = bulk_queue_size;
+      bopt.large_cost = opt->large_cost;
+      bulk_scheduler = std::make_unique<request_scheduler>(bopt);
+    }
+
+    server_state st {registry, compute, batcher.get(), results.get(), scheduler.get(),
+                      scheduler ? *scheduler : *bulk_scheduler, opt->deadline};
+
+    server.on_error = [&](request_t request, const SimpleWeb::error_code&) {
+      st.inflight.cancel(request.get());
+    };
+
+    server.resource["^/kmindex/query"]["POST"] = [&](response_t response, request_t request) {
+      accept_request(response, request, st);
+    };
+
+    server.resource["^/kmindex/bulk"]["POST"] = [&](response_t response, request_t request) {
+      accept_bulk_request(response, request, st);
     };
 
     server.resource["^/kmindex/infos"]["GET"] = [&](response_t response, request_t request) {
-      accept_get_request(response, request, opt->index_path);
+      accept_get_request(response, request, *registry.get());
+    };
+
+    server.resource["^/kmindex/reload$"]["POST"] = [&](response_t response, request_t request) {
+      accept_reload_request(response, request, reloader);
+    };
+
+    server.resource["^/kmindex/cache"]["GET"] = [&](response_t response, request_t request) {
+      spdlog::info("GET {} from {}", request->path, request->remote_endpoint().address().to_string());
+      send_response(response, request, cache_stats(*registry.get(), results.get()).dump(4));
+    };
+
+    server.resource["^/metrics$"]["GET"] = [&](response_t response, request_t) {
+      response->write(SimpleWeb::StatusCode::success_ok,
+                      export_metrics(*registry.get(), results.get()),
+                      { { "Content-type", "text/plain; version=0.0.4" } });
     };
 
     auto s = start_server(server, opt->address, opt->port, opt->nb_threads);
@@ -17,6 +17,26 @@ namespace kmq {
     std::string log_directory;
     std::size_t nb_threads;
     bool no_stderr {false};
+    bool prefault {false};
+    std::size_t cache_budget {0};
+    std::string cache_policy;
+    std::size_t batch_window {0};
+    std::size_t batch_max {0};
+    std::size_t result_cache {0};
+    std::size_t compute_threads {0};
+    std::size_t request_parallelism {0};
+    std::size_t queue_size {0};
+    std::size_t small_workers {0};
+    std::size_t large_workers {0};
+    std::size_t large_cost {0};
+    std::size_t queue_timeout {0};
+    std::size_t deadline {0};
+    int zlib_level {6};
+    int zstd_level {3};
+    std::size_t compress_min_size {0};
+    bool watch {false};
+    bool router {false};
+    std::string backends;
   };
 
   using kmq_server_options_t = std::shared_ptr<struct kmq_server_options>;
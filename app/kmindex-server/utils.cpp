@@ -1,8 +1,70 @@
+#include <chrono>
+#include <memory>
+#include <string_view>
+
+#include <fmt/format.h>
+
 #include "compress.hpp"
+#include "metrics.hpp"
 #include "utils.hpp"
 
 namespace kmq {
 
+  // Uncompressed bytes per compression step.
+  static constexpr std::size_t compression_slice = 64 * 1024;
+
+  namespace {
+
+    // Compressed response in flight: the uncompressed message and where its compression is.
+    struct compressed_stream
+    {
+      compressed_stream(std::string&& m, content_encoding e, const compression_options& opt)
+        : msg(std::move(m)), rest(msg), compressor(e, opt) {}
+
+      std::string msg;
+      std::string_view rest;
+      stream_compressor compressor;
+      std::chrono::nanoseconds compress_time {0};
+    };
+
+    // Compresses the next slices until a chunk is produced and sends it. The following slices
+    // are compressed by the completion handler of the send, so that at most one compressed
+    // chunk is buffered and no thread waits for the client.
+    void send_slices(response_t response, std::shared_ptr<compressed_stream> s)
+    {
+      auto start = std::chrono::steady_clock::now();
+      std::string chunk;
+      bool last = false;
+      while (chunk.empty() && !last)
+      {
+        std::string_view slice = s->rest.substr(0, compression_slice);
+        s->rest.remove_prefix(slice.size());
+        last = slice.empty();
+        if (last)
+          s->compressor.finish(chunk);
+        else
+          s->compressor.write(slice, chunk);
+      }
+      s->compress_time += std::chrono::steady_clock::now() - start;
+
+      if (!chunk.empty())
+        *response << fmt::format("{:x}\r\n", chunk.size()) << chunk << "\r\n";
+
+      if (last)
+      {
+        *response << "0\r\n\r\n";
+        response->send();
+        metrics().stage(stage::compress).observe(s->compress_time.count());
+        return;
+      }
+
+      response->send([response, s](const SimpleWeb::error_code& ec) {
+        if (!ec)
+          send_slices(response, s);
+      });
+    }
+  }
+
   json json_error(const std::string& s)
   {
     json j;
@@ -10,7 +72,10 @@ namespace kmq {
     return j;
   }
 
-  void send_response(response_t& response, const request_t& request, std::string&& msg)
+  void send_response(response_t& response,
+                     const request_t& request,
+                     std::string&& msg,
+                     const SimpleWeb::CaseInsensitiveMultimap& extra)
   {
     SimpleWeb::CaseInsensitiveMultimap head;
 
@@ -25,18 +90,28 @@ namespace kmq {
         { { "Content-type", "text/csv" } } );
     }
 
+    head.insert(extra.begin(), extra.end());
+
+    const compression_options& opt = response_compression();
     auto ec = request->header.find("Accept-Encoding");
-    auto compress =
-      ec != request->header.end() && ec->second.find("deflate") != std::string::npos;
+    content_encoding encoding = ec != request->header.end() && msg.size() >= opt.min_size
+      ? negotiate_encoding(ec->second)
+      : content_encoding::identity;
 
-    if (compress)
+    if (encoding == content_encoding::identity)
     {
-      msg = compress_string(msg);
-      head.insert(std::make_pair("Content-Encoding", "deflate"));
-      head.insert(std::make_pair("Content-Length", std::to_string(msg.size())));
+      response->write(SimpleWeb::StatusCode::success_ok, msg, head);
+      return;
     }
 
-    response->write(SimpleWeb::StatusCode::success_ok, msg, head);
+    // Compressed by slices and sent chunk by chunk, with chunked transfer encoding: the
+    // compressed response is never held in a separate string.
+    head.emplace("Content-Encoding", encoding_name(encoding));
+    head.emplace("Vary", "Accept-Encoding");
+    head.emplace("Transfer-Encoding", "chunked");
+    response->write(SimpleWeb::StatusCode::success_ok, head);
+
+    send_slices(response, std::make_shared<compressed_stream>(std::move(msg), encoding, opt));
   }
 
 }
@@ -56,7 +56,10 @@ namespace kmq {
 
   json json_error(const std::string& msg);
 
-  void send_response(response_t& response, const request_t& request, std::string&& msg);
+  void send_response(response_t& response,
+                     const request_t& request,
+                     std::string&& msg,
+                     const SimpleWeb::CaseInsensitiveMultimap& extra = {});
 }
 
 #endif /* end of include guard: UTILS_HPP_OEH2LBRD */
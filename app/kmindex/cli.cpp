@@ -19,10 +19,12 @@ namespace kmq {
     m_kmq_sum_index_opt = std::make_shared<struct kmq_sum_index_options>(kmq_sum_index_options{});
     m_kmq_sum_query_opt = std::make_shared<struct kmq_sum_query_options>(kmq_sum_query_options{});
     m_kmq_query2_opt = std::make_shared<struct kmq_query2_options>(kmq_query2_options{});
+    m_kmq_daemon_opt = std::make_shared<struct kmq_daemon_options>(kmq_daemon_options{});
     kmq_build_cli(m_cli_parser, m_kmq_build_opt);
     kmq_register_cli(m_cli_parser, m_kmq_register_opt);
     kmq_query_cli(m_cli_parser, m_kmq_query_opt);
     kmq_query2_cli(m_cli_parser, m_kmq_query2_opt);
+    kmq_daemon_cli(m_cli_parser, m_kmq_daemon_opt);
     kmq_merge_cli(m_cli_parser, m_kmq_merge_opt);
     kmq_infos_cli(m_cli_parser, m_kmq_infos_opt);
 #ifdef KMINDEX_WITH_COMPRESSION
@@ -67,6 +69,8 @@ namespace kmq {
       return std::make_tuple(kmq_commands::kmq_sum_query, m_kmq_sum_query_opt);
     else if (m_cli_parser->is("query2"))
       return std::make_tuple(kmq_commands::kmq_query2, m_kmq_query2_opt);
+    else if (m_cli_parser->is("daemon"))
+      return std::make_tuple(kmq_commands::kmq_daemon, m_kmq_daemon_opt);
     else
       exit(EXIT_FAILURE);
   }
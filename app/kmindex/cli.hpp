@@ -11,6 +11,7 @@
 #include "index_sum.hpp"
 #include "query_sum.hpp"
 #include "query2.hpp"
+#include "daemon.hpp"
 
 namespace kmq {
 
@@ -36,6 +37,7 @@ namespace kmq {
       kmq_sum_index_options_t m_kmq_sum_index_opt {nullptr};
       kmq_sum_query_options_t m_kmq_sum_query_opt {nullptr};
       kmq_query2_options_t m_kmq_query2_opt {nullptr};
+      kmq_daemon_options_t m_kmq_daemon_opt {nullptr};
   };
 }
 
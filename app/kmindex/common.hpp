@@ -36,7 +36,8 @@ namespace kmq {
     kmq_compress,
     kmq_sum_index,
     kmq_sum_query,
-    kmq_query2
+    kmq_query2,
+    kmq_daemon
   };
 
   struct kmq_options
@@ -91,20 +91,11 @@ namespace kmq {
     kindex ki(infos, false);
     ThreadPool pool(nb_threads);
 
-    for (std::size_t p = 0; p < infos.nb_partitions(); ++p)
-    {
-      pool.add_task([p, &bq, &ki](int){ ki.solve_one(bq, p); });
-    }
-    pool.join_all();
+    pool.parallel_for(0, infos.nb_partitions(), [&bq, &ki](int, std::size_t p){ ki.solve_one(bq, p); });
 
     return std::make_unique<query_result>(std::move(bq.response().front()), 0, infos, false);
   }
 
-  constexpr std::uint64_t rev8(std::uint64_t x)
-  {
-      return (x | 0x7ULL) - (x & 0x7ULL);
-  }
-
   bool epsilon_equal(double a, double b, double epsilon = 1e-6)
   {
       return std::abs(a - b) < epsilon;
@@ -243,43 +234,31 @@ namespace kmq {
       spdlog::info("Permutation computed ({}), saved at '{}'.", ptime.formatted(), opath);
     }
 
-    for (std::size_t i = 0; i < sub.nb_partitions(); ++i)
-    {
-      if (o->reorder)
+    pool.parallel_for(0, sub.nb_partitions(), [&sub, &config_path, &perm_orders, reorder=o->reorder, block_size_bytes](int, std::size_t i) {
+      spdlog::debug("Compressing partition {}.", i);
+      std::string part_path = sub.get_partition(i);
+      std::string out = fmt::format("{}/matrices/blocks{}", sub.get_directory(), i);
+      std::string out_ef = out + ".ef";
+      if (reorder)
       {
-        pool.add_task([i, &sub, &config_path, &perm_orders, block_size_bytes](int) {
-          spdlog::debug("Compressing partition {}.", i);
-          std::string part_path = sub.get_partition(i);
-          std::string out = fmt::format("{}/matrices/blocks{}", sub.get_directory(), i);
-          std::string out_ef = out + ".ef";
-          bms::reorder_matrix_columns_and_compress(part_path,
-                                                   out,
-                                                   out_ef,
-                                                   config_path,
-                                                   49,
-                                                   sub.nb_samples(),
-                                                   sub.bloom_size() / sub.nb_partitions(),
-                                                   perm_orders,
-                                                   block_size_bytes);
-          spdlog::debug("Partition {} compressed.", i);
-        });
+        bms::reorder_matrix_columns_and_compress(part_path,
+                                                 out,
+                                                 out_ef,
+                                                 config_path,
+                                                 49,
+                                                 sub.nb_samples(),
+                                                 sub.bloom_size() / sub.nb_partitions(),
+                                                 perm_orders,
+                                                 block_size_bytes);
       }
       else
       {
-        pool.add_task([i, &sub, &config_path] (int) {
-          spdlog::debug("Compressing partition {}.", i);
-          std::string part_path = sub.get_partition(i);
-          std::string out = fmt::format("{}/matrices/blocks{}", sub.get_directory(), i);
-          std::string out_ef = out + ".ef";
-          BlockCompressorZSTD bc(out, out_ef, config_path);
-          bc.compress_file(sub.get_partition(i), 49);
-          bc.close();
-          spdlog::debug("Partition {} compressed.", i);
-        });
+        BlockCompressorZSTD bc(out, out_ef, config_path);
+        bc.compress_file(part_path, 49);
+        bc.close();
       }
-    }
-
-    pool.join_all();
+      spdlog::debug("Partition {} compressed.", i);
+    });
 
     fs::copy_file(config_path, sub.get_compression_config(), fs::copy_options::overwrite_existing);
     fs::remove(config_path);
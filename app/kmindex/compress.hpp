@@ -3,6 +3,8 @@
 
 #ifdef KMINDEX_WITH_COMPRESSION
 
+#include <vector>
+
 #include "common.hpp"
 
 namespace kmq {
@@ -26,6 +28,19 @@ namespace kmq {
   kmq_options_t kmq_compress_cli(parser_t parser, kmq_compress_options_t);
 
   void main_compress(kmq_options_t opt);
+
+  // Column orders computed by bitmatrixshuffle index the bits of a byte from the most
+  // significant one: sample i takes the column rev8(order[rev8(i)]).
+  constexpr std::uint64_t rev8(std::uint64_t x)
+  {
+      return (x | 0x7ULL) - (x & 0x7ULL);
+  }
+
+  // Keeps the padding columns of the last byte in place.
+  void immutable_filling_columns_inplace(std::vector<std::uint64_t>& order, const std::size_t SAMPLES);
+
+  // Reorders the lines of a fof as the columns, the original is kept in '.bak'.
+  void reorder_fof(const std::string& fof_path, const std::size_t SAMPLES, const std::vector<std::uint64_t>& order);
 }
 
 #endif
@@ -0,0 +1,362 @@
+#include "daemon.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <kmindex/index/index.hpp>
+#include <kmindex/index/kindex.hpp>
+#include <kmindex/index/partition_cache.hpp>
+#include <kmindex/query/query.hpp>
+#include <kmindex/query/query_results.hpp>
+#include <kmindex/threadpool.hpp>
+#include <kmindex/utils.hpp>
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include "daemon_protocol.hpp"
+
+namespace kmq {
+
+  kmq_options_t kmq_daemon_cli(parser_t parser, kmq_daemon_options_t options)
+  {
+    auto cmd = parser->add_command("daemon", "Serve queries on a Unix socket (see kmindex query --daemon-socket).");
+
+    cmd->add_param("-i/--index", "Global index path.")
+       ->meta("STR")
+       ->checker(bc::check::is_dir)
+       ->setter(options->global_index_path);
+
+    cmd->add_param("-s/--socket", "Unix socket path.")
+       ->meta("STR")
+       ->setter(options->socket);
+
+    auto name_setter = [options](const std::string& v) {
+      if (v != "all")
+        options->index_names = bc::utils::split(v, ',');
+    };
+
+    cmd->add_param("-n/--names", "Sub-indexes to serve, comma separated.")
+       ->meta("STR")
+       ->def("all")
+       ->setter_c(name_setter);
+
+    cmd->add_param("--prefault", "Load the partitions in memory at startup.")
+       ->as_flag()
+       ->setter(options->prefault);
+
+    add_common_options(cmd, options, true);
+
+    return options;
+  }
+
+  namespace {
+
+    std::atomic<bool> stop_requested {false};
+
+    void request_stop(int)
+    {
+      stop_requested = true;
+    }
+
+    // Sub-indexes mapped once at startup, shared by all the connections. Compressed partitions
+    // decode into their own buffers and cannot be shared by a kindex, they are kept open in a
+    // partition cache without budget, which serializes the lookups of each partition.
+    class query_daemon
+    {
+      struct served_index
+      {
+        index_infos infos;
+        // nullptr for a compressed sub-index.
+        std::unique_ptr<kindex> ki;
+      };
+
+      public:
+        query_daemon(const kmq_daemon_options_t& o)
+          : m_path(fs::canonical(o->global_index_path).string()),
+            m_compressed(std::numeric_limits<std::size_t>::max())
+        {
+          Timer timer;
+          index global(o->global_index_path);
+
+          for (auto& name : o->index_names.empty() ? global.all() : o->index_names)
+          {
+            const index_infos& infos = global.get(name);
+            served_index& s = m_indexes.emplace(name, served_index {infos, nullptr}).first->second;
+            if (!infos.is_compressed_index())
+              s.ki = std::make_unique<kindex>(infos, true);
+          }
+
+          if (o->prefault)
+          {
+            ThreadPool pool(o->nb_threads);
+            std::vector<kindex*> kis;
+            for (auto& [_, s] : m_indexes)
+              if (s.ki)
+                kis.push_back(s.ki.get());
+            pool.parallel_for(0, kis.size(), [&kis](int, std::size_t i){
+              kis[i]->prefault();
+            });
+          }
+
+          spdlog::info("{} sub-indexes mapped{} ({}).",
+                       m_indexes.size(), o->prefault ? " and prefaulted" : "", timer.formatted());
+        }
+
+        // Answers the requests of a connection until the client closes it, or sends a frame
+        // too large to be read.
+        void serve(int fd, ThreadPool& pool) const
+        {
+          std::string payload;
+          while (true)
+          {
+            daemon::writer w;
+            w.start();
+
+            try
+            {
+              if (!daemon::recv_frame(fd, payload))
+                return;
+            }
+            catch (const kmq_invalid_request& e)
+            {
+              spdlog::warn("Request rejected -> {}", e.what());
+              w.put(daemon::status::error);
+              w.put(std::string_view(e.what()));
+              daemon::send_frame(fd, w.finish());
+              return;
+            }
+
+            try
+            {
+              std::vector<daemon::output> outputs = solve(payload, pool);
+              w.put(daemon::status::ok);
+              w.put<std::uint32_t>(outputs.size());
+              for (auto& out : outputs)
+              {
+                w.put(std::string_view(out.name));
+                w.put(std::string_view(out.data));
+              }
+              if (w.size() - sizeof(std::uint64_t) > daemon::max_frame_size)
+                throw kmq_error(fmt::format("Results too large ({} bytes, max is {}), split the queries.",
+                                            w.size() - sizeof(std::uint64_t), daemon::max_frame_size));
+            }
+            catch (const std::exception& e)
+            {
+              spdlog::warn("Request failed -> {}", e.what());
+              w.start();
+              w.put(daemon::status::error);
+              w.put(std::string_view(e.what()));
+            }
+            daemon::send_frame(fd, w.finish());
+          }
+        }
+
+      private:
+        std::vector<daemon::output> solve(const std::string& payload, ThreadPool& pool) const
+        {
+          Timer timer;
+          daemon::reader r(payload);
+
+          if (auto v = r.get<std::uint8_t>(); v != daemon::version)
+            throw kmq_invalid_request(fmt::format("Protocol version {}, expected {}.", v, daemon::version));
+
+          daemon::request rq;
+          rq.index_path = r.get_str();
+          if (rq.index_path != m_path)
+            throw kmq_invalid_index(fmt::format("{} is not served by this daemon ({}).", rq.index_path, m_path));
+
+          std::uint32_t nb_names = r.get<std::uint32_t>();
+          for (std::uint32_t i = 0; i < nb_names; ++i)
+            rq.names.emplace_back(r.get_str());
+          rq.z = r.get<std::uint8_t>();
+          rq.threshold = r.get<double>();
+          rq.format = static_cast<enum format>(r.get<std::uint8_t>());
+          rq.single = r.get_str();
+
+          std::uint64_t nb_records = r.get<std::uint64_t>();
+          if (nb_records > r.remaining() / (2 * sizeof(std::uint64_t)))
+            throw kmq_invalid_request("Truncated daemon message.");
+          std::vector<std::pair<std::string_view, std::string_view>> records(nb_records);
+          for (auto& [name, seq] : records)
+          {
+            name = r.get_str();
+            seq = r.get_str();
+          }
+
+          if (rq.names.empty())
+            for (auto& [name, _] : m_indexes)
+              rq.names.push_back(name);
+
+          std::vector<const served_index*> served;
+          for (auto& name : rq.names)
+          {
+            auto it = m_indexes.find(name);
+            if (it == m_indexes.end())
+              throw kmq_invalid_index(fmt::format("'{}' is not served by this daemon", name));
+            served.push_back(&it->second);
+          }
+
+          bool wpos = rq.format == format::json_with_positions || rq.format == format::jsonl_with_positions;
+
+          // Sub-indexes with the same configuration share their s-mers, as in the query command.
+          std::unordered_map<std::string, smer_batch_t> batches;
+          std::vector<daemon::output> outputs(served.size());
+
+          for (std::size_t i = 0; i < served.size(); ++i)
+          {
+            const index_infos& infos = served[i]->infos;
+            auto& smers = batches[infos.sha1()];
+            if (!smers)
+            {
+              smers = std::make_shared<smer_batch>(infos.nb_partitions(),
+                                                   infos.smer_size(),
+                                                   infos.get_repartition(),
+                                                   infos.get_hash_w(),
+                                                   infos.minim_size());
+              for (auto& [name, seq] : records)
+              {
+                if (seq.size() < infos.smer_size() + rq.z)
+                  spdlog::warn("'{}' skipped: min size is s+z={}", name, infos.smer_size() + rq.z);
+                else
+                  smers->add_query(std::string(name), seq);
+              }
+            }
+
+            batch_query bq(infos.nb_samples(), rq.z, infos.bw(), smers);
+            // Partitions are opened once, lookups of distinct partitions do not interfere.
+            if (kindex* ki = served[i]->ki.get())
+            {
+              pool.parallel_for(0, infos.nb_partitions(), [ki, &bq](int, std::size_t p){
+                ki->solve_partition(bq, p);
+              });
+            }
+            else
+            {
+              pool.parallel_for(0, infos.nb_partitions(), [this, &infos, &bq](int, std::size_t p){
+                m_compressed.solve(infos, bq, p);
+              });
+            }
+
+            query_result_agg agg;
+            for (auto&& res : bq.response())
+              agg.add(query_result(std::move(res), rq.z, infos, wpos));
+
+            std::ostringstream ss;
+            agg.output(infos, ss, rq.format, rq.single, rq.threshold);
+            outputs[i] = {infos.name(), ss.str()};
+          }
+
+          spdlog::debug("{} sequences, {} sub-indexes ({}).", records.size(), served.size(), timer.formatted());
+          return outputs;
+        }
+
+      private:
+        std::string m_path;
+        std::map<std::string, served_index> m_indexes;
+        mutable partition_cache m_compressed;
+    };
+
+    int listen_on(const std::string& path)
+    {
+      // A socket left by a daemon that did not exit cleanly is replaced, a live one is not.
+      if (fs::exists(path))
+      {
+        if (int fd = daemon::connect_to(path); fd >= 0)
+        {
+          ::close(fd);
+          throw kmq_error(fmt::format("A daemon already listens on {}", path));
+        }
+        fs::remove(path);
+      }
+
+      sockaddr_un addr = daemon::socket_address(path);
+      int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0 ||
+          ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+          ::listen(fd, SOMAXCONN) < 0)
+      {
+        throw kmq_io_error(fmt::format("Unable to listen on {} ({})", path, std::strerror(errno)));
+      }
+      return fd;
+    }
+  }
+
+  void main_daemon(kmq_options_t opt)
+  {
+    kmq_daemon_options_t o = std::static_pointer_cast<struct kmq_daemon_options>(opt);
+
+    query_daemon d(o);
+
+    // Connections have their own thread, blocked on the socket between requests. Lookups of all
+    // the requests share the pool.
+    ThreadPool pool(o->nb_threads);
+    std::atomic<std::size_t> active {0};
+    // Open connections, shut down on stop so that idle ones do not keep the daemon alive.
+    std::mutex connections_mutex;
+    std::set<int> connections;
+    int fd = listen_on(o->socket);
+
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+
+    spdlog::info("Listening on {}.", o->socket);
+
+    while (!stop_requested)
+    {
+      pollfd pfd {fd, POLLIN, 0};
+      if (::poll(&pfd, 1, 200) <= 0)
+        continue;
+
+      int c = ::accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (c < 0)
+        continue;
+
+      ++active;
+      {
+        std::unique_lock<std::mutex> lock(connections_mutex);
+        connections.insert(c);
+      }
+      std::thread([&d, &pool, &active, &connections_mutex, &connections, c]() {
+        try {
+          d.serve(c, pool);
+        } catch (const std::exception& e) {
+          spdlog::warn("Connection closed -> {}", e.what());
+        }
+        {
+          std::unique_lock<std::mutex> lock(connections_mutex);
+          connections.erase(c);
+        }
+        ::close(c);
+        --active;
+      }).detach();
+    }
+
+    ::close(fd);
+    fs::remove(o->socket);
+
+    // Requests in progress are completed, connections waiting for the next one see it closed.
+    {
+      std::unique_lock<std::mutex> lock(connections_mutex);
+      for (int c : connections)
+        ::shutdown(c, SHUT_RD);
+    }
+    while (active > 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    pool.join_all();
+    spdlog::info("Daemon stopped.");
+  }
+}
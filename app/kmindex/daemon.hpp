@@ -0,0 +1,23 @@
+#ifndef DAEMON_HPP_N5TQX2VB
+#define DAEMON_HPP_N5TQX2VB
+
+#include <vector>
+#include "common.hpp"
+
+namespace kmq {
+
+  struct kmq_daemon_options : kmq_options
+  {
+    std::string socket;
+    std::vector<std::string> index_names;
+    bool prefault {false};
+  };
+
+  using kmq_daemon_options_t = std::shared_ptr<struct kmq_daemon_options>;
+
+  kmq_options_t kmq_daemon_cli(parser_t parser, kmq_daemon_options_t options);
+
+  void main_daemon(kmq_options_t opt);
+}
+
+#endif /* end of include guard: DAEMON_HPP_N5TQX2VB */
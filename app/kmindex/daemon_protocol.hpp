@@ -0,0 +1,228 @@
+#ifndef DAEMON_PROTOCOL_HPP_W3KZR7PD
+#define DAEMON_PROTOCOL_HPP_W3KZR7PD
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <kmindex/exceptions.hpp>
+#include <kmindex/query/format.hpp>
+
+#include <fmt/format.h>
+
+namespace kmq {
+
+  // Messages exchanged with 'kmindex daemon' over a Unix socket. Each message is a frame: its
+  // size (u64) then its payload. Integers are in host byte order, both ends run on the same
+  // host. Strings are their size (u64) followed by their bytes.
+  //
+  // request:  version (u8), index path, nb names (u32), names, z (u8), threshold (f64),
+  //           format (u8), single query name, nb records (u64), records (name, sequence)
+  // response: status (u8), then on success nb outputs (u32) and outputs (sub-index, formatted
+  //           results), on error the message.
+  namespace daemon {
+
+    constexpr std::uint8_t version = 1;
+
+    // Larger frames are rejected before their payload is allocated.
+    constexpr std::uint64_t max_frame_size = std::uint64_t {4} << 30;
+
+    enum class status : std::uint8_t
+    {
+      ok = 0,
+      error = 1
+    };
+
+    class writer
+    {
+      public:
+        template<typename T>
+        void put(T v)
+        {
+          static_assert(std::is_trivially_copyable_v<T>);
+          m_data.append(reinterpret_cast<const char*>(&v), sizeof(T));
+        }
+
+        void put(std::string_view s)
+        {
+          put<std::uint64_t>(s.size());
+          m_data.append(s.data(), s.size());
+        }
+
+        // Overwrites a value written at 'offset' (see size()).
+        template<typename T>
+        void set(std::size_t offset, T v)
+        {
+          std::memcpy(m_data.data() + offset, &v, sizeof(T));
+        }
+
+        std::size_t size() const
+        {
+          return m_data.size();
+        }
+
+        // Frame size, set when all the payload is written.
+        void start()
+        {
+          m_data.assign(sizeof(std::uint64_t), '\0');
+        }
+
+        const std::string& finish()
+        {
+          std::uint64_t size = m_data.size() - sizeof(std::uint64_t);
+          std::memcpy(m_data.data(), &size, sizeof(size));
+          return m_data;
+        }
+
+      private:
+        std::string m_data;
+    };
+
+    class reader
+    {
+      public:
+        reader(std::string_view data)
+          : m_data(data) {}
+
+        template<typename T>
+        T get()
+        {
+          static_assert(std::is_trivially_copyable_v<T>);
+          need(sizeof(T));
+          T v;
+          std::memcpy(&v, m_data.data(), sizeof(T));
+          m_data.remove_prefix(sizeof(T));
+          return v;
+        }
+
+        std::string_view get_str()
+        {
+          std::uint64_t size = get<std::uint64_t>();
+          need(size);
+          std::string_view s = m_data.substr(0, size);
+          m_data.remove_prefix(size);
+          return s;
+        }
+
+        std::size_t remaining() const
+        {
+          return m_data.size();
+        }
+
+      private:
+        void need(std::size_t n) const
+        {
+          if (m_data.size() < n)
+            throw kmq_invalid_request("Truncated daemon message.");
+        }
+
+      private:
+        std::string_view m_data;
+    };
+
+    inline void write_all(int fd, const char* data, std::size_t n)
+    {
+      while (n > 0)
+      {
+        ssize_t w = ::send(fd, data, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+          continue;
+        if (w <= 0)
+          throw kmq_io_error(fmt::format("Daemon socket: {}", std::strerror(errno)));
+        data += w;
+        n -= w;
+      }
+    }
+
+    // False if the peer closed the connection before the first byte.
+    inline bool read_all(int fd, char* data, std::size_t n)
+    {
+      std::size_t done = 0;
+      while (done < n)
+      {
+        ssize_t r = ::recv(fd, data + done, n - done, 0);
+        if (r < 0 && errno == EINTR)
+          continue;
+        if (r == 0 && done == 0)
+          return false;
+        if (r <= 0)
+          throw kmq_io_error(fmt::format("Daemon socket: {}",
+                                         r == 0 ? "connection closed" : std::strerror(errno)));
+        done += r;
+      }
+      return true;
+    }
+
+    inline void send_frame(int fd, const std::string& frame)
+    {
+      write_all(fd, frame.data(), frame.size());
+    }
+
+    // False on end of stream. Throws kmq_invalid_request on a frame above max_frame_size, its
+    // payload is left unread and the connection cannot be used anymore.
+    inline bool recv_frame(int fd, std::string& payload)
+    {
+      std::uint64_t size = 0;
+      if (!read_all(fd, reinterpret_cast<char*>(&size), sizeof(size)))
+        return false;
+      if (size > max_frame_size)
+        throw kmq_invalid_request(
+          fmt::format("Daemon message of {} bytes, max is {}.", size, max_frame_size));
+      payload.resize(size);
+      if (size > 0 && !read_all(fd, payload.data(), size))
+        throw kmq_io_error("Daemon socket: connection closed");
+      return true;
+    }
+
+    inline sockaddr_un socket_address(const std::string& path)
+    {
+      sockaddr_un addr {};
+      addr.sun_family = AF_UNIX;
+      if (path.size() >= sizeof(addr.sun_path))
+        throw kmq_error(fmt::format("Socket path too long: {}", path));
+      std::memcpy(addr.sun_path, path.data(), path.size());
+      return addr;
+    }
+
+    // Returns -1 if nothing listens on 'path'.
+    inline int connect_to(const std::string& path)
+    {
+      sockaddr_un addr = socket_address(path);
+      int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0)
+        throw kmq_io_error(fmt::format("Daemon socket: {}", std::strerror(errno)));
+      if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+      {
+        ::close(fd);
+        return -1;
+      }
+      return fd;
+    }
+
+    struct output
+    {
+      std::string name;
+      std::string data;
+    };
+
+    struct request
+    {
+      std::string index_path;
+      std::vector<std::string> names;
+      std::size_t z {0};
+      double threshold {0.0};
+      enum format format {format::json};
+      std::string single;
+    };
+  }
+}
+
+#endif /* end of include guard: DAEMON_PROTOCOL_HPP_W3KZR7PD */
@@ -0,0 +1,646 @@
+#include "fastx_reader.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <fmt/format.h>
+#include <spdlog/spdlog.h>
+
+#include <kseq++/seqio.hpp>
+
+#include <kmindex/exceptions.hpp>
+#include <kmindex/utils.hpp>
+
+namespace kmq {
+
+  namespace {
+
+    struct bgzf_block
+    {
+      std::size_t size {0};
+      std::size_t payload {0};
+      std::size_t payload_size {0};
+      std::uint32_t crc {0};
+      std::uint32_t isize {0};
+    };
+
+    inline std::uint32_t le32(const unsigned char* p)
+    {
+      return static_cast<std::uint32_t>(p[0])
+           | static_cast<std::uint32_t>(p[1]) << 8
+           | static_cast<std::uint32_t>(p[2]) << 16
+           | static_cast<std::uint32_t>(p[3]) << 24;
+    }
+
+    inline std::size_t le16(const unsigned char* p)
+    {
+      return static_cast<std::size_t>(p[0]) | static_cast<std::size_t>(p[1]) << 8;
+    }
+
+    // Private writable mapping: pages are copied on write, so records can be joined in place
+    // without touching the file.
+    std::shared_ptr<char> map_file(const std::string& path, std::size_t& size, bool writable)
+    {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+        throw kmq_io_error(fmt::format("Unable to read at {}.", path));
+
+      struct stat st;
+      if (::fstat(fd, &st) < 0)
+      {
+        ::close(fd);
+        throw kmq_io_error(fmt::format("Unable to stat {}.", path));
+      }
+
+      size = static_cast<std::size_t>(st.st_size);
+      if (size == 0)
+      {
+        ::close(fd);
+        return nullptr;
+      }
+
+      int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+      void* m = ::mmap(nullptr, size, prot, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+
+      if (m == MAP_FAILED)
+        throw kmq_io_error(fmt::format("Unable to map {}.", path));
+
+      ::madvise(m, size, MADV_SEQUENTIAL);
+
+      return std::shared_ptr<char>(static_cast<char*>(m), [size](char* p){ ::munmap(p, size); });
+    }
+
+    bgzf_block read_bgzf_block(const unsigned char* u, std::size_t size, std::size_t pos, const std::string& path)
+    {
+      auto invalid = [&](){
+        return kmq_io_error(fmt::format("{}: invalid BGZF block at offset {}.", path, pos));
+      };
+
+      if (size - pos < 18 || u[pos] != 0x1f || u[pos + 1] != 0x8b || u[pos + 2] != 8 || !(u[pos + 3] & 4))
+        throw invalid();
+
+      std::size_t xlen = le16(u + pos + 10);
+      if (pos + 12 + xlen > size)
+        throw invalid();
+
+      std::size_t bsize = 0;
+      for (std::size_t x = pos + 12; x + 4 <= pos + 12 + xlen;)
+      {
+        std::size_t slen = le16(u + x + 2);
+        if (u[x] == 'B' && u[x + 1] == 'C' && slen == 2)
+        {
+          bsize = le16(u + x + 4) + 1;
+          break;
+        }
+        x += 4 + slen;
+      }
+
+      if (bsize < 12 + xlen + 8 || pos + bsize > size)
+        throw invalid();
+
+      bgzf_block b;
+      b.size = bsize;
+      b.payload = pos + 12 + xlen;
+      b.payload_size = bsize - 12 - xlen - 8;
+      b.crc = le32(u + pos + bsize - 8);
+      b.isize = le32(u + pos + bsize - 4);
+      return b;
+    }
+
+    void inflate_blocks(const unsigned char* u,
+                        const std::vector<bgzf_block>& blocks,
+                        std::string& out,
+                        std::size_t slack)
+    {
+      std::size_t total = 0;
+      for (auto& b : blocks)
+        total += b.isize;
+
+      out.reserve(total + slack);
+      out.resize(total);
+
+      z_stream zs {};
+      if (inflateInit2(&zs, -15) != Z_OK)
+        throw kmq_error("Unable to initialize zlib stream.");
+
+      std::size_t o = 0;
+      for (auto& b : blocks)
+      {
+        inflateReset(&zs);
+        zs.next_in = const_cast<Bytef*>(u + b.payload);
+        zs.avail_in = static_cast<uInt>(b.payload_size);
+        zs.next_out = reinterpret_cast<Bytef*>(out.data() + o);
+        zs.avail_out = b.isize;
+
+        int ret = inflate(&zs, Z_FINISH);
+        if (ret != Z_STREAM_END || zs.avail_out != 0 ||
+            crc32(0L, reinterpret_cast<const Bytef*>(out.data() + o), b.isize) != b.crc)
+        {
+          inflateEnd(&zs);
+          throw kmq_io_error("Corrupted BGZF block.");
+        }
+        o += b.isize;
+      }
+      inflateEnd(&zs);
+    }
+  }
+
+  input_codec detect_codec(const std::string& path)
+  {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.good())
+      throw kmq_io_error(fmt::format("Unable to read at {}.", path));
+
+    std::array<unsigned char, 16> h {};
+    in.read(reinterpret_cast<char*>(h.data()), h.size());
+    std::size_t n = in.gcount();
+
+    if (n >= 2 && h[0] == 0x1f && h[1] == 0x8b)
+    {
+      if (n >= 16 && (h[3] & 4) && h[12] == 'B' && h[13] == 'C' && h[14] == 2 && h[15] == 0)
+        return input_codec::bgzf;
+      return input_codec::gzip;
+    }
+
+    if (n >= 3 && h[0] == 'B' && h[1] == 'Z' && h[2] == 'h')
+      return input_codec::bzip2;
+
+    return input_codec::plain;
+  }
+
+  fastx_reader::fastx_reader(std::vector<std::string> paths, ThreadPool& pool, std::size_t chunk_size)
+    : m_paths(std::move(paths)),
+      m_pool(pool),
+      m_chunk_size(chunk_size),
+      m_wave(std::max<std::size_t>(2, 2 * pool.size()))
+  {
+  }
+
+  void fastx_reader::read(const sink_type& sink)
+  {
+    m_pool.parallel_for(0, m_paths.size(), [this, &sink](int, std::size_t i){
+      read_file(m_paths[i], sink);
+    });
+  }
+
+  std::size_t fastx_reader::nb_records() const
+  {
+    return m_records.load();
+  }
+
+  std::size_t fastx_reader::nb_bytes() const
+  {
+    return m_bytes.load();
+  }
+
+  void fastx_reader::read_file(const std::string& path, const sink_type& sink)
+  {
+    Timer timer;
+    switch (detect_codec(path))
+    {
+      case input_codec::plain:
+        read_mapped(path, sink);
+        break;
+      case input_codec::bgzf:
+        read_bgzf(path, sink);
+        break;
+      case input_codec::gzip:
+        read_gzip(path, sink);
+        break;
+      case input_codec::bzip2:
+        read_kseq(path, sink);
+        break;
+    }
+    spdlog::debug("'{}' read ({}).", path, timer.formatted());
+  }
+
+  bool fastx_reader::emit(std::vector<fastx_chunk_t>& chunks, const sink_type& sink, std::size_t& emitted)
+  {
+    bool ok = true;
+    for (auto& c : chunks)
+    {
+      if (!c)
+      {
+        ok = false;
+        break;
+      }
+      m_records += c->size();
+      emitted += c->size();
+      sink(std::move(c));
+    }
+    chunks.clear();
+    return ok;
+  }
+
+  void fastx_reader::read_mapped(const std::string& path, const sink_type& sink)
+  {
+    std::size_t size = 0;
+    auto data = map_file(path, size, true);
+    if (!data)
+      return;
+
+    char* begin = data.get();
+    char* end = begin + size;
+    fastx_type type = guess_fastx_type(begin, end);
+
+    if (type == fastx_type::fastq && !is_four_line_fastq(begin, end))
+    {
+      spdlog::debug("'{}': multi-line FASTQ records, parsed sequentially.", path);
+      parse_multiline(data, begin, end, sink);
+      m_bytes += size;
+      return;
+    }
+
+    std::vector<char*> bounds {begin};
+    while (bounds.back() < end)
+    {
+      if (static_cast<std::size_t>(end - bounds.back()) <= m_chunk_size)
+      {
+        bounds.push_back(end);
+        break;
+      }
+      const char* from = bounds.back() + m_chunk_size;
+      bounds.push_back(begin + (next_fastx_record(begin, end, from, type) - begin));
+    }
+
+    std::size_t nb_segments = bounds.size() - 1;
+    std::vector<fastx_chunk_t> chunks;
+    std::size_t emitted = 0;
+    for (std::size_t w = 0; w < nb_segments; w += m_wave)
+    {
+      std::size_t n = std::min(m_wave, nb_segments - w);
+      chunks.assign(n, nullptr);
+      m_pool.parallel_for(0, n, [&](int, std::size_t i){
+        auto c = std::make_shared<fastx_chunk>(data);
+        if (parse_fastx(bounds[w + i], bounds[w + i + 1], type, c->records()))
+          chunks[i] = std::move(c);
+      });
+
+      // The chunks before the first one holding a multi-line record start and end on record
+      // boundaries, the rest of the file is parsed sequentially from the start of that one.
+      std::size_t failed = std::find(chunks.begin(), chunks.end(), nullptr) - chunks.begin();
+      if (!emit(chunks, sink, emitted))
+      {
+        spdlog::debug("'{}': multi-line FASTQ records after {} records, parsed sequentially.", path, emitted);
+        parse_multiline(data, bounds[w + failed], end, sink);
+        break;
+      }
+    }
+    m_bytes += size;
+  }
+
+  void fastx_reader::parse_multiline(std::shared_ptr<char> data, char* begin, char* end, const sink_type& sink)
+  {
+    auto c = std::make_shared<fastx_chunk>(data);
+    std::vector<fastx_record_view> records;
+    parse_fastx(begin, end, fastx_type::fastq, records, true);
+
+    // Delivered by chunks of about the usual size.
+    std::size_t bytes = 0;
+    for (auto& r : records)
+    {
+      c->records().push_back(r);
+      bytes += r.name.size() + r.seq.size();
+      if (bytes >= m_chunk_size)
+      {
+        m_records += c->size();
+        sink(std::move(c));
+        c = std::make_shared<fastx_chunk>(data);
+        bytes = 0;
+      }
+    }
+
+    if (c->size() > 0)
+    {
+      m_records += c->size();
+      sink(std::move(c));
+    }
+  }
+
+  std::vector<std::shared_ptr<fastx_reader::segment>> fastx_reader::stitch(std::vector<segment>& segments,
+                                                                           segment& pending,
+                                                                           bool& has_pending,
+                                                                           bool last,
+                                                                           fastx_type type)
+  {
+    static constexpr std::size_t npos = std::string::npos;
+
+    std::vector<segment*> segs;
+    if (has_pending)
+      segs.push_back(&pending);
+    for (auto& s : segments)
+      segs.push_back(&s);
+
+    std::vector<std::shared_ptr<segment>> ready;
+    if (segs.empty())
+      return ready;
+
+    // First record start of each segment. Segments are cut anywhere, skip the partial line.
+    char last_char = segs[0]->data.empty() ? '\n' : segs[0]->data.back();
+    for (std::size_t j = 1; j < segs.size(); ++j)
+    {
+      auto& s = *segs[j];
+      const char* b = s.data.data();
+      const char* e = b + s.data.size();
+      const char* from = b;
+      if (last_char != '\n')
+      {
+        const void* nl = std::memchr(b, '\n', e - b);
+        from = nl ? static_cast<const char*>(nl) + 1 : e;
+      }
+      const char* r = from < e ? next_fastx_record(from, e, from, type) : e;
+      s.start = r == e ? npos : static_cast<std::size_t>(r - b);
+      if (!s.data.empty())
+        last_char = s.data.back();
+    }
+
+    std::vector<std::size_t> live;
+    for (std::size_t j = 0; j < segs.size(); ++j)
+      if (j == 0 || segs[j]->start != npos)
+        live.push_back(j);
+
+    // A segment owns the records starting in it, it takes the end of the last one from the
+    // following segments.
+    for (std::size_t k = 0; k < live.size(); ++k)
+    {
+      auto& s = *segs[live[k]];
+      std::size_t next = k + 1 < live.size() ? live[k + 1] : segs.size();
+      for (std::size_t m = live[k] + 1; m < next; ++m)
+        s.data.append(segs[m]->data);
+      if (next < segs.size())
+        s.data.append(segs[next]->data, 0, segs[next]->start);
+    }
+
+    std::size_t complete = last ? live.size() : live.size() - 1;
+    for (std::size_t k = 0; k < complete; ++k)
+    {
+      auto& s = *segs[live[k]];
+      m_bytes += s.data.size() - s.start;
+      ready.push_back(std::make_shared<segment>(std::move(s)));
+    }
+
+    if (last)
+    {
+      has_pending = false;
+      pending = segment{};
+    }
+    else
+    {
+      if (segs[live.back()] != &pending)
+        pending = std::move(*segs[live.back()]);
+      has_pending = true;
+    }
+
+    return ready;
+  }
+
+  void fastx_reader::parse(task_group& group,
+                           std::vector<std::shared_ptr<segment>>& ready,
+                           std::vector<fastx_chunk_t>& chunks,
+                           fastx_type type)
+  {
+    chunks.assign(ready.size(), nullptr);
+    for (std::size_t i = 0; i < ready.size(); ++i)
+    {
+      m_pool.add_task(group, [&ready, &chunks, i, type](int){
+        auto& s = ready[i];
+        auto c = std::make_shared<fastx_chunk>(s);
+        char* b = s->data.data();
+        if (parse_fastx(b + s->start, b + s->data.size(), type, c->records()))
+          chunks[i] = std::move(c);
+      });
+    }
+  }
+
+  void fastx_reader::read_bgzf(const std::string& path, const sink_type& sink)
+  {
+    std::size_t size = 0;
+    auto data = map_file(path, size, false);
+    if (!data)
+      return;
+
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(data.get());
+    const std::size_t slack = m_chunk_size >> 4;
+
+    segment pending;
+    bool has_pending = false;
+    bool first = true;
+    fastx_type type = fastx_type::fasta;
+
+    task_group group;
+    std::vector<std::shared_ptr<segment>> ready;
+    std::vector<fastx_chunk_t> chunks;
+    std::size_t emitted = 0;
+
+    std::size_t pos = 0;
+    try
+    {
+      bool last = false;
+      while (!last)
+      {
+        std::vector<std::vector<bgzf_block>> groups;
+        while (groups.size() < m_wave && pos < size)
+        {
+          std::vector<bgzf_block> g;
+          std::size_t total = 0;
+          while (pos < size && total < m_chunk_size)
+          {
+            auto b = read_bgzf_block(u, size, pos, path);
+            pos += b.size;
+            if (b.isize > 0)
+            {
+              g.push_back(b);
+              total += b.isize;
+            }
+          }
+          if (!g.empty())
+            groups.push_back(std::move(g));
+        }
+        last = pos >= size;
+
+        // Inflate the next wave while the previous one is parsed.
+        std::vector<segment> wave(groups.size());
+        m_pool.parallel_for(0, groups.size(), [&](int, std::size_t i){
+          inflate_blocks(u, groups[i], wave[i].data, slack);
+        });
+
+        if (first && !wave.empty())
+        {
+          const char* b = wave[0].data.data();
+          const char* e = b + wave[0].data.size();
+          type = guess_fastx_type(b, e);
+          first = false;
+
+          // Nothing is emitted yet.
+          if (type == fastx_type::fastq && !is_four_line_fastq(b, e))
+          {
+            read_multiline(path, sink, 0);
+            return;
+          }
+        }
+
+        m_pool.wait(group);
+        if (!emit(chunks, sink, emitted))
+        {
+          read_multiline(path, sink, emitted);
+          return;
+        }
+
+        ready = stitch(wave, pending, has_pending, last, type);
+        parse(group, ready, chunks, type);
+      }
+
+      m_pool.wait(group);
+      if (!emit(chunks, sink, emitted))
+        read_multiline(path, sink, emitted);
+    }
+    catch (...)
+    {
+      try { m_pool.wait(group); } catch (...) {}
+      throw;
+    }
+  }
+
+  void fastx_reader::read_gzip(const std::string& path, const sink_type& sink)
+  {
+    gzFile f = gzopen(path.c_str(), "rb");
+    if (!f)
+      throw kmq_io_error(fmt::format("Unable to read at {}.", path));
+
+    std::unique_ptr<std::remove_pointer_t<gzFile>, decltype(&gzclose)> guard(f, &gzclose);
+    gzbuffer(f, 1 << 20);
+
+    const std::size_t slack = m_chunk_size >> 4;
+
+    segment pending;
+    bool has_pending = false;
+    bool first = true;
+    fastx_type type = fastx_type::fasta;
+
+    task_group group;
+    std::vector<std::shared_ptr<segment>> ready;
+    std::vector<fastx_chunk_t> chunks;
+    std::size_t emitted = 0;
+
+    try
+    {
+      bool eof = false;
+      while (!eof)
+      {
+        // Inflate the next wave while the previous one is parsed.
+        std::vector<segment> wave;
+        while (wave.size() < m_wave && !eof)
+        {
+          segment s;
+          s.data.reserve(m_chunk_size + slack);
+          s.data.resize(m_chunk_size);
+          int n = gzread(f, s.data.data(), static_cast<unsigned>(m_chunk_size));
+          if (n < 0)
+          {
+            int err = 0;
+            throw kmq_io_error(fmt::format("{}: {}", path, gzerror(f, &err)));
+          }
+          s.data.resize(n);
+          eof = static_cast<std::size_t>(n) < m_chunk_size;
+          if (n > 0)
+            wave.push_back(std::move(s));
+        }
+
+        if (first && !wave.empty())
+        {
+          const char* b = wave[0].data.data();
+          const char* e = b + wave[0].data.size();
+          type = guess_fastx_type(b, e);
+          first = false;
+
+          // Nothing is emitted yet.
+          if (type == fastx_type::fastq && !is_four_line_fastq(b, e))
+          {
+            read_multiline(path, sink, 0);
+            return;
+          }
+        }
+
+        m_pool.wait(group);
+        if (!emit(chunks, sink, emitted))
+        {
+          read_multiline(path, sink, emitted);
+          return;
+        }
+
+        ready = stitch(wave, pending, has_pending, eof, type);
+        parse(group, ready, chunks, type);
+      }
+
+      m_pool.wait(group);
+      if (!emit(chunks, sink, emitted))
+        read_multiline(path, sink, emitted);
+    }
+    catch (...)
+    {
+      try { m_pool.wait(group); } catch (...) {}
+      throw;
+    }
+  }
+
+  void fastx_reader::read_multiline(const std::string& path, const sink_type& sink, std::size_t skip)
+  {
+    spdlog::debug("'{}': multi-line FASTQ records after {} records, read with kseq++.", path, skip);
+    read_kseq(path, sink, skip);
+  }
+
+  void fastx_reader::read_kseq(const std::string& path, const sink_type& sink, std::size_t skip)
+  {
+    struct offsets
+    {
+      std::size_t name, name_size, seq, seq_size;
+    };
+
+    klibpp::SeqStreamIn iss(path.c_str());
+    klibpp::KSeq record;
+
+    auto s = std::make_shared<segment>();
+    std::vector<offsets> offs;
+
+    auto flush = [&](){
+      if (offs.empty())
+        return;
+      auto c = std::make_shared<fastx_chunk>(s);
+      c->records().reserve(offs.size());
+      const char* b = s->data.data();
+      for (auto& o : offs)
+        c->records().push_back({std::string_view(b + o.name, o.name_size), std::string_view(b + o.seq, o.seq_size)});
+      m_bytes += s->data.size();
+      m_records += c->size();
+      sink(std::move(c));
+      s = std::make_shared<segment>();
+      offs.clear();
+    };
+
+    while (iss >> record)
+    {
+      if (skip > 0)
+      {
+        --skip;
+        continue;
+      }
+      offs.push_back({s->data.size(), record.name.size(), s->data.size() + record.name.size(), record.seq.size()});
+      s->data.append(record.name);
+      s->data.append(record.seq);
+      if (s->data.size() >= m_chunk_size)
+        flush();
+    }
+    flush();
+  }
+
+}
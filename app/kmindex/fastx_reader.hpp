@@ -0,0 +1,93 @@
+#ifndef FASTX_READER_HPP_R4JD0XQA
+#define FASTX_READER_HPP_R4JD0XQA
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <kmindex/fastx.hpp>
+#include <kmindex/threadpool.hpp>
+
+namespace kmq {
+
+  enum class input_codec
+  {
+    plain,
+    gzip,
+    bgzf,
+    bzip2
+  };
+
+  input_codec detect_codec(const std::string& path);
+
+  // Parallel FASTA/Q reader.
+  //  - uncompressed files are mapped and parsed in place,
+  //  - BGZF files are inflated by groups of blocks in parallel,
+  //  - other gzip files are inflated by one thread while the previous chunks are parsed,
+  //  - bzip2 files go through kseq++.
+  // Chunks are cut assuming four-line FASTQ records. From the first chunk holding another
+  // record, a mapped file is parsed sequentially in place and a compressed one is read again
+  // by kseq++, skipping the records already delivered.
+  // The chunks of a file are delivered in order, several files are read concurrently.
+  class fastx_reader
+  {
+    public:
+      using sink_type = std::function<void(fastx_chunk_t)>;
+
+      // Target size of the decompressed data behind a chunk.
+      static constexpr std::size_t default_chunk_size = 1 << 20;
+
+      fastx_reader(std::vector<std::string> paths,
+                   ThreadPool& pool,
+                   std::size_t chunk_size = default_chunk_size);
+
+      // Read all the inputs. 'sink' is called concurrently for chunks of different files.
+      void read(const sink_type& sink);
+
+      std::size_t nb_records() const;
+      std::size_t nb_bytes() const;
+
+    private:
+      struct segment
+      {
+        std::string data;
+        std::size_t start {0};
+      };
+
+      void read_file(const std::string& path, const sink_type& sink);
+      void read_mapped(const std::string& path, const sink_type& sink);
+      void read_bgzf(const std::string& path, const sink_type& sink);
+      void read_gzip(const std::string& path, const sink_type& sink);
+      void read_kseq(const std::string& path, const sink_type& sink, std::size_t skip = 0);
+      void read_multiline(const std::string& path, const sink_type& sink, std::size_t skip);
+      void parse_multiline(std::shared_ptr<char> data, char* begin, char* end, const sink_type& sink);
+
+      std::vector<std::shared_ptr<segment>> stitch(std::vector<segment>& segments,
+                                                   segment& pending,
+                                                   bool& has_pending,
+                                                   bool last,
+                                                   fastx_type type);
+
+      void parse(task_group& group,
+                 std::vector<std::shared_ptr<segment>>& ready,
+                 std::vector<fastx_chunk_t>& chunks,
+                 fastx_type type);
+
+      // Deliver the chunks in order up to the first one which could not be parsed (nullptr),
+      // false if there is one. 'emitted' counts the records delivered.
+      bool emit(std::vector<fastx_chunk_t>& chunks, const sink_type& sink, std::size_t& emitted);
+
+    private:
+      std::vector<std::string> m_paths;
+      ThreadPool& m_pool;
+      std::size_t m_chunk_size {default_chunk_size};
+      std::size_t m_wave {1};
+
+      std::atomic<std::size_t> m_records {0};
+      std::atomic<std::size_t> m_bytes {0};
+  };
+
+}
+
+#endif /* end of include guard: FASTX_READER_HPP_R4JD0XQA */
@@ -66,11 +66,7 @@ namespace kmq {
     kindex ki(infos, false);
     ThreadPool pool(nb_threads);
 
-    for (std::size_t p = 0; p < infos.nb_partitions(); ++p)
-    {
-      pool.add_task([p, &bq, &ki](int){ ki.solve_one(bq, p); });
-    }
-    pool.join_all();
+    pool.parallel_for(0, infos.nb_partitions(), [&bq, &ki](int, std::size_t p){ ki.solve_one(bq, p); });
 
     query_result res(std::move(bq.response().front()), 0, infos, false);
     return std::accumulate(res.ratios().begin(), res.ratios().end(), 0.0) / infos.nb_samples();
@@ -106,16 +102,11 @@ namespace kmq {
     sum_index builder(&sub);
   
     ThreadPool pool(o->nb_threads);
-    for (std::size_t p = 0; p < sub.nb_partitions(); ++p)
-    {
-      pool.add_task([p, &builder, c=o->correction](int) { 
-        spdlog::info("Process partition {}", p);
-        builder.sum_partition(p, c);
-        spdlog::info("Done partition {}", p);
-      });
-    }
-
-    pool.join_all();
+    pool.parallel_for(0, sub.nb_partitions(), [&builder, c=o->correction](int, std::size_t p) {
+      spdlog::info("Process partition {}", p);
+      builder.sum_partition(p, c);
+      spdlog::info("Done partition {}", p);
+    });
 
     spdlog::info("Index '{}' processed. ({})", o->index_name, gtime.formatted());
   }
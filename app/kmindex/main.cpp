@@ -36,6 +36,9 @@ int main(int argc, char* argv[])
       case kmq::kmq_commands::kmq_query2:
         kmq::main_query2(options);
         break;
+      case kmq::kmq_commands::kmq_daemon:
+        kmq::main_daemon(options);
+        break;
       case kmq::kmq_commands::kmq_build:
         kmq::main_build(options);
         break;
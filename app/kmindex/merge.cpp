@@ -9,6 +9,11 @@
 
 #include <spdlog/spdlog.h>
 
+#ifdef KMINDEX_WITH_COMPRESSION
+  #include <bitmatrixshuffle.h>
+  #include "compress.hpp"
+#endif
+
 namespace kmq {
 
   kmq_options_t kmq_merge_cli(parser_t parser, kmq_merge_options_t options)
@@ -59,6 +64,47 @@ namespace kmq {
        ->def("")
        ->setter(options->rename);
 
+#ifdef KMINDEX_WITH_COMPRESSION
+    auto cpr = cmd->add_group("Compression options", "");
+
+    cpr->add_param("--compress", "Merge into a compressed sub-index (presence/absence only).")
+       ->as_flag()
+       ->setter(options->compress);
+
+    cpr->add_param("--block-size", "Size of uncompressed blocks, in megabytes.")
+       ->meta("INT")
+       ->def("8")
+       ->checker(bc::check::f::range(1, 1024))
+       ->setter(options->block_size);
+
+    cpr->add_param("--reorder", "Reorder columns before compressing.")
+       ->as_flag()
+       ->setter(options->reorder);
+
+    cpr->add_param("--sampling", "Number of rows to sample for reordering.")
+       ->meta("INT")
+       ->def("20000")
+       ->checker(bc::check::f::range(1000, 100000000))
+       ->setter(options->sampling);
+
+    cpr->add_param("--column-per-block", "Reorder columns by group of N. Should be a multiple of 8 (0=all)")
+       ->meta("INT")
+       ->def("0")
+       ->checker(bc::check::f::range(0, 100000000))
+       ->checker([](const std::string& p, const std::string& v) -> bc::check::checker_ret_t {
+          auto n = std::stoul(v);
+          bool ok = (n == 0 || n % 8 == 0);
+          return std::make_tuple(ok, bc::utils::format_error(p, v, fmt::format("'{}' is not a multiple of 8.", v)));
+       })
+       ->setter(options->column_blocks);
+
+    cpr->add_param("--cpr-level", "Compression level in [1,22])")
+       ->meta("INT")
+       ->def("6")
+       ->checker(bc::check::f::range(1, 22))
+       ->setter(options->cpr_level);
+#endif
+
     add_common_options(cmd, options, true);
 
     return options;
@@ -156,6 +202,16 @@ namespace kmq {
       throw kmq_error(fmt::format("[{}] are not mergeable.", fmt::join(opt->to_merge, ",")));
     }
 
+    if (opt->compress && gindex.get(opt->to_merge[0]).bw() != 1)
+    {
+      throw kmq_error("--compress: only presence/absence sub-indexes can be compressed.");
+    }
+
+    if (opt->reorder && !opt->compress)
+    {
+      spdlog::warn("--reorder is ignored without --compress.");
+    }
+
     if (share_sample_ids(opt->to_merge, gindex) && opt->rename.empty())
     {
       throw kmq_error(
@@ -204,6 +260,67 @@ namespace kmq {
     }
   }
 
+#ifdef KMINDEX_WITH_COMPRESSION
+  // Same output as 'kmindex compress' run on the merged sub-index, without writing it. Returns
+  // the column order (empty without --reorder).
+  std::vector<std::uint64_t> merge_compressed(kmq_merge_options_t o,
+                                              index& gindex,
+                                              const index_merger& merger,
+                                              ThreadPool& pool)
+  {
+    std::size_t nb_samples = 0;
+    for (auto& n : o->to_merge)
+      nb_samples += gindex.get(n).nb_samples();
+
+    auto& first = gindex.get(o->to_merge[0]);
+    std::size_t nb_parts = first.nb_partitions();
+    std::size_t psize = first.bloom_size() / nb_parts;
+
+    auto block_size_bytes = o->block_size * 1024 * 1024;
+    auto entry_per_block = bms::target_block_nb_rows(nb_samples, block_size_bytes);
+
+    fs::create_directories(o->new_path);
+    auto config_path = fmt::format("{}/compression.cfg", o->new_path);
+    {
+      std::ofstream config_file(config_path + ".tmp", std::ios::out);
+      config_file << "samples = " << nb_samples << "\n";
+      config_file << "bitvectorsperblock = " << entry_per_block << "\n";
+      config_file << "preset = " << o->cpr_level << std::endl;
+    }
+
+    std::vector<std::uint64_t> perm_orders;
+
+    if (o->reorder)
+    {
+      // The order is computed from the first rows of a partition, only these rows are merged
+      // to an uncompressed file.
+      Timer ptime;
+      std::size_t p = std::min<std::size_t>(1, nb_parts - 1);
+      std::size_t nb_rows = std::min(o->sampling, psize);
+      auto spath = fmt::format("{}/sample_{}.cmbf", o->new_path, p);
+
+      spdlog::info("Reordering columns using {} sampled rows and {} column blocks.", nb_rows, o->column_blocks);
+      merger.write_rows(p, nb_rows, spath);
+      bms::compute_order_from_matrix_columns(spath, 49, nb_samples, nb_rows, o->column_blocks, nb_rows, perm_orders);
+      fs::remove(spath);
+
+      immutable_filling_columns_inplace(perm_orders, nb_samples);
+      auto opath = fmt::format("{}/permutations.bin", o->new_path);
+      std::ofstream ofs(opath, std::ios::out | std::ios::binary);
+      ofs.write(reinterpret_cast<const char*>(perm_orders.data()), perm_orders.size() * sizeof(std::uint64_t));
+      spdlog::info("Permutation computed ({}), saved at '{}'.", ptime.formatted(), opath);
+    }
+
+    spdlog::info("Compressing using {}MB blocks ({} bit vectors per block).", o->block_size, entry_per_block);
+    merger.merge_compressed(pool, config_path + ".tmp", perm_orders);
+
+    fs::copy_file(config_path + ".tmp", config_path, fs::copy_options::overwrite_existing);
+    fs::remove(config_path + ".tmp");
+
+    return perm_orders;
+  }
+#endif
+
   void main_merge(kmq_options_t opt)
   {
     kmq_merge_options_t o = std::static_pointer_cast<struct kmq_merge_options>(opt);
@@ -220,6 +337,27 @@ namespace kmq {
       &gindex, o->to_merge, o->new_path, o->name, o->mode, o->remove, gindex.get(o->to_merge[0]).bw());
 
     ThreadPool pool(o->nb_threads);
+
+#ifdef KMINDEX_WITH_COMPRESSION
+    if (o->compress)
+    {
+      auto perm_orders = merge_compressed(o, gindex, *merger, pool);
+      merger->rename(o->rename);
+
+      if (!perm_orders.empty())
+      {
+        auto& sub = gindex.get(o->name);
+        reorder_fof(fmt::format("{}/kmtricks.fof", o->new_path), sub.nb_samples(), perm_orders);
+        gindex.remove_index(o->name);
+        gindex.add_index(o->name, o->new_path);
+        gindex.save();
+      }
+
+      spdlog::info("Done. ({})", time.formatted());
+      return;
+    }
+#endif
+
     merger->merge(pool);
     merger->rename(o->rename);
 
@@ -19,6 +19,14 @@ namespace kmq {
 
     std::string rename;
     rename_mode mode {rename_mode::none};
+
+    // --compress, see kmq_compress_options.
+    bool compress {false};
+    bool reorder {false};
+    std::size_t block_size {8}; // in MB
+    std::size_t sampling {20000};
+    std::size_t column_blocks {0};
+    int cpr_level {6};
   };
 
   using kmq_merge_options_t = std::shared_ptr<struct kmq_merge_options>;
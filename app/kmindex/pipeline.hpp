@@ -0,0 +1,339 @@
+#ifndef PIPELINE_HPP_K2VQH7RB
+#define PIPELINE_HPP_K2VQH7RB
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <kmindex/spinlock.hpp>
+
+#include <spdlog/spdlog.h>
+
+#include <atomic_queue/atomic_queue.h>
+
+namespace kmq {
+
+  inline std::uint64_t steady_ns()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // Counters of a pipeline stage, all times in nanoseconds.
+  struct stage_stats
+  {
+    stage_stats(const std::string& name, std::size_t threads)
+      : name(name), threads(threads) {}
+
+    std::string name;
+    std::size_t threads {0};
+    std::atomic<std::uint64_t> items {0};
+    std::atomic<std::uint64_t> active {0};
+    std::atomic<std::uint64_t> starved {0};
+    std::atomic<std::uint64_t> blocked {0};
+
+    void log(std::uint64_t wall) const
+    {
+      double total = static_cast<double>(wall) * threads;
+      if (total == 0)
+        return;
+      std::uint64_t waiting = starved.load() + blocked.load();
+      std::uint64_t busy = active.load() > waiting ? active.load() - waiting : 0;
+      spdlog::info("stage '{}': {} thread(s), {} item(s), busy {:.1f}%, waiting for input {:.1f}%, blocked on output {:.1f}%",
+                   name,
+                   threads,
+                   items.load(),
+                   100.0 * busy / total,
+                   100.0 * starved.load() / total,
+                   100.0 * blocked.load() / total);
+    }
+  };
+
+  // Threads of a pipeline. Each stage has dedicated threads: workers block on their queues
+  // and cannot run as pool tasks. The first error aborts all the stages.
+  class pipeline
+  {
+    public:
+      pipeline() = default;
+      pipeline(const pipeline&) = delete;
+      pipeline& operator=(const pipeline&) = delete;
+
+      ~pipeline()
+      {
+        abort(nullptr);
+        join_threads();
+      }
+
+      bool aborted() const noexcept
+      {
+        return m_aborted.load(std::memory_order_relaxed);
+      }
+
+      void abort(std::exception_ptr e)
+      {
+        {
+          std::unique_lock<spinlock> lock(m_lock);
+          if (!m_error)
+            m_error = e;
+        }
+        m_aborted.store(true);
+      }
+
+      // Start the 'stats.threads' workers of a stage. 'done' is called once, by the last
+      // worker to return, usually to forward the end of the stream to the next stage.
+      template<typename Worker, typename Done>
+      void add_stage(stage_stats& stats, Worker worker, Done done)
+      {
+        auto alive = std::make_shared<std::atomic<std::size_t>>(stats.threads);
+        for (std::size_t i = 0; i < stats.threads; ++i)
+        {
+          m_threads.emplace_back([this, &stats, worker, done, alive](){
+            std::uint64_t t = steady_ns();
+            try
+            {
+              worker();
+            }
+            catch (...)
+            {
+              abort(std::current_exception());
+            }
+            stats.active += steady_ns() - t;
+            if (alive->fetch_sub(1) == 1)
+              done();
+          });
+        }
+      }
+
+      // Wait for all the stages.
+      void join()
+      {
+        join_threads();
+      }
+
+      // Rethrow the first error of the stages, if any.
+      void rethrow()
+      {
+        std::exception_ptr e;
+        {
+          std::unique_lock<spinlock> lock(m_lock);
+          std::swap(e, m_error);
+        }
+        if (e)
+          std::rethrow_exception(e);
+      }
+
+    private:
+      void join_threads()
+      {
+        for (auto& t : m_threads)
+          if (t.joinable()) t.join();
+        m_threads.clear();
+      }
+
+    private:
+      std::vector<std::thread> m_threads;
+      std::atomic<bool> m_aborted {false};
+      spinlock m_lock;
+      std::exception_ptr m_error {nullptr};
+  };
+
+  // Bounded lock-free queue between two stages. A full queue blocks the producers
+  // (backpressure), an empty one the consumers. Both waits are accounted in the stages stats.
+  // T must be nullable, nullptr marks the end of the stream.
+  template<typename T, std::size_t N>
+  class stage_queue
+  {
+    using queue_type = atomic_queue::AtomicQueue2<T, N, true, true, true, false>;
+
+    public:
+      stage_queue(pipeline& pipe)
+        : m_pipe(pipe) {}
+
+      // Returns false if the pipeline was aborted, the value is then dropped.
+      bool push(T&& v, stage_stats& s)
+      {
+        if (m_queue.try_push(std::move(v)))
+          return true;
+
+        std::uint64_t t = steady_ns();
+        std::size_t n = 0;
+        while (!m_queue.try_push(std::move(v)))
+        {
+          if (m_pipe.aborted())
+            return false;
+          wait(n);
+        }
+        s.blocked += steady_ns() - t;
+        return true;
+      }
+
+      // Returns nullptr at the end of the stream or if the pipeline was aborted.
+      T pop(stage_stats& s)
+      {
+        T v;
+        if (m_queue.try_pop(v))
+          return v;
+
+        std::uint64_t t = steady_ns();
+        std::size_t n = 0;
+        while (!m_queue.try_pop(v))
+        {
+          if (m_pipe.aborted())
+            return nullptr;
+          wait(n);
+        }
+        s.starved += steady_ns() - t;
+        return v;
+      }
+
+    private:
+      static void wait(std::size_t& n)
+      {
+        if (n < 1024)
+        {
+          CPU_PAUSE();
+          n++;
+        }
+        else if (n < 2048)
+        {
+          std::this_thread::yield();
+          n++;
+        }
+        else
+        {
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+      }
+
+    private:
+      pipeline& m_pipe;
+      queue_type m_queue;
+  };
+
+  // Memory of the batches in flight, in bytes. A limit of 0 means unlimited, usage is then
+  // only tracked.
+  class memory_budget
+  {
+    public:
+      memory_budget(std::size_t limit)
+        : m_limit(limit) {}
+
+      // Wait until 'bytes' fit in the budget. A request is always granted when nothing is in
+      // flight, a batch larger than the budget cannot stall the pipeline.
+      // Returns false if 'aborted()' became true while waiting.
+      template<typename Aborted>
+      bool acquire(std::size_t bytes, Aborted&& aborted)
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_limit && m_used > 0 && m_used + bytes > m_limit)
+        {
+          std::uint64_t t = steady_ns();
+          while (m_used > 0 && m_used + bytes > m_limit)
+          {
+            if (aborted())
+              return false;
+            m_cv.wait_for(lock, std::chrono::milliseconds(10));
+          }
+          m_waited += steady_ns() - t;
+        }
+        add(bytes);
+        return true;
+      }
+
+      // Acquire without waiting, for estimates exceeding what was reserved.
+      void force(std::size_t bytes)
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        add(bytes);
+      }
+
+      void release(std::size_t bytes)
+      {
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_used -= std::min(bytes, m_used);
+        }
+        m_cv.notify_all();
+      }
+
+      std::size_t limit() const noexcept
+      {
+        return m_limit;
+      }
+
+      std::size_t peak() const
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_peak;
+      }
+
+      // Time spent waiting for memory, in nanoseconds.
+      std::uint64_t waited() const
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_waited;
+      }
+
+    private:
+      void add(std::size_t bytes)
+      {
+        m_used += bytes;
+        m_peak = std::max(m_peak, m_used);
+      }
+
+    private:
+      std::size_t m_limit {0};
+      std::size_t m_used {0};
+      std::size_t m_peak {0};
+      std::uint64_t m_waited {0};
+      mutable std::mutex m_mutex;
+      std::condition_variable m_cv;
+  };
+
+  // Bytes held by a batch, released when the last stage using the batch drops its ticket.
+  class memory_ticket
+  {
+    public:
+      memory_ticket(memory_budget& budget, std::size_t bytes)
+        : m_budget(budget), m_bytes(bytes) {}
+
+      memory_ticket(const memory_ticket&) = delete;
+      memory_ticket& operator=(const memory_ticket&) = delete;
+
+      ~memory_ticket()
+      {
+        m_budget.release(m_bytes);
+      }
+
+      // Adjust the reservation to the actual size of the batch.
+      void resize(std::size_t bytes)
+      {
+        if (bytes > m_bytes)
+          m_budget.force(bytes - m_bytes);
+        else
+          m_budget.release(m_bytes - bytes);
+        m_bytes = bytes;
+      }
+
+      std::size_t bytes() const noexcept
+      {
+        return m_bytes;
+      }
+
+    private:
+      memory_budget& m_budget;
+      std::size_t m_bytes {0};
+  };
+
+  using memory_ticket_t = std::shared_ptr<memory_ticket>;
+
+}
+
+#endif /* end of include guard: PIPELINE_HPP_K2VQH7RB */
@@ -2,37 +2,27 @@
 #include "query.hpp"
 
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+#include <sys/resource.h>
 #include <kmindex/query/query.hpp>
 #include <kmindex/index/index.hpp>
 #include <kmindex/query/format.hpp>
 
 #include <kmindex/threadpool.hpp>
-#include <kseq++/seqio.hpp>
+
+#include "daemon_protocol.hpp"
+#include "fastx_reader.hpp"
+#include "pipeline.hpp"
 
 #include <fmt/format.h>
 #include <spdlog/spdlog.h>
 
-#include <atomic_queue/atomic_queue.h>
-
 namespace kmq {
 
-  struct fastx_record {
-    std::string name;
-    std::string seq;
-    fastx_record() noexcept {}
-    fastx_record(std::string&& name, std::string&& seq) noexcept
-      : name(std::move(name)), seq(std::move(seq)) {}
-  };
-
-  static constexpr bool minimize_contention = true;
-  static constexpr bool maximize_throughput = true;
-  static constexpr bool total_ordering = true;
-  static constexpr bool spsc = false;
-  static constexpr std::size_t queue_size = 2048;
-  using queue_type = atomic_queue::AtomicQueue2<
-    fastx_record, queue_size, minimize_contention, maximize_throughput, total_ordering, spsc
-  >;
-
   kmq_options_t kmq_query_cli(parser_t parser, kmq_query_options_t options)
   {
     auto cmd = parser->add_command("query", "Query index.");
@@ -79,11 +69,25 @@ namespace kmq {
        ->checker(not_dir)
        ->setter(options->output);
 
-    cmd->add_param("-q/--fastx", "Input fasta/q file (supports gz/bzip2) containing the sequence(s) to query.")
+    auto fastx_ext = bc::check::f::ext(
+      "fa|fq|fasta|fastq|fna|fa.gz|fq.gz|fasta.gz|fastq.gz|fna.gz|fa.bz2|fq.bz2|fasta.bz2|fastq.bz2|fna.bz2");
+
+    auto are_fastx = [fastx_ext](const std::string& p, const std::string& v) -> bc::check::checker_ret_t {
+      for (auto& f : bc::utils::split(v, ','))
+      {
+        auto r = bc::check::is_file(p, f);
+        if (!std::get<0>(r))
+          return r;
+        r = fastx_ext(p, f);
+        if (!std::get<0>(r))
+          return r;
+      }
+      return std::make_tuple(true, "");
+    };
+
+    cmd->add_param("-q/--fastx", "Input fasta/q files (supports gz/bgzf/bzip2), comma separated, containing the sequence(s) to query.")
        ->meta("STR")
-       ->checker(bc::check::is_file)
-       ->checker(bc::check::f::ext(
-         "fa|fq|fasta|fastq|fna|fa.gz|fq.gz|fasta.gz|fastq.gz|fna.gz|fa.bz2|fq.bz2|fasta.bz2|fastq.bz2|fna.bz2"))
+       ->checker(are_fastx)
        ->setter(options->input);
 
     cmd->add_param("-s/--single-query", "Query identifier. All sequences are considered as a unique query.")
@@ -101,20 +105,57 @@ namespace kmq {
        ->checker(bc::check::f::in("json|matrix|json_vec|jsonl|jsonl_vec"))
        ->setter_c(format_setter);
 
-    cmd->add_param("-b/--batch-size", "Size of query batches (0≈nb_seq/nb_thread).")
+    cmd->add_param("-b/--batch-size", "Size of query batches (0=~4M s-mers per batch, or sized by --max-memory).")
        ->meta("INT")
        ->def("0")
        ->checker(bc::check::is_number)
        ->setter(options->batch_size);
 
+    cmd->add_param("--reader-threads", "Number of threads used to read and decompress inputs (0=threads/8).")
+       ->meta("INT")
+       ->def("0")
+       ->checker(bc::check::is_number)
+       ->setter(options->reader_threads);
+
+    auto is_budget = [](const std::string& p, const std::string& v) -> bc::check::checker_ret_t {
+      if (v.empty())
+        return std::make_tuple(true, "");
+      auto t = bc::utils::split(v, ',');
+      bool ok = t.size() == 6 && std::all_of(t.begin(), t.end(), [](const std::string& n){
+        return !n.empty() && std::all_of(n.begin(), n.end(), ::isdigit) && std::stoull(n) > 0;
+      });
+      return std::make_tuple(ok, bc::utils::format_error(p, v, "Expects 6 positive integers."));
+    };
+
+    cmd->add_param("--max-memory", "Max memory used by query batches, in MB (0=unlimited, see doc for details).")
+       ->meta("INT")
+       ->def("0")
+       ->checker(bc::check::is_number)
+       ->setter(options->max_memory);
+
+    cmd->add_param("--stage-threads", "Threads per pipeline stage: hash,sort,lookup,reduce,format,write (see doc for details).")
+       ->meta("STR")
+       ->def("")
+       ->checker(is_budget)
+       ->setter(options->stage_threads);
+
     cmd->add_param("-a/--aggregate", "Aggregate results from batches into one file.")
        ->as_flag()
        ->setter(options->aggregate);
 
+    cmd->add_param("--fused", "Fused lookups for sub-indexes sharing the same configuration (see doc for details).")
+       ->as_flag()
+       ->setter(options->fused);
+
     cmd->add_param("--fast", "Keep more pages in cache (see doc for details).")
        ->as_flag()
        ->setter(options->cache);
 
+    cmd->add_param("--daemon-socket", "Send the queries to a 'kmindex daemon' listening on this socket.")
+       ->meta("STR")
+       ->def("")
+       ->setter(options->daemon_socket);
+
     cmd->add_param("-u/--uncompressed", "Use uncompressed partitions (if available).")
        ->as_flag()
        ->hide()
@@ -126,74 +167,164 @@ namespace kmq {
     return options;
   }
 
-  void populate_queue(queue_type& q, klibpp::SeqStreamIn& fx_stream, std::size_t n, std::size_t min_size)
+  // S-mers per batch when batches are neither sized by -b nor by --max-memory, about four
+  // input chunks.
+  constexpr std::size_t default_batch_smers = std::size_t{1} << 22;
+
+  // Threads of each stage of the query pipeline.
+  struct stage_budget
   {
-    klibpp::KSeq record;
-    while (fx_stream >> record)
+    std::size_t hash {1};
+    std::size_t sort {1};
+    std::size_t lookup {1};
+    std::size_t reduce {1};
+    std::size_t format {1};
+    std::size_t write {1};
+  };
+
+  // Reader threads are taken from -t before splitting the rest between stages.
+  std::size_t get_reader_threads(const kmq_query_options_t& opt)
+  {
+    return opt->reader_threads ? opt->reader_threads : std::max<std::size_t>(1, opt->nb_threads / 8);
+  }
+
+  stage_budget get_stage_budget(const kmq_query_options_t& opt, std::size_t readers)
+  {
+    stage_budget b;
+    if (!opt->stage_threads.empty())
     {
-      if (record.seq.size() < min_size)
-      {
-        spdlog::warn("'{}' skipped: min size is s+z={}", record.name, min_size);
-        continue;
-      }
-      q.push(fastx_record(std::move(record.name), std::move(record.seq)));
+      auto v = bc::utils::split(opt->stage_threads, ',');
+      b.hash = std::stoull(v[0]);
+      b.sort = std::stoull(v[1]);
+      b.lookup = std::stoull(v[2]);
+      b.reduce = std::stoull(v[3]);
+      b.format = std::stoull(v[4]);
+      b.write = std::stoull(v[5]);
     }
-    for (std::size_t _ = 0; _ < n; ++_)
-      q.push(fastx_record("", ""));
+    else
+    {
+      // Lookups dominate, hashing comes next. Formatting and writing are mostly I/O bound
+      // and get one thread each, lookups get what is left so that the total is -t.
+      std::size_t t = opt->nb_threads > readers + 2 ? opt->nb_threads - readers - 2 : 0;
+      b.hash = std::max<std::size_t>(1, t / 4);
+      b.sort = std::max<std::size_t>(1, t / 8);
+      b.reduce = std::max<std::size_t>(1, t / 8);
+      std::size_t used = b.hash + b.sort + b.reduce;
+      b.lookup = t > used ? t - used : 1;
+    }
+    return b;
   }
 
-  void solve_batch(batch_query& bq,
-                   const index_infos& infos,
-                   kindex& ki,
-                   const kmq_query_options_t& opt,
-                   std::size_t batch_id,
-                   Timer& timer,
-                   query_result_agg& aggs)
+  // Estimate of the memory used by a query in the pipeline: s-mers buckets, responses and
+  // results for all the sub-indexes of the group, formatted output. The bytes per s-mer and
+  // per output value are refined with the sizes measured on the processed batches.
+  class query_memory_model
   {
-    std::size_t nq = bq.size();
-
-    ki.solve_batch(bq);
+    static constexpr std::size_t query_overhead = 256;
 
-    bq.free_smers();
+    public:
+      query_memory_model(const std::vector<index_infos>& group, bool with_positions)
+      {
+        for (auto& infos : group)
+        {
+          m_response_bytes += (infos.nb_samples() * infos.bw() + 7) / 8;
+          m_samples += infos.nb_samples();
+        }
+        if (with_positions)
+          m_response_bytes += m_samples;
+      }
 
-    bool wpos = opt->format == format::json_with_positions || opt->format == format::jsonl_with_positions;
-    if (opt->single.empty())
-    {
-      query_result_agg agg;
-      for (auto&& r : bq.response())
-        agg.add(query_result(std::move(r), opt->z, infos, wpos));
+      std::size_t estimate(std::size_t nb_smers) const
+      {
+        double smer = m_smer_bytes.load(std::memory_order_relaxed);
+        double value = m_value_bytes.load(std::memory_order_relaxed);
+        return query_overhead
+          + nb_smers * (smer + m_response_bytes)
+          + m_samples * (sizeof(std::uint32_t) + sizeof(double) + value);
+      }
 
-      bq.free_responses();
+      void observe_smers(std::size_t bytes, std::size_t nb_smers)
+      {
+        if (nb_smers)
+          update(m_smer_bytes, static_cast<double>(bytes) / nb_smers);
+      }
 
-      std::string output;
-      if (opt->batch_size > 0 || opt->nb_threads > 1)
+      void observe_output(std::size_t bytes, std::size_t nb_values)
       {
-        output = fmt::format("{}/batch_{}", opt->output, batch_id);
-        fs::create_directories(output);
+        if (nb_values)
+          update(m_value_bytes, static_cast<double>(bytes) / nb_values);
       }
-      else
+
+    private:
+      // Moving average, concurrent updates may be lost, which is harmless here.
+      static void update(std::atomic<double>& v, double x)
       {
-        output = opt->output;
+        v.store(0.75 * v.load(std::memory_order_relaxed) + 0.25 * x, std::memory_order_relaxed);
       }
-      agg.output(infos, output, opt->format, opt->single, opt->sk_threshold);
-
-      spdlog::debug("batch_{} processed ({} sequences) dumped at {}/{}.{} ({})",
-          batch_id,
-          nq,
-          output,
-          infos.name(),
-          opt->format == format::matrix ? "tsv" : "json",
-          timer.formatted());
-    }
-    else
-    {
-      for (auto&& r : bq.response())
-        aggs.add(query_result(std::move(r), opt->z, infos, wpos));
 
-      bq.free_responses();
+    private:
+      std::size_t m_response_bytes {0};
+      std::size_t m_samples {0};
+      std::atomic<double> m_smer_bytes {sizeof(std::pair<smer, std::uint32_t>)};
+      std::atomic<double> m_value_bytes {16};
+  };
 
-      spdlog::debug("batch_{} processed ({} sequences) ({})", batch_id, nq, timer.formatted());
-    }
+  std::size_t peak_rss()
+  {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+      return 0;
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+  }
+
+  // Items flowing between the stages of the query pipeline.
+  struct hashed_batch
+  {
+    std::size_t id {0};
+    std::size_t nb_smers {0};
+    smer_batch_t smers {nullptr};
+    memory_ticket_t ticket {nullptr};
+  };
+
+  using hashed_batch_t = std::shared_ptr<hashed_batch>;
+
+  // Lookups of a batch in the sub-indexes [first, last) of a group.
+  struct lookup_task
+  {
+    hashed_batch_t batch {nullptr};
+    std::size_t first {0};
+    std::size_t last {0};
+  };
+
+  struct solved_batch
+  {
+    std::size_t id {0};
+    std::size_t g {0};
+    batch_query bq;
+    memory_ticket_t ticket {nullptr};
+  };
+
+  struct reduced_batch
+  {
+    std::size_t id {0};
+    std::size_t g {0};
+    query_result_agg agg;
+    memory_ticket_t ticket {nullptr};
+  };
+
+  struct formatted_batch
+  {
+    std::size_t id {0};
+    std::size_t g {0};
+    std::string data;
+    memory_ticket_t ticket {nullptr};
+  };
+
+  template<typename T, std::size_t N>
+  void close_queue(stage_queue<T, N>& q, std::size_t n, stage_stats& stats)
+  {
+    for (std::size_t _ = 0; _ < n; ++_)
+      q.push(nullptr, stats);
   }
 
   void merge_json(std::size_t n, const std::string& index_name, const std::string& output)
@@ -255,11 +386,8 @@ namespace kmq {
     }
   }
 
-  void merge_results(const std::string& output, format f, const std::string& index_name)
+  void merge_results(const std::string& output, format f, const std::string& index_name, std::size_t n)
   {
-    auto it = fs::directory_iterator(output);
-    std::size_t n = std::distance(it, fs::directory_iterator{});
-
     switch (f)
     {
       case format::json:
@@ -276,135 +404,313 @@ namespace kmq {
     }
   }
 
-  void main_query(kmq_options_t opt)
+  // Queries are processed by a pipeline of stages connected by bounded queues:
+  // read -> hash -> sort -> lookup -> reduce -> format -> write.
+  // Each stage has its own threads, a slow stage fills its input queue and throttles the
+  // previous ones instead of accumulating batches in memory.
+  void query_group(const kmq_query_options_t& o, const std::vector<index_infos>& group)
   {
-    kmq_query_options_t o = std::static_pointer_cast<struct kmq_query_options>(opt);
+    Timer timer;
+    const index_infos& ref = group.front();
 
-    Timer gtime;
+    for (auto& infos : group)
+      spdlog::info("Starting '{}' query ({} samples)", infos.name(), infos.nb_samples());
 
-    index global(o->global_index_path);
+    std::size_t readers = get_reader_threads(o);
+    stage_budget budget = get_stage_budget(o, readers);
+    bool batched = o->batch_size > 0 || o->max_memory > 0 || o->nb_threads > 1
+                   || budget.hash > 1 || budget.lookup > 1;
+    spdlog::debug("Stage threads: hash={}, sort={}, lookup={}, reduce={}, format={}, write={}",
+                  budget.hash, budget.sort, budget.lookup, budget.reduce, budget.format, budget.write);
+    bool wpos = o->format == format::json_with_positions || o->format == format::jsonl_with_positions;
 
-    spdlog::info(
-      "Global index: '{}'", fs::absolute(o->global_index_path + "/").parent_path().filename().string());
+    ThreadPool reader_pool(readers);
+    fastx_reader reader(bc::utils::split(o->input, ','), reader_pool);
 
-    if (o->index_names.empty())
+    std::vector<std::unique_ptr<kindex>> kis;
+    for (auto& infos : group)
+      kis.push_back(std::make_unique<kindex>(infos, o->cache));
+
+    // Slices of sub-indexes queried with fused lookups.
+    std::vector<fused_kindex> fused;
+    if (o->fused && group.size() > 1)
     {
-      o->index_names = global.all();
+      for (std::size_t s = 0; s < group.size(); s += fused_kindex::max_fused)
+      {
+        std::vector<kindex*> slice;
+        for (std::size_t g = s; g < std::min(group.size(), s + fused_kindex::max_fused); ++g)
+          slice.push_back(kis[g].get());
+        fused.emplace_back(std::move(slice));
+      }
     }
-    else
+    std::size_t slice_size = fused.empty() ? 1 : fused_kindex::max_fused;
+
+    std::atomic<std::size_t> batch_id = 0;
+    std::vector<query_result_agg> aggs(group.size());
+
+    stage_stats s_read("read", reader_pool.size());
+    stage_stats s_hash("hash", budget.hash);
+    stage_stats s_sort("sort", budget.sort);
+    stage_stats s_lookup("lookup", budget.lookup);
+    stage_stats s_reduce("reduce", budget.reduce);
+    stage_stats s_format("format", budget.format);
+    stage_stats s_write("write", budget.write);
+
+    // With a memory limit, batches are cut so that each hash and lookup worker can hold one.
+    memory_budget memory(o->max_memory * 1024 * 1024);
+    query_memory_model model(group, wpos);
+    std::size_t target = memory.limit() / (budget.hash + budget.lookup);
+    // Otherwise, batches are cut every few input chunks so that they flow through the stages
+    // concurrently instead of holding the whole input.
+    std::size_t max_smers = batched && !target && !o->batch_size ? default_batch_smers : 0;
+
+    pipeline pipe;
+    // Chunks of ~1MB of sequences.
+    stage_queue<fastx_chunk_t, 64> chunks(pipe);
+    stage_queue<hashed_batch_t, 4> hashed(pipe);
+    stage_queue<std::shared_ptr<lookup_task>, 64> lookups(pipe);
+    stage_queue<std::shared_ptr<solved_batch>, 16> solved(pipe);
+    stage_queue<std::shared_ptr<reduced_batch>, 16> reduced(pipe);
+    stage_queue<std::shared_ptr<formatted_batch>, 16> formatted(pipe);
+
+    std::uint64_t start = steady_ns();
+
+    pipe.add_stage(s_hash, [&](){
+      std::size_t min_size = ref.smer_size() + o->z;
+      fastx_chunk_t chunk {nullptr};
+      std::size_t next = 0;
+      bool end = false;
+
+      while (!end)
+      {
+        if (!memory.acquire(target, [&pipe](){ return pipe.aborted(); }))
+          return;
+        auto ticket = std::make_shared<memory_ticket>(memory, target);
+
+        auto smers = std::make_shared<smer_batch>(ref.nb_partitions(),
+                                                  ref.smer_size(),
+                                                  ref.get_repartition(),
+                                                  ref.get_hash_w(),
+                                                  ref.minim_size());
+        std::size_t bytes = 0;
+        std::size_t nb_smers = 0;
+
+        while (o->batch_size == 0 || smers->size() < o->batch_size)
+        {
+          if (!chunk || next == chunk->size())
+          {
+            chunk = chunks.pop(s_hash);
+            next = 0;
+            if (!chunk)
+            {
+              end = true;
+              break;
+            }
+            continue;
+          }
 
-    spdlog::info("Sub-indexes to query: [{}]", fmt::join(o->index_names, ","));
+          auto& record = chunk->records()[next];
+          if (record.seq.size() < min_size)
+          {
+            spdlog::warn("'{}' skipped: min size is s+z={}", record.name, min_size);
+            ++next;
+            continue;
+          }
 
-    if (!o->single.empty())
-      spdlog::warn("--single-query: all query results are kept in memory");
+          std::size_t n = record.seq.size() - ref.smer_size() + 1;
+          std::size_t est = model.estimate(n);
+          if (target && smers->size() > 0 && bytes + est > target)
+            break;
+          if (max_smers && smers->size() > 0 && nb_smers + n > max_smers)
+            break;
+
+          smers->add_query(std::string(record.name), record.seq);
+          bytes += est;
+          nb_smers += n;
+          ++next;
+        }
 
-    for (auto& index_name : o->index_names)
-    {
-      Timer timer;
-      auto infos = global.get(index_name);
+        // Hold the estimated size instead of the reservation. A single query can exceed it.
+        ticket->resize(bytes);
 
-      if (o->uncompressed)
+        if (smers->size() > 0)
+        {
+          auto batch = std::make_shared<hashed_batch>();
+          batch->id = batch_id.fetch_add(1);
+          batch->nb_smers = nb_smers;
+          batch->smers = std::move(smers);
+          batch->ticket = std::move(ticket);
+          spdlog::debug("batch_{} hashed ({} sequences, ~{} MB)", batch->id, batch->smers->size(), bytes >> 20);
+          ++s_hash.items;
+          if (!hashed.push(std::move(batch), s_hash))
+            return;
+        }
+      }
+    }, [&](){ close_queue(hashed, budget.sort, s_hash); });
+
+    pipe.add_stage(s_sort, [&](){
+      while (auto batch = hashed.pop(s_sort))
       {
-        if (infos.has_uncompressed_partitions())
+        for (std::size_t p = 0; p < batch->smers->nb_partitions(); ++p)
+          batch->smers->partition(p);
+        model.observe_smers(batch->smers->memory(), batch->nb_smers);
+        ++s_sort.items;
+
+        for (std::size_t first = 0; first < group.size(); first += slice_size)
         {
-          spdlog::info("Using uncompressed partitions for index '{}'.", index_name);
-          infos.set_compress(false);
-          auto fof_bak = fmt::format("{}/kmtricks.fof.bak", infos.get_directory());
-          if (fs::exists(fof_bak))
-            infos.use_fof(fof_bak);
+          auto task = std::make_shared<lookup_task>();
+          task->batch = batch;
+          task->first = first;
+          task->last = std::min(group.size(), first + slice_size);
+          if (!lookups.push(std::move(task), s_sort))
+            return;
         }
+      }
+    }, [&](){ close_queue(lookups, budget.lookup, s_sort); });
+
+    pipe.add_stage(s_lookup, [&](){
+      while (auto task = lookups.pop(s_lookup))
+      {
+        std::vector<batch_query> bqs;
+        bqs.reserve(task->last - task->first);
+        for (std::size_t g = task->first; g < task->last; ++g)
+          bqs.emplace_back(group[g].nb_samples(), o->z, group[g].bw(), task->batch->smers);
+
+        if (fused.empty())
+          kis[task->first]->solve_batch(bqs.front());
         else
+          fused[task->first / fused_kindex::max_fused].solve_batch(bqs);
+        ++s_lookup.items;
+
+        for (std::size_t g = task->first; g < task->last; ++g)
         {
-          spdlog::warn("Index '{}' has no uncompressed partitions, using compressed ones.", index_name);
+          auto& bq = bqs[g - task->first];
+          bq.free_smers();
+          if (!solved.push(std::make_shared<solved_batch>(solved_batch{task->batch->id, g, std::move(bq), task->batch->ticket}), s_lookup))
+            return;
         }
       }
+    }, [&](){ close_queue(solved, budget.reduce, s_lookup); });
 
-      if (infos.is_compressed_index() && o->cache)
+    pipe.add_stage(s_reduce, [&](){
+      while (auto s = solved.pop(s_reduce))
       {
-        spdlog::warn("Index '{}' is compressed, ignoring --fast.", index_name);
+        const index_infos& infos = group[s->g];
+        ++s_reduce.items;
+
+        // A single query is aggregated in memory and dumped at the end.
+        if (!o->single.empty())
+        {
+          for (auto&& r : s->bq.response())
+            aggs[s->g].add(query_result(std::move(r), o->z, infos, wpos));
+          continue;
+        }
+
+        auto red = std::make_shared<reduced_batch>();
+        red->id = s->id;
+        red->g = s->g;
+        red->ticket = s->ticket;
+        for (auto&& r : s->bq.response())
+          red->agg.add(query_result(std::move(r), o->z, infos, wpos));
+        s = nullptr;
+
+        if (!reduced.push(std::move(red), s_reduce))
+          return;
       }
+    }, [&](){ close_queue(reduced, budget.format, s_reduce); });
 
-      spdlog::info("Starting '{}' query ({} samples)", infos.name(), infos.nb_samples());
+    pipe.add_stage(s_format, [&](){
+      while (auto red = reduced.pop(s_format))
+      {
+        std::ostringstream ss;
+        red->agg.output(group[red->g], ss, o->format, o->single, o->sk_threshold);
+        ++s_format.items;
+
+        auto f = std::make_shared<formatted_batch>();
+        f->id = red->id;
+        f->g = red->g;
+        f->data = ss.str();
+        f->ticket = red->ticket;
+        model.observe_output(f->data.size(), red->agg.size() * group[red->g].nb_samples());
+        red = nullptr;
+
+        if (!formatted.push(std::move(f), s_format))
+          return;
+      }
+    }, [&](){ close_queue(formatted, budget.write, s_format); });
 
-      klibpp::SeqStreamIn iss(o->input.c_str());
-      queue_type bqueue;
+    pipe.add_stage(s_write, [&](){
+      std::string ext = format_to_fext(o->format);
+      while (auto f = formatted.pop(s_write))
+      {
+        std::string output = o->output;
+        if (batched)
+        {
+          output = fmt::format("{}/batch_{}", o->output, f->id);
+          fs::create_directories(output);
+        }
 
-      ThreadPool pool(opt->nb_threads);
+        std::string path = fmt::format("{}/{}.{}", output, group[f->g].name(), ext);
+        std::ofstream out(path, std::ios::out | std::ios::binary);
+        if (!out)
+          throw kmq_io_error(fmt::format("Unable to write {}", path));
+        out.write(f->data.data(), f->data.size());
+        ++s_write.items;
 
-      kindex ki(infos, o->cache);
-     //smer_hasher sh(infos.get_repartition(), infos.get_hash_w(), infos.minim_size());
+        spdlog::debug("batch_{} dumped at {}", f->id, path);
+      }
+    }, [](){});
+
+    try
+    {
+      reader.read([&](fastx_chunk_t chunk){
+        ++s_read.items;
+        if (!chunks.push(std::move(chunk), s_read))
+          throw kmq_error("Query aborted.");
+      });
+      spdlog::debug("{} sequences read ({} bytes).", reader.nb_records(), reader.nb_bytes());
+    }
+    catch (...)
+    {
+      pipe.abort(std::current_exception());
+    }
+    // Always release the hash stage, even on error.
+    close_queue(chunks, budget.hash, s_read);
 
-      std::atomic<std::size_t> batch_id = 0;
+    pipe.join();
 
-      query_result_agg aggs;
+    std::uint64_t wall = steady_ns() - start;
+    for (auto* s : {&s_read, &s_hash, &s_sort, &s_lookup, &s_reduce, &s_format, &s_write})
+      s->log(wall);
 
-      for (std::size_t c = 0; c < opt->nb_threads; ++c)
-      {
-        pool.add_task([&bqueue, &infos, &ki, &batch_id, &aggs, opt=o](int i){
-          unused(i);
-          for (;;)
-          {
-            Timer timer;
-            batch_query bq(infos.nb_samples(),
-                           infos.nb_partitions(),
-                           infos.smer_size(),
-                           opt->z,
-                           infos.bw(),
-                           infos.get_repartition(),
-                           infos.get_hash_w(),
-                           infos.minim_size());
-
-            bool end = false;
-            std::size_t nq = 0;
-            std::size_t id = batch_id.fetch_add(1);
-
-            while (!end)
-            {
-              auto record = bqueue.pop();
-
-              if (record.name.empty())
-              {
-                end = true;
-              }
-              else
-              {
-                bq.add_query(std::move(record.name), std::move(record.seq));
-                ++nq;
-              }
-
-              if ((nq == opt->batch_size || end) && nq > 0)
-              {
-                spdlog::debug("process batch_{} ({} sequences)", id, nq);
-                solve_batch(bq, infos, ki, opt, id, timer, aggs);
-                break;
-              }
-            }
+    if (memory.limit())
+      spdlog::info("Peak memory: {} MB held by batches (limit {} MB, {:.1f}s waiting for memory), {} MB RSS",
+                   memory.peak() >> 20, memory.limit() >> 20, memory.waited() / 1e9, peak_rss() >> 20);
+    else
+      spdlog::info("Peak memory: {} MB held by batches, {} MB RSS", memory.peak() >> 20, peak_rss() >> 20);
 
-            nq = 0;
+    pipe.rethrow();
 
-            if (end)
-              return;
-          }
-        });
-      }
+    std::size_t nb_batches = batch_id.load();
 
-      populate_queue(bqueue, iss, opt->nb_threads, infos.smer_size() + o->z);
-      pool.join_all();
+    for (std::size_t g = 0; g < group.size(); ++g)
+    {
+      auto& infos = group[g];
 
       if (!o->single.empty())
       {
-        spdlog::info("aggregate query results ({} sequences)", aggs.size());
-        aggs.output(infos, o->output, o->format, o->single, o->sk_threshold);
+        spdlog::info("aggregate query results ({} sequences)", aggs[g].size());
+        aggs[g].output(infos, o->output, o->format, o->single, o->sk_threshold);
         spdlog::info("query '{}' processed, results dumped at {}/{}.{}",
           o->single, o->output, infos.name(), format_to_fext(o->format));
       }
       else
       {
-        if (o->aggregate && ((o->batch_size > 0) || (o->nb_threads > 1)))
+        if (o->aggregate && batched)
         {
           std::string ext = format_to_fext(o->format);
 
-          merge_results(o->output, o->format, infos.name());
+          merge_results(o->output, o->format, infos.name(), nb_batches);
 
           spdlog::info("Index '{}' processed, results dumped at {}/{}.{} ({}).",
                        infos.name(),
@@ -419,6 +725,160 @@ namespace kmq {
         }
       }
     }
+  }
+
+  // Sequences are read here and sent to the daemon, which holds the sub-indexes. The outputs
+  // are the ones of a run without batches.
+  void query_daemon(const kmq_query_options_t& o)
+  {
+    Timer timer;
+
+    daemon::writer w;
+    w.start();
+    w.put(daemon::version);
+    w.put(std::string_view(fs::canonical(o->global_index_path).string()));
+    w.put<std::uint32_t>(o->index_names.size());
+    for (auto& name : o->index_names)
+      w.put(std::string_view(name));
+    w.put<std::uint8_t>(o->z);
+    w.put(o->sk_threshold);
+    w.put(static_cast<std::uint8_t>(o->format));
+    w.put(std::string_view(o->single));
+
+    // Records are counted while they are written, their number is patched afterwards.
+    std::size_t count_offset = w.size();
+    w.put<std::uint64_t>(0);
+    std::uint64_t nb_records = 0;
+
+    ThreadPool reader_pool(o->reader_threads ? o->reader_threads : 1);
+    fastx_reader reader(bc::utils::split(o->input, ','), reader_pool);
+    std::mutex mutex;
+    reader.read([&](fastx_chunk_t chunk){
+      std::unique_lock<std::mutex> lock(mutex);
+      for (auto& record : chunk->records())
+      {
+        w.put(record.name);
+        w.put(record.seq);
+        ++nb_records;
+      }
+    });
+    w.set(count_offset, nb_records);
+
+    if (w.size() - sizeof(std::uint64_t) > daemon::max_frame_size)
+      throw kmq_error(fmt::format("Queries too large for the daemon ({} bytes, max is {}), split the inputs.",
+                                  w.size() - sizeof(std::uint64_t), daemon::max_frame_size));
+
+    int fd = daemon::connect_to(o->daemon_socket);
+    if (fd < 0)
+      throw kmq_io_error(fmt::format("No daemon listening on {} ({})", o->daemon_socket, std::strerror(errno)));
+
+    std::string payload;
+    try
+    {
+      daemon::send_frame(fd, w.finish());
+      if (!daemon::recv_frame(fd, payload))
+        throw kmq_io_error("Daemon socket: connection closed");
+    }
+    catch (...)
+    {
+      ::close(fd);
+      throw;
+    }
+    ::close(fd);
+
+    daemon::reader r(payload);
+    if (r.get<daemon::status>() != daemon::status::ok)
+      throw kmq_error(fmt::format("Daemon: {}", r.get_str()));
+
+    fs::create_directories(o->output);
+    std::string ext = format_to_fext(o->format);
+    std::uint32_t nb_outputs = r.get<std::uint32_t>();
+    for (std::uint32_t i = 0; i < nb_outputs; ++i)
+    {
+      std::string_view name = r.get_str();
+      std::string_view data = r.get_str();
+
+      std::string path = fmt::format("{}/{}.{}", o->output, name, ext);
+      std::ofstream out(path, std::ios::out | std::ios::binary);
+      if (!out)
+        throw kmq_io_error(fmt::format("Unable to write {}", path));
+      out.write(data.data(), data.size());
+      spdlog::info("Index '{}' processed, results dumped at {}", name, path);
+    }
+
+    spdlog::info("{} sequences queried through {} ({}).", nb_records, o->daemon_socket, timer.formatted());
+  }
+
+  void main_query(kmq_options_t opt)
+  {
+    kmq_query_options_t o = std::static_pointer_cast<struct kmq_query_options>(opt);
+
+    if (!o->daemon_socket.empty())
+    {
+      query_daemon(o);
+      return;
+    }
+
+    Timer gtime;
+
+    index global(o->global_index_path);
+
+    spdlog::info(
+      "Global index: '{}'", fs::absolute(o->global_index_path + "/").parent_path().filename().string());
+
+    if (o->index_names.empty())
+    {
+      o->index_names = global.all();
+    }
+    else
+
+    spdlog::info("Sub-indexes to query: [{}]", fmt::join(o->index_names, ","));
+
+    if (!o->single.empty())
+      spdlog::warn("--single-query: all query results are kept in memory");
+
+    // Sub-indexes with the same configuration share their s-mers: inputs are read and hashed
+    // once per configuration.
+    std::vector<std::vector<index_infos>> groups;
+    std::unordered_map<std::string, std::size_t> by_sha1;
+
+    for (auto& index_name : o->index_names)
+    {
+      auto infos = global.get(index_name);
+
+      if (o->uncompressed)
+      {
+        if (infos.has_uncompressed_partitions())
+        {
+          spdlog::info("Using uncompressed partitions for index '{}'.", index_name);
+          infos.set_compress(false);
+          auto fof_bak = fmt::format("{}/kmtricks.fof.bak", infos.get_directory());
+          if (fs::exists(fof_bak))
+            infos.use_fof(fof_bak);
+        }
+        else
+        {
+          spdlog::warn("Index '{}' has no uncompressed partitions, using compressed ones.", index_name);
+        }
+      }
+
+      if (infos.is_compressed_index() && o->cache)
+      {
+        spdlog::warn("Index '{}' is compressed, ignoring --fast.", index_name);
+      }
+
+      auto [it, inserted] = by_sha1.emplace(infos.sha1(), groups.size());
+      if (inserted)
+        groups.emplace_back();
+      groups[it->second].push_back(std::move(infos));
+    }
+
+    if (groups.size() < o->index_names.size())
+      spdlog::info("{} sub-indexes, {} distinct configurations.", o->index_names.size(), groups.size());
+
+    for (auto& group : groups)
+      query_group(o, group);
+
     spdlog::info("Done ({}).", gtime.formatted());
   }
 }
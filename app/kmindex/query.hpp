@@ -18,7 +18,12 @@ namespace kmq {
     std::size_t z {0};
     double sk_threshold {0};
     std::size_t batch_size {0};
+    std::size_t max_memory {0};
+    std::size_t reader_threads {0};
+    std::string stage_threads;
+    std::string daemon_socket;
     bool cache {false};
+    bool fused {false};
     bool aggregate {false};
     bool uncompressed {false};
   };
@@ -1,7 +1,11 @@
 
 #include "query2.hpp"
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
 #include <kmindex/query/query.hpp>
 #include <kmindex/index/index.hpp>
 #include <kmindex/query/format.hpp>
@@ -15,6 +19,8 @@
 
 #include <atomic_queue/atomic_queue.h>
 
+#include "pipeline.hpp"
+
 namespace kmq {
 
   struct fastx_record {
@@ -97,6 +103,16 @@ namespace kmq {
        ->checker(bc::check::f::in("json|matrix|json_vec|jsonl|jsonl_vec"))
        ->setter_c(format_setter);
 
+    cmd->add_param("--max-memory", "Max memory used by responses, in MB (0=unlimited, see doc for details).")
+       ->meta("INT")
+       ->def("0")
+       ->checker(bc::check::is_number)
+       ->setter(options->max_memory);
+
+    cmd->add_param("--fused", "Fused lookups for sub-indexes sharing the same configuration (see doc for details).")
+       ->as_flag()
+       ->setter(options->fused);
+
     cmd->add_param("--fast", "Keep more pages in cache (see doc for details).")
        ->as_flag()
        ->setter(options->cache);
@@ -112,6 +128,180 @@ namespace kmq {
     return options;
   }
 
+  // Queries of one or more sub-indexes sharing the same s-mers. A job is made of 'nb_units'
+  // units, each one solving a range of partitions for all the sub-indexes of the job.
+  // Responses are allocated by the first unit to run, results are written by the last one.
+  struct query2_job
+  {
+    std::vector<index_infos> infos;
+    std::size_t cost {0};
+    std::size_t memory {0};
+    std::size_t nb_units {1};
+
+    std::once_flag prepared;
+    std::vector<std::unique_ptr<kindex>> kis;
+    std::vector<batch_query> bqs;
+    std::unique_ptr<fused_kindex> fused;
+    std::atomic<std::size_t> remaining {0};
+    memory_ticket_t ticket {nullptr};
+    Timer timer;
+  };
+
+  using query2_job_t = std::shared_ptr<query2_job>;
+
+  index_infos load_infos(const index& global, const std::string& index_name, bool uncompressed)
+  {
+    auto infos = global.get(index_name);
+
+    if (uncompressed)
+    {
+      if (infos.has_uncompressed_partitions())
+      {
+        spdlog::info("Using uncompressed partitions for index '{}'.", index_name);
+        infos.set_compress(false);
+        auto fof_bak = fmt::format("{}/kmtricks.fof.bak", infos.get_directory());
+        if (fs::exists(fof_bak))
+          infos.use_fof(fof_bak);
+      }
+      else
+      {
+        spdlog::warn("Index '{}' has no uncompressed partitions, using compressed ones.", index_name);
+      }
+    }
+    return infos;
+  }
+
+  // Jobs in decreasing order of cost. The cost of a sub-index is an estimate of the bytes it
+  // reads (its size on disk and its rows for all the s-mers), its memory the size of its
+  // responses and results. Sub-indexes that would delay the end of the query are split by
+  // partitions over several workers, small ones are packed together.
+  std::vector<query2_job_t> schedule_query2(std::vector<index_infos>&& group,
+                                            const smer_batch& smers,
+                                            std::size_t nb_workers,
+                                            bool fused,
+                                            bool with_positions)
+  {
+    std::size_t nb_smers = 0;
+    for (std::size_t q = 0; q < smers.size(); ++q)
+      nb_smers += smers.nb_smers(q);
+
+    std::vector<query2_job_t> single;
+    std::size_t total = 0;
+    for (auto& infos : group)
+    {
+      std::size_t block = (infos.nb_samples() * infos.bw() + 7) / 8;
+      auto job = std::make_shared<query2_job>();
+      job->cost = infos.index_size() + nb_smers * block;
+      job->memory = nb_smers * (block + (with_positions ? infos.nb_samples() : 0))
+                  + smers.size() * infos.nb_samples() * (sizeof(std::uint32_t) + sizeof(double));
+      job->infos.push_back(std::move(infos));
+      total += job->cost;
+      single.push_back(std::move(job));
+    }
+
+    std::sort(single.begin(), single.end(), [](auto& a, auto& b){ return a->cost > b->cost; });
+
+    std::size_t split_cost = total / nb_workers;
+    std::size_t pack_cost = total / (4 * nb_workers);
+    std::size_t max_pack = fused ? fused_kindex::max_fused : std::numeric_limits<std::size_t>::max();
+
+    std::vector<query2_job_t> jobs;
+    query2_job_t pack {nullptr};
+
+    for (auto& job : single)
+    {
+      std::size_t nb_partitions = job->infos.front().nb_partitions();
+      if (nb_workers > 1 && job->cost > split_cost && nb_partitions > 1)
+      {
+        job->nb_units = std::min(nb_partitions, nb_workers);
+        jobs.push_back(std::move(job));
+      }
+      else if (job->cost >= pack_cost)
+      {
+        jobs.push_back(std::move(job));
+      }
+      else
+      {
+        if (!pack)
+          pack = std::make_shared<query2_job>();
+        pack->cost += job->cost;
+        pack->memory += job->memory;
+        pack->infos.push_back(std::move(job->infos.front()));
+        if (pack->cost >= pack_cost || pack->infos.size() == max_pack)
+          jobs.push_back(std::move(pack));
+      }
+    }
+    if (pack)
+      jobs.push_back(std::move(pack));
+
+    return jobs;
+  }
+
+  void run_query2_unit(query2_job& job,
+                       std::size_t u,
+                       const kmq_query2_options_t& o,
+                       const smer_batch_t& smers,
+                       bool with_positions)
+  {
+    std::call_once(job.prepared, [&job, &o, &smers](){
+      job.timer.reset();
+      for (auto& i : job.infos)
+      {
+        spdlog::info("Starting '{}' query ({} samples)", i.name(), i.nb_samples());
+        job.kis.push_back(std::make_unique<kindex>(i, o->cache));
+        job.bqs.emplace_back(i.nb_samples(), o->z, i.bw(), smers);
+      }
+
+      if (o->fused && job.kis.size() > 1)
+      {
+        std::vector<kindex*> slice;
+        for (auto& ki : job.kis)
+          slice.push_back(ki.get());
+        job.fused = std::make_unique<fused_kindex>(std::move(slice));
+      }
+    });
+
+    std::size_t nb_partitions = job.infos.front().nb_partitions();
+    std::size_t first = u * nb_partitions / job.nb_units;
+    std::size_t last = (u + 1) * nb_partitions / job.nb_units;
+
+    if (job.fused)
+    {
+      for (std::size_t p = first; p < last; ++p)
+        job.fused->solve_one(job.bqs, p);
+    }
+    else
+    {
+      for (std::size_t n = 0; n < job.kis.size(); ++n)
+        for (std::size_t p = first; p < last; ++p)
+          job.kis[n]->solve_partition(job.bqs[n], p);
+    }
+
+    if (job.remaining.fetch_sub(1) != 1)
+      return;
+
+    for (std::size_t n = 0; n < job.infos.size(); ++n)
+    {
+      auto& b = job.bqs[n];
+      b.free_smers();
+
+      query_result_agg agg;
+      for (auto&& r : b.response())
+      {
+        agg.add(query_result(std::move(r), o->z, job.infos[n], with_positions));
+      }
+      agg.output(job.infos[n], o->output, o->format, "", o->sk_threshold);
+      b.free_responses();
+
+      spdlog::info("Index '{}' processed. ({})", job.infos[n].name(), job.timer.formatted());
+    }
+
+    job.bqs.clear();
+    job.kis.clear();
+    job.fused = nullptr;
+    job.ticket = nullptr;
+  }
+
   void main_query2(kmq_options_t opt)
   {
     kmq_query2_options_t o = std::static_pointer_cast<struct kmq_query2_options>(opt);
@@ -154,6 +344,7 @@ namespace kmq {
       spdlog::warn("--single-query: all query results are kept in memory");
 
     ThreadPool pool(opt->nb_threads);
+    memory_budget memory(o->max_memory * 1024 * 1024);
 
     klibpp::SeqStreamIn iss(o->input.c_str());
     std::vector<klibpp::KSeq> records;
@@ -165,74 +356,109 @@ namespace kmq {
     }
 
     bool with_positions = o->format == format::json_with_positions || o->format == format::jsonl_with_positions;
+
+    // Sub-indexes with the same configuration share their s-mers, which are computed once.
+    std::vector<std::vector<std::string>> groups;
+    std::unordered_map<std::string, std::size_t> by_sha1;
     for (auto& index_name : o->index_names)
     {
-      pool.add_task([&o, &global, &index_name, &records, with_positions](int i){
-        unused(i);
-        Timer timer;
-        auto infos = global.get(index_name);
-        spdlog::info("Starting '{}' query ({} samples)", infos.name(), infos.nb_samples());
-
-        batch_query b(infos.nb_samples(),
-                      infos.nb_partitions(),
-                      infos.smer_size(),
-                      o->z,
-                      infos.bw(),
-                      infos.get_repartition(),
-                      infos.get_hash_w(),
-                      infos.minim_size()
-        );
-
-        std::size_t skip = 0;
-        for (auto& record : records)
-        {
-          if (record.seq.size() >= infos.smer_size() + o->z)
-          {
-            b.add_query(record.name, record.seq);
-          }
-          else
-          {
-            skip++;
-          }
-        }
+      auto [it, inserted] = by_sha1.emplace(global.get(index_name).sha1(), groups.size());
+      if (inserted)
+        groups.emplace_back();
+      groups[it->second].push_back(index_name);
+    }
 
-        if (skip)
+    if (groups.size() < o->index_names.size())
+      spdlog::info("{} sub-indexes, {} distinct configurations.", o->index_names.size(), groups.size());
+
+    for (auto& group : groups)
+    {
+      Timer htime;
+      auto ref = global.get(group.front());
+
+      auto smers = std::make_shared<smer_batch>(ref.nb_partitions(),
+                                                ref.smer_size(),
+                                                ref.get_repartition(),
+                                                ref.get_hash_w(),
+                                                ref.minim_size());
+
+      std::size_t skip = 0;
+      for (auto& record : records)
+      {
+        if (record.seq.size() >= ref.smer_size() + o->z)
         {
-          spdlog::warn("Ignoring {} queries (min query length is {} for index '{}')", skip, o->z + infos.smer_size(), infos.name());
+          smers->add_query(record.name, record.seq);
         }
-
-        if (o->uncompressed)
+        else
         {
-          if (infos.has_uncompressed_partitions())
-          {
-            spdlog::info("Using uncompressed partitions for index '{}'.", index_name);
-            infos.set_compress(false);
-            auto fof_bak = fmt::format("{}/kmtricks.fof.bak", infos.get_directory());
-            if (fs::exists(fof_bak))
-              infos.use_fof(fof_bak);
-          }
-          else
-          {
-            spdlog::warn("Index '{}' has no uncompressed partitions, using compressed ones.", index_name);
-          }
+          skip++;
         }
+      }
+
+      if (skip)
+      {
+        spdlog::warn("Ignoring {} queries (min query length is {} for index '{}'{})",
+                     skip,
+                     o->z + ref.smer_size(),
+                     ref.name(),
+                     group.size() > 1 ? fmt::format(" and {} others", group.size() - 1) : "");
+      }
+
+      pool.parallel_for(0, smers->nb_partitions(), [&smers](int, std::size_t p){
+        smers->partition(p);
+      });
+
+      spdlog::debug("{} queries hashed for {} sub-indexes ({}).", smers->size(), group.size(), htime.formatted());
+
+      std::vector<index_infos> infos;
+      infos.reserve(group.size());
+      for (auto& index_name : group)
+        infos.push_back(load_infos(global, index_name, o->uncompressed));
 
-        kindex ki(infos, o->cache);
+      auto jobs = schedule_query2(std::move(infos), *smers, pool.size(), o->fused, with_positions);
 
-        ki.solve_batch(b);
-        b.free_smers();
+      std::size_t nb_split = std::count_if(jobs.begin(), jobs.end(), [](auto& j){ return j->nb_units > 1; });
+      std::size_t nb_packed = std::count_if(jobs.begin(), jobs.end(), [](auto& j){ return j->infos.size() > 1; });
+      spdlog::debug("{} sub-indexes scheduled in {} jobs ({} split by partitions, {} packed).",
+                    group.size(), jobs.size(), nb_split, nb_packed);
+
+      // Jobs are started by decreasing cost, as long as their memory fits in the budget.
+      // Waiting here rather than in the workers keeps them busy with the started jobs.
+      task_group tasks;
+      std::atomic<bool> failed {false};
+
+      for (auto& job : jobs)
+      {
+        if (failed || !memory.acquire(job->memory, [&failed](){ return failed.load(); }))
+          break;
+        job->ticket = std::make_shared<memory_ticket>(memory, job->memory);
+        job->remaining = job->nb_units;
 
-        query_result_agg agg;
-        for (auto&& r : b.response())
+        for (std::size_t u = 0; u < job->nb_units; ++u)
         {
-          agg.add(query_result(std::move(r), o->z, infos, with_positions));
+          pool.add_task(tasks, [job, u, &o, &smers, &failed, with_positions](int){
+            try
+            {
+              run_query2_unit(*job, u, o, smers, with_positions);
+            }
+            catch (...)
+            {
+              failed = true;
+              throw;
+            }
+          });
         }
-        agg.output(infos, o->output, o->format, "", o->sk_threshold);
+      }
 
-        spdlog::info("Index '{}' processed. ({})", infos.name(), timer.formatted());
-      });
+      pool.wait(tasks);
     }
-    pool.join_all();
+
+    if (memory.limit())
+      spdlog::info("Peak memory: {} MB held by responses (limit {} MB, {:.1f}s waiting for memory).",
+                   memory.peak() >> 20, memory.limit() >> 20, memory.waited() / 1e9);
+    else
+      spdlog::info("Peak memory: {} MB held by responses.", memory.peak() >> 20);
+
     spdlog::info("Done ({}).", gtime.formatted());
   }
 }
@@ -127,14 +127,9 @@ namespace kmq {
 
 
       ThreadPool pool(opt->nb_threads);
-      for (std::size_t p = 0; p < infos.nb_partitions(); ++p)
-      {
-        pool.add_task([p, &bq, &si](int) { 
-          si.search_partition(p, bq);
-        });
-      }
-
-      pool.join_all();
+      pool.parallel_for(0, infos.nb_partitions(), [&bq, &si](int, std::size_t p) {
+        si.search_partition(p, bq);
+      });
 
       bq.free_smers();
 
@@ -0,0 +1,79 @@
+#ifndef FASTX_HPP_QC7MWB2E
+#define FASTX_HPP_QC7MWB2E
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kmq {
+
+  enum class fastx_type
+  {
+    fasta,
+    fastq
+  };
+
+  struct fastx_record_view
+  {
+    std::string_view name;
+    std::string_view seq;
+  };
+
+  // A set of records parsed from a memory region. The views point into the region,
+  // which is kept alive by the chunk.
+  class fastx_chunk
+  {
+    public:
+      fastx_chunk(std::shared_ptr<const void> storage)
+        : m_storage(std::move(storage)) {}
+
+      std::vector<fastx_record_view>& records()
+      {
+        return m_records;
+      }
+
+      const std::vector<fastx_record_view>& records() const
+      {
+        return m_records;
+      }
+
+      std::size_t size() const
+      {
+        return m_records.size();
+      }
+
+    private:
+      std::shared_ptr<const void> m_storage {nullptr};
+      std::vector<fastx_record_view> m_records;
+  };
+
+  using fastx_chunk_t = std::shared_ptr<fastx_chunk>;
+
+  // Record type from the first non-blank character, throws kmq_io_error if it is neither '>' nor '@'.
+  fastx_type guess_fastx_type(const char* begin, const char* end);
+
+  // First record start in [from, end), 'end' if there is none. 'begin' is the start of the
+  // region, from which 'from' is assumed to be reachable. FASTQ records are expected on four lines.
+  const char* next_fastx_record(const char* begin, const char* end, const char* from, fastx_type type);
+
+  // False if one of the first 'nb_records' FASTQ records of [begin, end) is not on four lines
+  // (multi-line sequence or quality). A record cut by 'end' is not checked.
+  bool is_four_line_fastq(const char* begin, const char* end, std::size_t nb_records = 1024);
+
+  // Parse the records of [begin, end), which must start on a record and end on a record boundary.
+  // Sequences on several lines are joined in place, so the region must be writable.
+  // FASTQ records are expected on four lines unless 'multiline' is set: parse_fastx then returns
+  // false, with 'records' partially filled, on the first record which is not or which is cut by
+  // 'end', the boundaries found by next_fastx_record being unreliable around such records.
+  // With 'multiline', quality lines are read until they cover the sequence, as kseq does.
+  // Throws kmq_io_error on malformed records.
+  bool parse_fastx(char* begin,
+                   char* end,
+                   fastx_type type,
+                   std::vector<fastx_record_view>& records,
+                   bool multiline = false);
+
+}
+
+#endif /* end of include guard: FASTX_HPP_QC7MWB2E */
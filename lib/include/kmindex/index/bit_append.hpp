@@ -0,0 +1,132 @@
+#ifndef BIT_APPEND_HPP_J4RW8TLE
+#define BIT_APPEND_HPP_J4RW8TLE
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace kmq {
+
+  // Bit strings in the order of BITSET/BITCHECK (presence/absence rows): bit k is (1 << k % 8)
+  // of byte k / 8.
+
+  // ORs the first 'nbits' bits of 'src' into 'dst' from bit 'offset'. Bits of 'src' beyond
+  // 'nbits' are ignored, bits of 'dst' outside [offset, offset + nbits) are left unchanged.
+  // A byte-aligned offset is a plain copy (the destination range is expected to be zero),
+  // other offsets are shifted by 64-bit words on little-endian targets.
+  inline void append_bits(std::uint8_t* dst, std::size_t offset, const std::uint8_t* src, std::size_t nbits)
+  {
+    std::uint8_t* d = dst + offset / 8;
+    unsigned s = offset % 8;
+    std::size_t full = nbits / 8;
+    unsigned rest = nbits % 8;
+
+    std::size_t i = 0;
+    // Bits shifted out of the previous byte or word, in the low 's' bits.
+    unsigned carry = 0;
+
+    if (s == 0)
+    {
+      if (full)
+        std::memcpy(d, src, full);
+      i = full;
+    }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    else
+    {
+      // Little-endian words hold the bits in stream order: shifting a word shifts the string.
+      for (; i + 8 <= full; i += 8)
+      {
+        std::uint64_t w, o;
+        std::memcpy(&w, src + i, 8);
+        std::memcpy(&o, d + i, 8);
+        o |= (w << s) | carry;
+        std::memcpy(d + i, &o, 8);
+        carry = static_cast<unsigned>(w >> (64 - s));
+      }
+    }
+#endif
+
+    for (; i < full; ++i)
+    {
+      unsigned v = (static_cast<unsigned>(src[i]) << s) | carry;
+      d[i] |= static_cast<std::uint8_t>(v);
+      carry = v >> 8;
+    }
+
+    if (rest)
+    {
+      unsigned v = ((static_cast<unsigned>(src[i]) & ((1u << rest) - 1)) << s) | carry;
+      d[i] |= static_cast<std::uint8_t>(v);
+      carry = v >> 8;
+    }
+    else if (s == 0)
+    {
+      return;
+    }
+
+    // Set bits of the carry are within the destination range, its byte exists.
+    if (carry)
+      d[i + (rest ? 1 : 0)] |= static_cast<std::uint8_t>(carry);
+  }
+
+  // Same as append_bits, for bit strings in the order of bitpacker (abundance rows): bit k is
+  // (0x80 >> k % 8) of byte k / 8. Words are loaded big-endian.
+  inline void append_bits_msb(std::uint8_t* dst, std::size_t offset, const std::uint8_t* src, std::size_t nbits)
+  {
+    std::uint8_t* d = dst + offset / 8;
+    unsigned s = offset % 8;
+    std::size_t full = nbits / 8;
+    unsigned rest = nbits % 8;
+
+    std::size_t i = 0;
+    // Bits shifted out of the previous byte or word, in the high 's' bits.
+    unsigned carry = 0;
+
+    if (s == 0)
+    {
+      if (full)
+        std::memcpy(d, src, full);
+      i = full;
+    }
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    else
+    {
+      for (; i + 8 <= full; i += 8)
+      {
+        std::uint64_t w, o;
+        std::memcpy(&w, src + i, 8);
+        std::memcpy(&o, d + i, 8);
+        w = __builtin_bswap64(w);
+        o |= __builtin_bswap64((w >> s) | (static_cast<std::uint64_t>(carry) << 56));
+        std::memcpy(d + i, &o, 8);
+        carry = static_cast<unsigned>((w << (64 - s)) >> 56);
+      }
+    }
+#endif
+
+    for (; i < full; ++i)
+    {
+      unsigned v = src[i];
+      d[i] |= static_cast<std::uint8_t>((v >> s) | carry);
+      carry = (v << (8 - s)) & 0xff;
+    }
+
+    if (rest)
+    {
+      unsigned v = src[i] & (0xff00u >> rest) & 0xff;
+      d[i] |= static_cast<std::uint8_t>((v >> s) | carry);
+      carry = (v << (8 - s)) & 0xff;
+    }
+    else if (s == 0)
+    {
+      return;
+    }
+
+    if (carry)
+      d[i + (rest ? 1 : 0)] |= static_cast<std::uint8_t>(carry);
+  }
+
+}
+
+#endif /* end of include guard: BIT_APPEND_HPP_J4RW8TLE */
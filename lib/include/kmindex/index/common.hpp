@@ -19,7 +19,7 @@ namespace kmq {
     using hw_type = std::shared_ptr<km::HashWindow>;
 
     void operator()(std::vector<qpart_type>& smers,
-                    const std::string& seq,
+                    std::string_view seq,
                     std::uint32_t qid,
                     std::size_t smer_size,
                     repart_type& repart,
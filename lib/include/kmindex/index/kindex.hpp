@@ -2,6 +2,7 @@
 #define INDEX_HPP_FJYOTLJN
 
 #include <memory>
+#include <mutex>
 #include <kmindex/query/query_results.hpp>
 #include <kmindex/index/index_infos.hpp>
 #include <kmindex/spinlock.hpp>
@@ -20,6 +21,18 @@ namespace kmq {
     public:
       virtual ~partition_interface() = default;
       virtual void query(std::uint64_t pos, std::uint8_t* dest) = 0;
+
+      // Hint that the row at 'pos' is going to be queried soon.
+      virtual void prefetch(std::uint64_t) {}
+
+      // Load the whole partition in memory.
+      virtual void prefault() {}
+
+      // Drop the pages loaded so far, the partition stays usable.
+      virtual void release() {}
+
+      // Bytes held by the partition once fully loaded.
+      virtual std::size_t memory() const { return 0; }
   };
 
   class partition : public partition_interface
@@ -31,6 +44,14 @@ namespace kmq {
 
       virtual void query(std::uint64_t pos, std::uint8_t* dest);
 
+      virtual void prefetch(std::uint64_t pos);
+
+      virtual void prefault();
+
+      virtual void release();
+
+      virtual std::size_t memory() const;
+
     private:
       int m_fd {0};
       mio::mmap_source m_mapped;
@@ -48,15 +69,23 @@ namespace kmq {
 
       virtual void query(std::uint64_t pos, std::uint8_t* dest);
 
+      virtual std::size_t memory() const;
+
     private:
       std::unique_ptr<BlockDecompressor> m_ptr_bd;
       std::size_t m_nb_samples {0};
       std::size_t m_bytes {0};
+      std::size_t m_size {0};
   };
 #endif
 
+  // Partition p of a sub-index, compressed or not.
+  std::unique_ptr<partition_interface> make_partition(const index_infos& infos, std::size_t p);
+
   class kindex
   {
+    friend class fused_kindex;
+
     public:
 
       kindex();
@@ -76,7 +105,7 @@ namespace kmq {
         for (std::size_t p = 0; p < m_infos.nb_partitions(); p++)
           order.push_back(p);
 #ifndef __APPLE__
-        static std::mt19937 g{std::random_device{}()};
+        thread_local std::mt19937 g{std::random_device{}()};
         std::shuffle(std::begin(order), std::end(order), g);
 #endif
         for (auto const& p : order)
@@ -88,8 +117,6 @@ namespace kmq {
         auto& smers = bq.partition(p);
         auto& responses = bq.response();
 
-        std::sort(std::begin(smers), std::end(smers));
-
         std::unique_lock<spinlock> lock(m_mutexes[p]);
         init(p);
         for (auto& [mer, qid] : smers)
@@ -105,21 +132,19 @@ namespace kmq {
         for (std::size_t p = 0; p < m_infos.nb_partitions(); p++)
           order.push_back(p);
 #ifndef __APPLE__
-        static std::mt19937 g{std::random_device{}()};
+        thread_local std::mt19937 g{std::random_device{}()};
         std::shuffle(std::begin(order), std::end(order), g);
 #endif
         for (auto const& p : order)
           solve_one_cache(bq, p);
       }
 
+      // Partitions stay mapped and are only read, concurrent lookups do not need the lock.
       void solve_one_cache(batch_query& bq, std::size_t p)
       {
         auto& smers = bq.partition(p);
         auto& responses = bq.response();
 
-        std::sort(std::begin(smers), std::end(smers));
-
-        std::unique_lock<spinlock> lock(m_mutexes[p]);
         for (auto& [mer, qid] : smers)
         {
           m_partitions[p]->query(mer.h, responses[qid]->get(mer.i));
@@ -134,13 +159,103 @@ namespace kmq {
           solve(bq);
       }
 
+      // Lookups of partition p only. Different partitions of a batch can be solved concurrently,
+      // their s-mers write to distinct positions of the responses.
+      void solve_partition(batch_query& bq, std::size_t p)
+      {
+        if (m_cache)
+          solve_one_cache(bq, p);
+        else
+          solve_one(bq, p);
+      }
+
+      // Load all the partitions in memory, only for instances built with 'cache'.
+      void prefault();
+
       index_infos& infos();
+      const index_infos& infos() const;
     private:
       index_infos m_infos;
       std::vector<std::unique_ptr<partition_interface>> m_partitions;
       std::vector<spinlock> m_mutexes;
       bool m_cache {false};
   };
+
+  // Lookups in several sub-indexes sharing the same configuration (see index_infos::sha1).
+  // For each partition, the sorted s-mers are walked once and the rows are fetched from all
+  // the sub-indexes in lockstep, as if they were merged.
+  class fused_kindex
+  {
+    public:
+      // Max number of sub-indexes fused together, which bounds the number of partitions
+      // opened at the same time.
+      static constexpr std::size_t max_fused = 64;
+
+      // Rows fetched ahead of the current one.
+      static constexpr std::size_t lookahead = 16;
+
+      fused_kindex(std::vector<kindex*> indexes)
+        : m_indexes(std::move(indexes)) {}
+
+      // bqs[i] holds the responses for indexes[i], all built on the same smer_batch.
+      void solve_one(std::vector<batch_query>& bqs, std::size_t p)
+      {
+        auto& smers = bqs.front().partition(p);
+        std::size_t n = m_indexes.size();
+
+        std::vector<std::unique_lock<spinlock>> locks;
+        std::vector<partition_interface*> parts(n);
+        std::vector<std::vector<query_response_t>*> responses(n);
+        locks.reserve(n);
+
+        for (std::size_t g = 0; g < n; ++g)
+        {
+          kindex* ki = m_indexes[g];
+          locks.emplace_back(ki->m_mutexes[p]);
+          if (!ki->m_cache)
+            ki->init(p);
+          parts[g] = ki->m_partitions[p].get();
+          responses[g] = &bqs[g].response();
+        }
+
+        for (std::size_t i = 0; i < smers.size(); ++i)
+        {
+          if (i + lookahead < smers.size())
+          {
+            std::uint64_t h = smers[i + lookahead].first.h;
+            for (std::size_t g = 0; g < n; ++g)
+              parts[g]->prefetch(h);
+          }
+
+          auto& [mer, qid] = smers[i];
+          for (std::size_t g = 0; g < n; ++g)
+            parts[g]->query(mer.h, (*responses[g])[qid]->get(mer.i));
+        }
+
+        for (std::size_t g = 0; g < n; ++g)
+        {
+          if (!m_indexes[g]->m_cache)
+            m_indexes[g]->m_partitions[p] = nullptr;
+        }
+      }
+
+      void solve_batch(std::vector<batch_query>& bqs)
+      {
+        std::size_t nb_partitions = m_indexes.front()->infos().nb_partitions();
+        std::vector<std::size_t> order; order.reserve(nb_partitions);
+        for (std::size_t p = 0; p < nb_partitions; p++)
+          order.push_back(p);
+#ifndef __APPLE__
+        thread_local std::mt19937 g{std::random_device{}()};
+        std::shuffle(std::begin(order), std::end(order), g);
+#endif
+        for (auto const& p : order)
+          solve_one(bqs, p);
+      }
+
+    private:
+      std::vector<kindex*> m_indexes;
+  };
 }
 
 
@@ -3,6 +3,7 @@
 
 #include <kmindex/index/index.hpp>
 #include <kmindex/threadpool.hpp>
+#include <mio/mmap.hpp>
 #include <string>
 #include <vector>
 #include <memory>
@@ -19,6 +20,22 @@ namespace kmq {
   class index_merger
   {
     protected:
+      // Partitions are split into ranges of rows merged in parallel. A range is merged in a
+      // page-aligned buffer of its worker, then written at its offset in the output file,
+      // allocated beforehand.
+      static constexpr std::size_t range_bytes = 8 << 20;
+
+      // Output bytes merged per tile of rows within a range, sized for the sources and the
+      // output to stay in cache while a tile is merged.
+      static constexpr std::size_t tile_bytes = 1 << 18;
+
+      // Sources of a partition (mapped with their header, number of samples) and the output.
+      struct partition_io
+      {
+        std::vector<std::pair<mio::mmap_source, std::size_t>> sources;
+        int fd {-1};
+      };
+
       index_merger(index* gindex,
                    const std::vector<std::string>& to_merge,
                    const std::string& new_path,
@@ -32,16 +49,41 @@ namespace kmq {
       void remove_old() const;
       void remove_old(std::size_t p) const;
 
-      virtual void merge_one(std::size_t p) const = 0;
+      // Appends 'n' rows of 'nb_samples' samples from 'src' to the rows of 'dst', of
+      // 'bytes_per_row' bytes, from bit 'offset'.
+      virtual void append_rows(std::uint8_t* dst,
+                               std::size_t bytes_per_row,
+                               std::size_t offset,
+                               const std::uint8_t* src,
+                               std::size_t nb_samples,
+                               std::size_t n) const = 0;
+
+      void open_sources(std::size_t p, partition_io& io) const;
+      void create_output(std::size_t p, partition_io& io) const;
+
+      // Merges the rows [first, first + n) of a partition into 'buffer'.
+      void merge_range(const partition_io& io, std::size_t first, std::size_t n, std::uint8_t* buffer) const;
 
       void copy_tree(const std::string& path) const;
       void copy_trees() const;
 
-      void zero(std::size_t p) const;
-
     public:
       void rename(const std::string& rename_string) const;
-      virtual void merge(ThreadPool& pool) const = 0;
+      void merge(ThreadPool& pool) const;
+
+      // Writes the header and the first 'nb_rows' merged rows of partition 'p' to 'path', as an
+      // uncompressed partition.
+      void write_rows(std::size_t p, std::size_t nb_rows, const std::string& path) const;
+
+#ifdef KMINDEX_WITH_COMPRESSION
+      // Same as merge, but the merged rows are compressed by blocks ('blocks{p}' and
+      // 'blocks{p}.ef', see kmindex compress) with the configuration at 'config_path'. No
+      // uncompressed partition is written. If 'order' is not empty, the columns are reordered
+      // by this bitmatrixshuffle order, as kmindex compress --reorder. Presence/absence only.
+      void merge_compressed(ThreadPool& pool,
+                            const std::string& config_path,
+                            const std::vector<std::uint64_t>& order) const;
+#endif
     protected:
       index* m_index;
       std::vector<std::string> m_to_merge;
@@ -54,7 +96,6 @@ namespace kmq {
       std::size_t m_psize {0};
       std::size_t m_nb_samples {0};
       std::size_t m_nb_parts {0};
-      mutable std::vector<std::vector<std::uint8_t>> m_buffer;
   };
 
   using index_merger_t = std::shared_ptr<index_merger>;
@@ -69,8 +110,13 @@ namespace kmq {
                      rename_mode mode,
                      bool rm);
 
-      void merge_one(std::size_t p) const override final;
-      void merge(ThreadPool& pool) const override final;
+    protected:
+      void append_rows(std::uint8_t* dst,
+                       std::size_t bytes_per_row,
+                       std::size_t offset,
+                       const std::uint8_t* src,
+                       std::size_t nb_samples,
+                       std::size_t n) const override final;
   };
 
   class index_merger_abs : public index_merger
@@ -84,8 +130,13 @@ namespace kmq {
                        bool rm,
                        std::size_t bw);
 
-      void merge_one(std::size_t p) const override final;
-      void merge(ThreadPool& pool) const override final;
+    protected:
+      void append_rows(std::uint8_t* dst,
+                       std::size_t bytes_per_row,
+                       std::size_t offset,
+                       const std::uint8_t* src,
+                       std::size_t nb_samples,
+                       std::size_t n) const override final;
   };
 
   index_merger_t make_merger(index* gindex,
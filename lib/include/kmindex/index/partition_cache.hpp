@@ -0,0 +1,97 @@
+#ifndef PARTITION_CACHE_HPP_N4XKD7QE
+#define PARTITION_CACHE_HPP_N4XKD7QE
+
+#include <atomic>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <kmindex/index/index_infos.hpp>
+#include <kmindex/index/kindex.hpp>
+
+namespace kmq {
+
+  enum class cache_policy
+  {
+    lru,
+    lfu
+  };
+
+  cache_policy str_to_cache_policy(const std::string& s);
+
+  struct partition_cache_stats
+  {
+    std::uint64_t hits {0};
+    std::uint64_t misses {0};
+    std::uint64_t evictions {0};
+    std::size_t bytes {0};
+    std::size_t capacity {0};
+    std::size_t entries {0};
+  };
+
+  // Partitions of several sub-indexes kept open within a byte budget, shared by concurrent users.
+  // Partitions are opened on first access. When the budget is exceeded, the least recently
+  // (lru) or least frequently (lfu, ties broken by recency) used partitions are released
+  // (MADV_DONTNEED) and closed. A partition in use is closed when its last user is done.
+  class partition_cache
+  {
+    struct entry
+    {
+      std::shared_ptr<partition_interface> part;
+      std::size_t bytes {0};
+      std::uint64_t uses {0};
+      // Compressed partitions decode into their own buffers, lookups are serialized. A whole
+      // partition lookup is held, waiters sleep instead of spinning.
+      bool exclusive {false};
+      std::mutex lock;
+      std::list<std::string>::iterator pos;
+      // Position in the bucket of its use count (lfu).
+      std::list<std::string>::iterator bucket_pos;
+    };
+
+    using entry_t = std::shared_ptr<entry>;
+
+    public:
+      partition_cache(std::size_t capacity, cache_policy policy = cache_policy::lru);
+
+      // Lookups of partition p of 'infos' for the s-mers of 'bq'.
+      void solve(const index_infos& infos, batch_query& bq, std::size_t p);
+
+      partition_cache_stats stats() const;
+
+      // Drop the partitions of 'infos', e.g. when the sub-index is rebuilt in place.
+      void drop(const index_infos& infos);
+
+    private:
+      entry_t get(const index_infos& infos, std::size_t p);
+      void evict();
+
+      void touch(const std::string& key, entry& e);
+      void unlink(entry& e);
+      void halve_uses();
+
+    private:
+      std::size_t m_capacity {0};
+      cache_policy m_policy {cache_policy::lru};
+
+      mutable std::mutex m_mutex;
+      std::unordered_map<std::string, entry_t> m_entries;
+      // Most recently used first.
+      std::list<std::string> m_order;
+      // lfu: keys by use count, most recently used first in each bucket. The victim is the last
+      // key of the first bucket.
+      std::map<std::uint64_t, std::list<std::string>> m_buckets;
+      std::size_t m_bytes {0};
+
+      std::atomic<std::uint64_t> m_hits {0};
+      std::atomic<std::uint64_t> m_misses {0};
+      std::atomic<std::uint64_t> m_evictions {0};
+  };
+
+}
+
+#endif /* end of include guard: PARTITION_CACHE_HPP_N4XKD7QE */
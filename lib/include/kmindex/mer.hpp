@@ -185,9 +185,15 @@ namespace kmq {
       smer_iterator& operator++()
       {
         ++m_current;
-        m_sk = m_sk * 4 + ((m_seq[m_current + m_smer_size - 1] >> 1) & 3);
-        m_sk &= m_mask;
-        m_smer = (m_hash)(m_sk.canonical(), m_current);
+        // Stepping to end() loads nothing: sequences may be views on a mapped file, with no
+        // byte after the last one.
+        std::size_t last = m_current + m_smer_size - 1;
+        if (last < m_seq.size())
+        {
+          m_sk = m_sk * 4 + ((m_seq[last] >> 1) & 3);
+          m_sk &= m_mask;
+          m_smer = (m_hash)(m_sk.canonical(), m_current);
+        }
         return *this;
       }
 
@@ -5,6 +5,9 @@
 #include <atomic>
 #include <string_view>
 #include <cassert>
+#include <algorithm>
+#include <memory>
+#include <mutex>
 
 #ifndef KMTRICKS_PUBLIC
   #define KMTRICKS_PUBLIC
@@ -29,14 +32,119 @@ namespace kmq {
       std::uint8_t* get(std::size_t mer_pos);
       void free();
 
+      // S-mers whose partition was not looked up, e.g. when a deadline is reached.
+      void unresolve(std::size_t mer_pos);
+      bool resolved(std::size_t mer_pos) const;
+      bool complete() const;
+
     private:
       std::string m_name;
       std::vector<std::uint8_t> m_responses;
       std::size_t m_block_size {0};
+      // Empty when all the s-mers are resolved.
+      std::vector<bool> m_unresolved;
   };
 
   using query_response_t = std::unique_ptr<query_response>;
 
+  // Hashed s-mers of a set of queries, bucketed by partition. Buckets only depend on the
+  // s-mer size, the repartition and the hash window, i.e. on index_infos::sha1(), so a batch
+  // can be shared by all the compatible sub-indexes.
+  class smer_batch
+  {
+    using qsmer_type = std::pair<smer, std::uint32_t>;
+    using qpart_type = std::vector<qsmer_type>;
+    using repart_type = std::shared_ptr<km::Repartition>;
+    using hw_type = std::shared_ptr<km::HashWindow>;
+
+    public:
+      smer_batch(std::size_t nb_partitions,
+                 std::size_t smer_size,
+                 repart_type repart,
+                 hw_type hw,
+                 std::size_t minim_size)
+        : m_nb_parts(nb_partitions),
+          m_smer_size(smer_size),
+          m_repart(repart),
+          m_hw(hw),
+          m_msize(minim_size),
+          m_smers(m_nb_parts),
+          m_sorted(new std::once_flag[m_nb_parts])
+      {
+      }
+
+      void add_query(std::string name, std::string_view seq)
+      {
+        std::uint32_t qid = m_names.size();
+
+        m_names.push_back(std::move(name));
+        m_sizes.push_back(seq.size() - m_smer_size + 1);
+
+        loop_executor<MAX_KMER_SIZE>::exec<smer_functor>(m_smer_size, m_smers, seq, qid, m_smer_size, m_repart, m_hw, m_msize);
+      }
+
+      // S-mers of partition p, sorted on first access. Queries cannot be added afterwards.
+      const qpart_type& partition(std::size_t p)
+      {
+        std::call_once(m_sorted[p], [this, p](){
+          std::sort(std::begin(m_smers[p]), std::end(m_smers[p]));
+        });
+        return m_smers[p];
+      }
+
+      std::size_t size() const
+      {
+        return m_names.size();
+      }
+
+      // Number of s-mers in partition p, whether sorted or not.
+      std::size_t partition_size(std::size_t p) const
+      {
+        return m_smers[p].size();
+      }
+
+      std::size_t nb_partitions() const
+      {
+        return m_nb_parts;
+      }
+
+      const std::string& name(std::size_t qid) const
+      {
+        return m_names[qid];
+      }
+
+      std::size_t nb_smers(std::size_t qid) const
+      {
+        return m_sizes[qid];
+      }
+
+      // Bytes used by the batch, mostly by the s-mers buckets.
+      std::size_t memory() const
+      {
+        std::size_t bytes = m_sizes.capacity() * sizeof(std::size_t);
+        for (auto& n : m_names)
+          bytes += sizeof(std::string) + n.capacity();
+        for (auto& p : m_smers)
+          bytes += p.capacity() * sizeof(qsmer_type);
+        return bytes;
+      }
+
+    private:
+      std::size_t m_nb_parts {0};
+      std::size_t m_smer_size {0};
+
+      repart_type m_repart {nullptr};
+      hw_type m_hw {nullptr};
+      std::size_t m_msize {0};
+
+      std::vector<std::string> m_names;
+      std::vector<std::size_t> m_sizes;
+      std::vector<qpart_type> m_smers;
+      std::unique_ptr<std::once_flag[]> m_sorted;
+  };
+
+  using smer_batch_t = std::shared_ptr<smer_batch>;
+
   class batch_query
   {
     using qsmer_type = std::pair<smer, std::uint32_t>;
@@ -54,15 +162,28 @@ namespace kmq {
                   hw_type hw,
                   std::size_t minim_size)
         : m_nb_samples(nb_samples),
-          m_nb_parts(nb_partitions),
-          m_smer_size(smer_size),
           m_z_size(z_size),
           m_width(width),
-          m_repart(repart),
-          m_hw(hw),
-          m_msize(minim_size),
-          m_smers(m_nb_parts)
+          m_smers(std::make_shared<smer_batch>(nb_partitions, smer_size, repart, hw, minim_size))
+      {
+      }
+
+      // Responses for the queries of an already hashed batch.
+      batch_query(std::size_t nb_samples,
+                  std::size_t z_size,
+                  std::size_t width,
+                  smer_batch_t smers)
+        : m_nb_samples(nb_samples),
+          m_z_size(z_size),
+          m_width(width),
+          m_smers(std::move(smers))
       {
+        m_responses.reserve(m_smers->size());
+        for (std::size_t i = 0; i < m_smers->size(); ++i)
+        {
+          m_responses.push_back(
+            std::make_unique<query_response>(m_smers->name(i), m_smers->nb_smers(i), m_nb_samples, m_width));
+        }
       }
 
     public:
@@ -71,22 +192,18 @@ namespace kmq {
         m_responses.reserve(nb_queries);
       }
 
-      void add_query(const std::string name,
-                     const std::string& seq)
+      void add_query(std::string name, std::string_view seq)
       {
-        std::size_t n = seq.size() - m_smer_size + 1;
+        m_smers->add_query(std::move(name), seq);
 
+        std::size_t qid = m_smers->size() - 1;
         m_responses.push_back(
-            std::make_unique<query_response>(std::move(name), n, m_nb_samples, m_width));
-
-        std::uint32_t qid = m_responses.size() - 1;
-
-        loop_executor<MAX_KMER_SIZE>::exec<smer_functor>(m_smer_size, m_smers, seq, qid, m_smer_size, m_repart, m_hw, m_msize);
+            std::make_unique<query_response>(m_smers->name(qid), m_smers->nb_smers(qid), m_nb_samples, m_width));
       }
 
-      qpart_type& partition(std::size_t p)
+      const qpart_type& partition(std::size_t p)
       {
-        return m_smers[p];
+        return m_smers->partition(p);
       }
 
       std::vector<query_response_t>& response()
@@ -94,19 +211,15 @@ namespace kmq {
         return m_responses;
       }
 
-      auto begin()
+      const smer_batch_t& smers() const
       {
-        return m_smers.begin();
-      }
-
-      auto end()
-      {
-        return m_smers.end();
+        return m_smers;
       }
 
+      // Release the s-mers, shared batches are freed when their last user releases them.
       void free_smers()
       {
-        free_container(m_smers);
+        m_smers = nullptr;
       }
 
       void free_responses()
@@ -119,21 +232,13 @@ namespace kmq {
         return m_responses.size();
       }
 
-    private:
-
     private:
       std::size_t m_nb_samples {0};
-      std::size_t m_nb_parts {0};
-      std::size_t m_smer_size {0};
       std::size_t m_z_size {0};
       std::size_t m_width {0};
 
-      repart_type m_repart {nullptr};
-      hw_type m_hw {nullptr};
-      std::size_t m_msize {0};
-
+      smer_batch_t m_smers {nullptr};
       std::vector<query_response_t> m_responses;
-      std::vector<qpart_type> m_smers;
   };
 
 }
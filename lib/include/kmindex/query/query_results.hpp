@@ -2,6 +2,7 @@
 #define QUERY_RESULTS_HPP_VLPMAIEE
 
 #include <mutex>
+#include <ostream>
 #include <kmindex/query/query.hpp>
 
 namespace kmq {
@@ -26,8 +27,14 @@ namespace kmq {
 
       void compute_abs_pos();
 
+      // K-mers the ratios are computed over, i.e. whose s-mers were all looked up.
       std::size_t nbk() const;
 
+      std::size_t nbk_total() const;
+
+      // Fraction of the k-mers of the query covered by the ratios.
+      double coverage() const;
+
       const std::vector<std::uint32_t>& counts() const;
 
       const std::vector<double>& ratios() const;
@@ -38,6 +45,11 @@ namespace kmq {
 
       double threshold() const;
 
+    private:
+      void count_resolved();
+
+      double ratio(double count) const;
+
     private:
       std::vector<double> m_ratios;
       std::vector<std::uint32_t> m_counts;
@@ -46,6 +58,7 @@ namespace kmq {
       std::size_t m_z;
       const index_infos& m_infos;
       std::uint32_t m_nbk;
+      std::uint32_t m_nbk_resolved;
   };
 
   class query_result_agg
@@ -73,6 +86,12 @@ namespace kmq {
                   const std::string& qname,
                   double threshold);
 
+      void output(const index_infos& infos,
+                  std::ostream& out,
+                  enum format f,
+                  const std::string& qname,
+                  double threshold);
+
     private:
       std::mutex m_mutex;
       std::vector<query_result> m_results;
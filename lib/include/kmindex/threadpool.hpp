@@ -1,22 +1,222 @@
 #ifndef THREADPOOL_HPP_DMXPPU0Y
 #define THREADPOOL_HPP_DMXPPU0Y
 
-#include <future>
-#include <iostream>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <stdexcept>
-#include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include <kmindex/spinlock.hpp>
+
 namespace kmq {
 
+  class task_group;
+  class ThreadPool;
+
+  // Type-erased 'void(int)' callable. Callables up to 'capacity' bytes are stored inline,
+  // submitting them does not allocate.
+  class task
+  {
+    public:
+      static constexpr std::size_t capacity = 64;
+
+      task() noexcept = default;
+
+      template<typename Callable,
+               typename F = std::decay_t<Callable>,
+               typename = std::enable_if_t<!std::is_same_v<F, task>>>
+      task(Callable&& f, task_group* group = nullptr)
+        : m_group(group)
+      {
+        if constexpr (is_inline<F>())
+        {
+          ::new (static_cast<void*>(&m_storage)) F(std::forward<Callable>(f));
+          m_ops = &inline_ops<F>::table;
+        }
+        else
+        {
+          ::new (static_cast<void*>(&m_storage)) F*(new F(std::forward<Callable>(f)));
+          m_ops = &heap_ops<F>::table;
+        }
+      }
+
+      task(task&& other) noexcept
+        : m_group(other.m_group), m_ops(other.m_ops)
+      {
+        if (m_ops)
+        {
+          m_ops->move(&m_storage, &other.m_storage);
+          other.m_ops = nullptr;
+          other.m_group = nullptr;
+        }
+      }
+
+      task& operator=(task&& other) noexcept
+      {
+        if (this != &other)
+        {
+          reset();
+          m_group = other.m_group;
+          m_ops = other.m_ops;
+          if (m_ops)
+          {
+            m_ops->move(&m_storage, &other.m_storage);
+            other.m_ops = nullptr;
+            other.m_group = nullptr;
+          }
+        }
+        return *this;
+      }
+
+      task(const task&) = delete;
+      task& operator=(const task&) = delete;
+
+      ~task()
+      {
+        reset();
+      }
+
+      void operator()(int thread_id)
+      {
+        m_ops->invoke(&m_storage, thread_id);
+      }
+
+      explicit operator bool() const noexcept
+      {
+        return m_ops != nullptr;
+      }
+
+      task_group* group() const noexcept
+      {
+        return m_group;
+      }
+
+      void reset() noexcept
+      {
+        if (m_ops)
+        {
+          m_ops->destroy(&m_storage);
+          m_ops = nullptr;
+        }
+        m_group = nullptr;
+      }
+
+    private:
+      struct ops
+      {
+        void (*invoke)(void*, int);
+        void (*move)(void*, void*);
+        void (*destroy)(void*);
+      };
+
+      template<typename F>
+      static constexpr bool is_inline()
+      {
+        return sizeof(F) <= capacity
+            && alignof(F) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<F>;
+      }
+
+      template<typename F>
+      struct inline_ops
+      {
+        static void invoke(void* s, int i) { (*static_cast<F*>(s))(i); }
+        static void move(void* d, void* s)
+        {
+          ::new (d) F(std::move(*static_cast<F*>(s)));
+          static_cast<F*>(s)->~F();
+        }
+        static void destroy(void* s) { static_cast<F*>(s)->~F(); }
+        static constexpr ops table {invoke, move, destroy};
+      };
+
+      template<typename F>
+      struct heap_ops
+      {
+        static void invoke(void* s, int i) { (**static_cast<F**>(s))(i); }
+        static void move(void* d, void* s) { ::new (d) F*(*static_cast<F**>(s)); }
+        static void destroy(void* s) { delete *static_cast<F**>(s); }
+        static constexpr ops table {invoke, move, destroy};
+      };
+
+    private:
+      alignas(std::max_align_t) unsigned char m_storage[capacity];
+      task_group* m_group {nullptr};
+      const ops* m_ops {nullptr};
+  };
+
+  // Set of tasks that can be waited on independently from the rest of the pool.
+  // Tasks of a group may add new tasks to the same group.
+  class task_group
+  {
+    friend class ThreadPool;
+
+    public:
+      task_group() = default;
+      task_group(const task_group&) = delete;
+      task_group& operator=(const task_group&) = delete;
+
+      bool done() const noexcept
+      {
+        return m_pending.load(std::memory_order_acquire) == 0;
+      }
+
+    private:
+      void set_error(std::exception_ptr e);
+      void finish();
+
+    private:
+      std::atomic<std::size_t> m_pending {0};
+      std::atomic<std::size_t> m_finishing {0};
+      std::mutex m_mutex;
+      std::condition_variable m_cv;
+      spinlock m_error_lock;
+      std::exception_ptr m_error {nullptr};
+  };
+
+  // Per-worker task queue. The owner pushes and pops at the back, thieves take from the front.
+  class alignas(64) work_queue
+  {
+    public:
+      work_queue();
+
+      void push(task&& t);
+      bool pop(task& t);
+      bool steal(task& t);
+
+      bool empty() const noexcept
+      {
+        return m_count.load(std::memory_order_relaxed) == 0;
+      }
+
+    private:
+      void grow();
+
+    private:
+      spinlock m_lock;
+      std::vector<task> m_buffer;
+      std::size_t m_head {0};
+      std::atomic<std::size_t> m_count {0};
+  };
+
   class ThreadPool
   {
-    using size_type = std::result_of<decltype (&std::thread::hardware_concurrency)()>::type;
+    using size_type = std::invoke_result_t<decltype(&std::thread::hardware_concurrency)>;
 
    public:
-    ThreadPool(size_type threads);
+    // Number of failed steal rounds before an idle worker parks.
+    static constexpr std::size_t default_spin = 2048;
+
+    ThreadPool(size_type threads, std::size_t spin = default_spin);
 
     ThreadPool() = delete;
     ThreadPool(const ThreadPool&) = delete;
@@ -26,6 +226,8 @@ namespace kmq {
 
     ~ThreadPool();
 
+    // Wait for all tasks, including the ones spawned by running tasks, and stop the workers.
+    // Rethrows the first exception thrown by a task outside of a group.
     void join_all();
 
     void join(int i);
@@ -34,25 +236,86 @@ namespace kmq {
     template <typename Callable>
     void add_task(Callable&& f)
     {
-      auto task = std::make_shared<std::packaged_task<void(int)>>(std::forward<Callable>(f));
+      push(task(std::forward<Callable>(f)));
+    }
+
+    template <typename Callable>
+    void add_task(task_group& group, Callable&& f)
+    {
+      group.m_pending.fetch_add(1, std::memory_order_relaxed);
+      push(task(std::forward<Callable>(f), &group));
+    }
+
+    // Wait for all tasks of a group. A worker calling wait() keeps executing tasks meanwhile,
+    // so groups can be nested. Rethrows the first exception thrown by a task of the group.
+    void wait(task_group& group);
+
+    // Call f(thread_id, i) for each i in [begin, end), by chunks of 'grain' indexes
+    // (0 = about four chunks per worker), and wait for completion.
+    template <typename Callable>
+    void parallel_for(std::size_t begin, std::size_t end, Callable&& f, std::size_t grain = 1)
+    {
+      if (begin >= end)
+        return;
+
+      std::size_t n = end - begin;
+
+      if (grain == 0)
+        grain = std::max<std::size_t>(1, n / (4 * static_cast<std::size_t>(m_n)));
+
+      task_group group;
+      for (std::size_t s = begin; s < end; s += grain)
       {
-        std::unique_lock<std::mutex> lock(_queue_mutex);
-        if (_stop) throw std::runtime_error("Push on stopped Pool.");
-        _queue.emplace([task](int thread_id) { (*task)(thread_id); });
+        std::size_t e = std::min(end, s + grain);
+        add_task(group, [s, e, &f](int thread_id) {
+          for (std::size_t i = s; i < e; ++i)
+            f(thread_id, i);
+        });
       }
-      _condition.notify_one();
+      wait(group);
+    }
+
+    size_type size() const noexcept
+    {
+      return m_n;
     }
 
+    void set_spin(std::size_t spin) noexcept
+    {
+      m_spin.store(spin, std::memory_order_relaxed);
+    }
+
+    std::size_t spin() const noexcept
+    {
+      return m_spin.load(std::memory_order_relaxed);
+    }
+
+    // Index of the calling worker in its pool, -1 if not called from a worker.
+    static int current_worker() noexcept;
+
    private:
+    void start();
+    void push(task&& t);
+    bool find_task(int i, task& t);
+    void execute(task& t, int i);
     void worker(int i);
 
    private:
-    size_type _n{std::thread::hardware_concurrency()};
-    std::vector<std::thread> _pool;
-    std::queue<std::function<void(int)>> _queue;
-    std::mutex _queue_mutex;
-    std::condition_variable _condition;
-    bool _stop{false};
+    size_type m_n {std::thread::hardware_concurrency()};
+    std::vector<std::thread> m_pool;
+    std::vector<std::unique_ptr<work_queue>> m_queues;
+
+    std::atomic<std::size_t> m_queued {0};
+    std::atomic<std::size_t> m_parked {0};
+    std::atomic<std::size_t> m_next {0};
+    std::atomic<std::size_t> m_spin {default_spin};
+
+    std::mutex m_park_mutex;
+    std::condition_variable m_condition;
+    std::atomic<bool> m_stop {false};
+
+    spinlock m_error_lock;
+    std::exception_ptr m_error {nullptr};
   };
 
 }
@@ -0,0 +1,229 @@
+#include <kmindex/fastx.hpp>
+#include <kmindex/exceptions.hpp>
+
+#include <cctype>
+#include <cstring>
+
+#include <fmt/format.h>
+
+namespace kmq {
+
+  namespace {
+
+    // End of the line starting at p, i.e. the position of '\n' or 'end'.
+    inline const char* eol(const char* p, const char* end)
+    {
+      const void* n = std::memchr(p, '\n', end - p);
+      return n ? static_cast<const char*>(n) : end;
+    }
+
+    inline char* eol(char* p, char* end)
+    {
+      void* n = std::memchr(p, '\n', end - p);
+      return n ? static_cast<char*>(n) : end;
+    }
+
+    inline char* next_line(char* e, char* end)
+    {
+      return e < end ? e + 1 : end;
+    }
+
+    inline char* strip_cr(char* b, char* e)
+    {
+      return (e > b && e[-1] == '\r') ? e - 1 : e;
+    }
+
+    inline std::size_t line_size(const char* b, const char* e)
+    {
+      return static_cast<std::size_t>(((e > b && e[-1] == '\r') ? e - 1 : e) - b);
+    }
+  }
+
+  fastx_type guess_fastx_type(const char* begin, const char* end)
+  {
+    for (const char* p = begin; p < end; ++p)
+    {
+      if (std::isspace(static_cast<unsigned char>(*p)))
+        continue;
+      if (*p == '>')
+        return fastx_type::fasta;
+      if (*p == '@')
+        return fastx_type::fastq;
+      break;
+    }
+    throw kmq_io_error("Input is neither a FASTA nor a FASTQ file.");
+  }
+
+  const char* next_fastx_record(const char* begin, const char* end, const char* from, fastx_type type)
+  {
+    const char* p = from;
+
+    if (p > begin && p[-1] != '\n')
+    {
+      p = eol(p, end);
+      p = p < end ? p + 1 : end;
+    }
+
+    const char marker = type == fastx_type::fasta ? '>' : '@';
+
+    while (p < end)
+    {
+      if (*p == marker)
+      {
+        if (type == fastx_type::fasta)
+          return p;
+
+        // A quality line may start with '@' too, but then the line after the next one is
+        // a sequence line, not a '+' separator.
+        const char* l1 = eol(p, end);
+        const char* l2 = l1 < end ? eol(l1 + 1, end) : end;
+        if (l2 < end - 1)
+        {
+          if (l2[1] == '+')
+            return p;
+        }
+        else
+        {
+          return end;
+        }
+      }
+      p = eol(p, end);
+      p = p < end ? p + 1 : end;
+    }
+    return end;
+  }
+
+  bool is_four_line_fastq(const char* begin, const char* end, std::size_t nb_records)
+  {
+    const char* p = begin;
+    for (std::size_t i = 0; i < nb_records && p < end; ++i)
+    {
+      while (p < end && (*p == '\n' || *p == '\r'))
+        ++p;
+      if (p >= end)
+        break;
+      if (*p != '@')
+        return false;
+
+      // A record cut by 'end' tells nothing more.
+      const char* h = eol(p, end);
+      if (h >= end)
+        break;
+      const char* s = h + 1;
+      const char* se = eol(s, end);
+      if (se + 1 >= end)
+        break;
+      if (se[1] != '+')
+        return false;
+      const char* q = eol(se + 1, end);
+      if (q >= end)
+        break;
+      const char* qe = eol(q + 1, end);
+      if (qe >= end)
+        break;
+      if (line_size(q + 1, qe) != line_size(s, se))
+        return false;
+      p = qe + 1;
+    }
+    return true;
+  }
+
+  bool parse_fastx(char* begin, char* end, fastx_type type, std::vector<fastx_record_view>& records,
+                   bool multiline)
+  {
+    const char header = type == fastx_type::fasta ? '>' : '@';
+    const char stop = type == fastx_type::fasta ? '>' : '+';
+    const bool strict = type == fastx_type::fastq && !multiline;
+
+    char* p = begin;
+    while (p < end)
+    {
+      if (*p == '\n' || *p == '\r')
+      {
+        ++p;
+        continue;
+      }
+
+      if (*p != header)
+      {
+        if (strict)
+          return false;
+        throw kmq_io_error(fmt::format("Malformed record, expected '{}' but got '{}'.", header, *p));
+      }
+
+      char* e = eol(p, end);
+      char* name = p + 1;
+      char* name_end = name;
+      char* line_end = strip_cr(name, e);
+      while (name_end < line_end && *name_end != ' ' && *name_end != '\t')
+        ++name_end;
+      p = next_line(e, end);
+
+      std::string_view record_name(name, name_end - name);
+      char* seq = p;
+      std::size_t seq_size = 0;
+
+      if (strict)
+      {
+        // Chunk boundaries are found with the four-line layout, other records are left to the
+        // caller (see the header).
+        if (p >= end)
+          return false;
+
+        e = eol(p, end);
+        seq_size = strip_cr(p, e) - p;
+        p = next_line(e, end);
+
+        if (p >= end || *p != stop)
+          return false;
+
+        p = next_line(eol(p, end), end);
+        e = eol(p, end);
+        std::size_t qual_size = strip_cr(p, e) - p;
+        p = next_line(e, end);
+
+        if (qual_size != seq_size)
+          return false;
+      }
+      else
+      {
+        // Sequence lines are moved backward so that the sequence is contiguous.
+        char* w = p;
+        while (p < end && *p != stop)
+        {
+          e = eol(p, end);
+          std::size_t n = strip_cr(p, e) - p;
+          if (w != p)
+            std::memmove(w, p, n);
+          w += n;
+          p = next_line(e, end);
+        }
+        seq_size = w - seq;
+
+        if (type == fastx_type::fastq)
+        {
+          if (p >= end)
+            throw kmq_io_error(fmt::format("Truncated FASTQ record '{}'.", record_name));
+
+          // Quality lines are read until they cover the sequence, they may start with '@'.
+          p = next_line(eol(p, end), end);
+          std::size_t qual_size = 0;
+          while (qual_size < seq_size && p < end)
+          {
+            e = eol(p, end);
+            qual_size += strip_cr(p, e) - p;
+            p = next_line(e, end);
+          }
+
+          if (qual_size != seq_size)
+            throw kmq_io_error(
+              fmt::format("Sequence and quality lengths differ for FASTQ record '{}'.", record_name));
+        }
+      }
+
+      records.push_back({record_name, std::string_view(seq, seq_size)});
+    }
+    return true;
+  }
+
+}
@@ -5,6 +5,7 @@
 #include <kmindex/query/query_results.hpp>
 #include <kmindex/index/kindex.hpp>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #ifdef KMINDEX_WITH_COMPRESSION
 #include <zstd/BlockDecompressorZSTD.h>
@@ -18,12 +19,14 @@ namespace kmq {
     m_fd = open(matrix_path.c_str(), O_RDONLY);
     m_mapped = mio::mmap_source(m_fd, 0, mio::map_entire_file);
     posix_madvise(&m_mapped[0], m_mapped.length(), POSIX_MADV_SEQUENTIAL);
+    // The mapping stays valid, long-lived partitions do not hold a descriptor.
+    close(m_fd);
+    m_fd = -1;
   }
 
   partition::~partition()
   {
     m_mapped.unmap();
-    close(m_fd);
   }
 
   void partition::query(std::uint64_t pos, std::uint8_t* dest)
@@ -31,11 +34,41 @@ namespace kmq {
     std::memcpy(dest, m_mapped.begin() + (m_bytes * pos) + 49, m_bytes);
   }
 
+  void partition::prefetch(std::uint64_t pos)
+  {
+    __builtin_prefetch(m_mapped.begin() + (m_bytes * pos) + 49);
+  }
+
+  void partition::prefault()
+  {
+    void* addr = const_cast<char*>(m_mapped.data());
+    posix_madvise(addr, m_mapped.length(), POSIX_MADV_WILLNEED);
+
+    std::size_t page = sysconf(_SC_PAGESIZE);
+    volatile char sink = 0;
+    for (std::size_t i = 0; i < m_mapped.length(); i += page)
+      sink = sink + m_mapped[i];
+
+    posix_madvise(addr, m_mapped.length(), POSIX_MADV_RANDOM);
+  }
+
+  void partition::release()
+  {
+    // posix_madvise(POSIX_MADV_DONTNEED) is a no-op on Linux.
+    madvise(const_cast<char*>(m_mapped.data()), m_mapped.length(), MADV_DONTNEED);
+  }
+
+  std::size_t partition::memory() const
+  {
+    return m_mapped.length();
+  }
+
 #ifdef KMINDEX_WITH_COMPRESSION
   compressed_partition::compressed_partition(const std::string& matrix_path, const std::string& config_path, std::size_t nb_samples, std::size_t width)
     : m_nb_samples(nb_samples), m_bytes(((nb_samples * width) + 7) / 8)
   {
     m_ptr_bd = std::make_unique<BlockDecompressorZSTD>(config_path, matrix_path, matrix_path + ".ef");
+    m_size = fs::file_size(matrix_path) + fs::file_size(matrix_path + ".ef");
   }
 
   compressed_partition::~compressed_partition()
@@ -46,8 +79,26 @@ namespace kmq {
   {
     std::memcpy(dest, m_ptr_bd->get_bit_vector_from_hash(pos), m_bytes);
   }
+
+  std::size_t compressed_partition::memory() const
+  {
+    return m_size;
+  }
 #endif
 
+  std::unique_ptr<partition_interface> make_partition(const index_infos& infos, std::size_t p)
+  {
+    if (infos.is_compressed_index())
+    {
+#ifdef KMINDEX_WITH_COMPRESSION
+      return std::make_unique<compressed_partition>(infos.get_partition(p), infos.get_compression_config(), infos.nb_samples(), infos.bw());
+#else
+      throw kmq_error("kmindex is not compiled with compression support");
+#endif
+    }
+    return std::make_unique<partition>(infos.get_partition(p), infos.nb_samples(), infos.bw());
+  }
+
   kindex::kindex() {}
 
   kindex::kindex(const index_infos& i, bool cache)
@@ -82,18 +133,7 @@ namespace kmq {
 
   void kindex::init(std::size_t p)
   {
-    if (m_infos.is_compressed_index())
-    {
-#ifdef KMINDEX_WITH_COMPRESSION
-      m_partitions[p] = std::make_unique<compressed_partition>(m_infos.get_partition(p), m_infos.get_compression_config(), m_infos.nb_samples(), m_infos.bw());
-#else
-      throw kmq_error("kmindex is not compiled with compression support");
-#endif
-    }
-    else
-    {
-      m_partitions[p] = std::make_unique<partition>(m_infos.get_partition(p), m_infos.nb_samples(), m_infos.bw());
-    }
+    m_partitions[p] = make_partition(m_infos, p);
   }
 
   void kindex::unmap(std::size_t p)
@@ -115,4 +155,17 @@ namespace kmq {
   {
     return m_infos;
   }
+
+  const index_infos& kindex::infos() const
+  {
+    return m_infos;
+  }
+
+  void kindex::prefault()
+  {
+    if (!m_cache)
+      return;
+    for (auto& p : m_partitions)
+      p->prefault();
+  }
 }
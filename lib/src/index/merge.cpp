@@ -1,9 +1,106 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <kmindex/index/merge.hpp>
-#include <bitpacker/bitpacker.hpp>
-#include <nonstd/span.hpp>
+#include <kmindex/index/bit_append.hpp>
+#include <kmindex/dispatch.hpp>
+#include <kmindex/exceptions.hpp>
+
+#ifdef KMINDEX_WITH_COMPRESSION
+  #include <bitmatrixshuffle.h>
+  #include <zstd/BlockCompressorZSTD.h>
+#endif
 
 namespace kmq {
 
+  namespace {
+
+    // Size of the kmtricks header of a partition, copied from the first sub-index.
+    constexpr std::size_t matrix_header = 49;
+
+    void write_at(int fd, const std::uint8_t* data, std::size_t n, std::size_t offset)
+    {
+      while (n > 0)
+      {
+        ssize_t w = ::pwrite(fd, data, n, offset);
+        if (w < 0 && errno == EINTR)
+          continue;
+        if (w < 0)
+          throw kmq_io_error(fmt::format("Unable to write merged partition ({})", std::strerror(errno)));
+        data += w;
+        n -= w;
+        offset += w;
+      }
+    }
+
+    // Readahead of [offset, offset + n) of a mapping, widened to pages.
+    void will_need(const mio::mmap_source& mapped, std::size_t offset, std::size_t n)
+    {
+      static const std::size_t page = sysconf(_SC_PAGESIZE);
+      std::size_t start = offset / page * page;
+      std::size_t end = std::min(offset + n, mapped.mapped_length());
+      if (start < end)
+        posix_madvise(const_cast<char*>(mapped.data()) + start, end - start, POSIX_MADV_WILLNEED);
+    }
+
+#ifdef KMINDEX_WITH_COMPRESSION
+    // Reorders the columns of the 'n' rows of 'rows' in place, as kmindex compress --reorder:
+    // the block is transposed, its rows are reordered and it is transposed back. 'rows' and
+    // 'transposed' hold n rounded up to a multiple of 8 rows.
+    void permute_columns(std::uint8_t* rows,
+                         std::uint8_t* transposed,
+                         std::size_t n,
+                         std::size_t bytes_per_row,
+                         const std::vector<std::uint64_t>& order)
+    {
+      std::size_t nb_rows = (n + 7) / 8 * 8;
+      std::size_t nb_cols = bytes_per_row * 8;
+      std::memset(rows + n * bytes_per_row, 0, (nb_rows - n) * bytes_per_row);
+
+      bms::__sse2_trans(rows, transposed, nb_rows, nb_cols);
+      bms::reorder_matrix_rows(reinterpret_cast<char*>(transposed), 0, nb_rows / 8, order);
+      bms::__sse2_trans(transposed, rows, nb_cols, nb_rows);
+    }
+#endif
+
+    using aligned_buffer = std::unique_ptr<std::uint8_t, decltype(&std::free)>;
+
+    aligned_buffer make_aligned_buffer(std::size_t size)
+    {
+      static const std::size_t page = sysconf(_SC_PAGESIZE);
+      void* ptr = std::aligned_alloc(page, std::max<std::size_t>(page, (size + page - 1) / page * page));
+      if (!ptr)
+        throw std::bad_alloc();
+      return aligned_buffer(static_cast<std::uint8_t*>(ptr), &std::free);
+    }
+  }
+
+  // Appends 'n' rows of 'nb_samples' counts of BW bits from 'src' to the rows of 'dst', from
+  // bit 'offset'. With BW fixed the row sizes are known up to the number of samples, and the
+  // rows of 8-bit counts are plain copies.
+  template<std::size_t BW>
+  struct abs_rows_appender
+  {
+    void operator()(std::uint8_t* dst,
+                    std::size_t bytes_per_row,
+                    std::size_t offset,
+                    const std::uint8_t* src,
+                    std::size_t nb_samples,
+                    std::size_t n) const noexcept
+    {
+      const std::size_t nbits = nb_samples * BW;
+      const std::size_t bytes_per_line = (nbits + 7) / 8;
+
+      for (std::size_t i = 0; i < n; ++i)
+        append_bits_msb(dst + i * bytes_per_row, offset, src + i * bytes_per_line, nbits);
+    }
+  };
 
   index_merger::index_merger(index* gindex,
                             const std::vector<std::string>& to_merge,
@@ -28,7 +125,6 @@ namespace kmq {
     auto& ii = m_index->get(m_to_merge[0]);
     m_psize = ii.bloom_size() / ii.nb_partitions();
     m_nb_parts = ii.nb_partitions();
-    m_buffer.resize(m_nb_parts);
   }
 
   void index_merger::remove_old() const
@@ -123,261 +219,243 @@ namespace kmq {
     remove_old();
   }
 
-  void index_merger::zero(std::size_t p) const
-  {
-    std::fill(m_buffer[p].begin(), m_buffer[p].end(), 0);
-  }
-  
-  index_merger_pa::index_merger_pa(index* gindex,
-                                   const std::vector<std::string>& to_merge,
-                                   const std::string& new_path,
-                                   const std::string& new_name,
-                                   rename_mode mode,
-                                   bool rm)
-    : index_merger(gindex, to_merge, new_path, new_name, mode, 1, rm)
-  {
-
-  }
-
-
-  void index_merger_pa::merge_one(std::size_t p) const
+  void index_merger::open_sources(std::size_t p, partition_io& io) const
   {
-    std::vector<std::pair<mio::mmap_source, std::size_t>> partitions;
-    partitions.reserve(m_to_merge.size());
+    io.sources.reserve(m_to_merge.size());
 
     for (auto& sub_name : m_to_merge)
     {
       auto& sub_index = m_index->get(sub_name);
 
       std::string index_path = fmt::format("{}/{}", m_index->path(), sub_name);
-      partitions.push_back(
+      io.sources.push_back(
         std::make_pair(
-          mio::mmap_source(fmt::format("{}/matrices/matrix_{}.cmbf", index_path, p), 49),
+          mio::mmap_source(fmt::format("{}/matrices/matrix_{}.cmbf", index_path, p)),
           sub_index.nb_samples()
         )
       );
-    }
 
-    std::ofstream out(fmt::format("{}/matrices/matrix_{}.cmbf", m_new_path, p));
-
-    { 
-      std::uint64_t km_magic;
-      std::uint32_t km_version;
-      bool km_compress;
-
-      std::uint64_t km_matrix_magic;
-      std::uint32_t km_bits;
-      std::uint32_t km_id;
-      std::uint32_t km_part;
-      std::uint64_t km_first;
-      std::uint64_t km_window;
-
-      std::string index_path = fmt::format("{}/{}", m_index->path(), m_to_merge[0]);
-      std::ifstream inf(fmt::format("{}/matrices/matrix_{}.cmbf", index_path, p), std::ios::binary);
-
-      inf.read(reinterpret_cast<char*>(&km_magic), sizeof(km_magic));
-      inf.read(reinterpret_cast<char*>(&km_version), sizeof(km_version));
-      inf.read(reinterpret_cast<char*>(&km_compress), sizeof(km_compress));
-      inf.read(reinterpret_cast<char*>(&km_matrix_magic), sizeof(km_matrix_magic));
-      inf.read(reinterpret_cast<char*>(&km_bits), sizeof(km_bits));
-      inf.read(reinterpret_cast<char*>(&km_id), sizeof(km_id));
-      inf.read(reinterpret_cast<char*>(&km_part), sizeof(km_part));
-      inf.read(reinterpret_cast<char*>(&km_first), sizeof(km_first));
-      inf.read(reinterpret_cast<char*>(&km_window), sizeof(km_window));
-
-      out.write(reinterpret_cast<char*>(&km_magic), sizeof(km_magic));
-      out.write(reinterpret_cast<char*>(&km_version), sizeof(km_version));
-      out.write(reinterpret_cast<char*>(&km_compress), sizeof(km_compress));
-      out.write(reinterpret_cast<char*>(&km_matrix_magic), sizeof(km_matrix_magic));
-      out.write(reinterpret_cast<char*>(&km_bits), sizeof(km_bits));
-      out.write(reinterpret_cast<char*>(&km_id), sizeof(km_id));
-      out.write(reinterpret_cast<char*>(&km_part), sizeof(km_part));
-      out.write(reinterpret_cast<char*>(&km_first), sizeof(km_first));
-      out.write(reinterpret_cast<char*>(&km_window), sizeof(km_window));
+      // Ranges are read front to back, the kernel can read ahead and drop pages behind.
+      auto& mapped = io.sources.back().first;
+      posix_madvise(const_cast<char*>(mapped.data()), mapped.mapped_length(), POSIX_MADV_SEQUENTIAL);
     }
+  }
+
+  void index_merger::create_output(std::size_t p, partition_io& io) const
+  {
+    std::string path = fmt::format("{}/matrices/matrix_{}.cmbf", m_new_path, p);
+    io.fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (io.fd < 0)
+      throw kmq_io_error(fmt::format("Unable to create {} ({})", path, std::strerror(errno)));
+
+    std::size_t bytes_per_row = ((m_nb_samples * m_bw) + 7) / 8;
+    std::size_t size = matrix_header + bytes_per_row * m_psize;
+
+    // The header is the one of the first sub-index, the rows are written at their offsets.
+    write_at(io.fd, reinterpret_cast<const std::uint8_t*>(io.sources[0].first.data()), matrix_header, 0);
+    if (posix_fallocate(io.fd, 0, size) != 0 && ::ftruncate(io.fd, size) != 0)
+      throw kmq_io_error(fmt::format("Unable to allocate {} ({})", path, std::strerror(errno)));
+  }
+
+  void index_merger::merge_range(const partition_io& io,
+                                 std::size_t first,
+                                 std::size_t n,
+                                 std::uint8_t* buffer) const
+  {
+    std::size_t bytes_per_row = ((m_nb_samples * m_bw) + 7) / 8;
+    std::size_t tile = std::max<std::size_t>(1, tile_bytes / bytes_per_row);
 
-    m_buffer[p].resize((m_nb_samples + 7) / 8, 0);
+    std::memset(buffer, 0, n * bytes_per_row);
 
-    auto& buf = m_buffer[p];
-   
-    for (std::size_t i = 0; i < m_psize; ++i)
+    for (auto& [mapped, nb_samples] : io.sources)
     {
-      std::size_t bytes_per_line = (partitions[0].second + 7) / 8;
-      std::size_t bits_per_line = bytes_per_line * 8;
-      
-      std::memcpy(
-        &buf[0],
-        partitions[0].first.begin() + (bytes_per_line * i),
-        bytes_per_line
-      );
-      
-      std::size_t current = partitions[0].second;
+      std::size_t bytes_per_line = ((nb_samples * m_bw) + 7) / 8;
+      will_need(mapped, matrix_header + bytes_per_line * first, bytes_per_line * n);
+    }
+
+    // The rows of a tile are appended source by source, each source is read sequentially.
+    for (std::size_t t = 0; t < n; t += tile)
+    {
+      std::size_t k = std::min(tile, n - t);
+      std::size_t offset = 0;
 
-      for (std::size_t j = 1; j < partitions.size(); ++j)
+      for (auto& [mapped, nb_samples] : io.sources)
       {
-        auto& p_ = partitions[j];
-
-        bytes_per_line = (p_.second + 7) / 8;
-        bits_per_line = bytes_per_line * 8;
-        
-        for (std::size_t k = 0; k < p_.second; ++k)
-        {
-          if (BITCHECK(p_.first, k + bits_per_line * i))
-          {
-            BITSET(buf, current);
-          }
-          ++current;
-        }
+        std::size_t bytes_per_line = ((nb_samples * m_bw) + 7) / 8;
+        auto src = reinterpret_cast<const std::uint8_t*>(mapped.data())
+                   + matrix_header + bytes_per_line * (first + t);
+
+        append_rows(buffer + t * bytes_per_row, bytes_per_row, offset, src, nb_samples, k);
+
+        offset += nb_samples * m_bw;
       }
-      out.write(reinterpret_cast<char*>(buf.data()), buf.size());
-      zero(p);
     }
-
-    remove_old(p);
   }
 
-  void index_merger_pa::merge(ThreadPool& pool) const
+  void index_merger::merge(ThreadPool& pool) const
   {
     copy_trees();
 
-    for (std::size_t p = 0; p < m_nb_parts; ++p)
+    std::size_t nb_workers = pool.size();
+    std::size_t bytes_per_row = ((m_nb_samples * m_bw) + 7) / 8;
+
+    // Ranges fill a worker buffer, and are smaller when there are not enough of them to keep
+    // all the workers busy (few or small partitions).
+    std::size_t range = std::max<std::size_t>(1, range_bytes / bytes_per_row);
+    std::size_t batch_size = std::min(nb_workers, m_nb_parts);
+    range = std::min(range, std::max<std::size_t>(1, (m_psize * batch_size) / (4 * nb_workers)));
+
+    std::vector<aligned_buffer> buffers;
+    buffers.reserve(nb_workers);
+    for (std::size_t i = 0; i < nb_workers; ++i)
+      buffers.push_back(make_aligned_buffer(range * bytes_per_row));
+
+    // Partitions are merged by batches of one partition per worker, which bounds the number of
+    // files open at once.
+    for (std::size_t b = 0; b < m_nb_parts; b += batch_size)
     {
-      pool.add_task([this, p](int i){
-        unused(i);
-        this->merge_one(p);
+      std::size_t nb = std::min(batch_size, m_nb_parts - b);
+      std::vector<partition_io> ios(nb);
+
+      pool.parallel_for(0, nb, [this, &ios, b](int, std::size_t i){
+        this->open_sources(b + i, ios[i]);
+        this->create_output(b + i, ios[i]);
+      });
+
+      std::vector<std::pair<std::size_t, std::size_t>> ranges;
+      for (std::size_t i = 0; i < nb; ++i)
+        for (std::size_t first = 0; first < m_psize; first += range)
+          ranges.emplace_back(i, first);
+
+      pool.parallel_for(0, ranges.size(), [this, &ios, &ranges, &buffers, range, bytes_per_row](int t, std::size_t r){
+        auto [i, first] = ranges[r];
+        std::size_t n = std::min(range, m_psize - first);
+        this->merge_range(ios[i], first, n, buffers[t].get());
+        write_at(ios[i].fd, buffers[t].get(), n * bytes_per_row, matrix_header + bytes_per_row * first);
       });
-    }
 
-    pool.join_all();
+      for (std::size_t i = 0; i < nb; ++i)
+      {
+        ios[i].sources.clear();
+        if (::close(ios[i].fd) != 0)
+          throw kmq_io_error(fmt::format("Unable to write merged partition {} ({})", b + i, std::strerror(errno)));
+        remove_old(b + i);
+      }
+    }
   }
 
-  index_merger_abs::index_merger_abs(index* gindex,
-                                   const std::vector<std::string>& to_merge,
-                                   const std::string& new_path,
-                                   const std::string& new_name,
-                                   rename_mode mode,
-                                   bool rm,
-                                   std::size_t bw)
-    : index_merger(gindex, to_merge, new_path, new_name, mode, bw, rm)
+
+  void index_merger::write_rows(std::size_t p, std::size_t nb_rows, const std::string& path) const
   {
+    partition_io io;
+    open_sources(p, io);
 
-  }
+    nb_rows = std::min(nb_rows, m_psize);
+    std::size_t bytes_per_row = ((m_nb_samples * m_bw) + 7) / 8;
+    std::vector<std::uint8_t> buffer(nb_rows * bytes_per_row);
+    merge_range(io, 0, nb_rows, buffer.data());
+
+    std::ofstream out(path, std::ios::binary);
+    out.write(io.sources[0].first.data(), matrix_header);
+    out.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
 
+    if (!out)
+      throw kmq_io_error(fmt::format("Unable to write {}", path));
+  }
 
-  void index_merger_abs::merge_one(std::size_t p) const
+#ifdef KMINDEX_WITH_COMPRESSION
+  void index_merger::merge_compressed(ThreadPool& pool,
+                                      const std::string& config_path,
+                                      const std::vector<std::uint64_t>& order) const
   {
-    std::vector<std::pair<mio::mmap_source, std::size_t>> partitions;
-    partitions.reserve(m_to_merge.size());
+    if (m_bw != 1)
+      throw kmq_error("Only presence/absence sub-indexes can be merged into compressed blocks.");
 
-    for (auto& sub_name : m_to_merge)
-    {
-      auto& sub_index = m_index->get(sub_name);
+    copy_trees();
 
-      std::string index_path = fmt::format("{}/{}", m_index->path(), sub_name);
-      partitions.push_back(
-        std::make_pair(
-          mio::mmap_source(fmt::format("{}/matrices/matrix_{}.cmbf", index_path, p), 49),
-          sub_index.nb_samples()
-        )
-      );
-    }
+    std::size_t bytes_per_row = (m_nb_samples + 7) / 8;
 
-    std::ofstream out(fmt::format("{}/matrices/matrix_{}.cmbf", m_new_path, p));
-
-    { 
-      std::uint64_t km_magic;
-      std::uint32_t km_version;
-      bool km_compress;
-
-      std::uint64_t km_matrix_magic;
-      std::uint32_t km_bits;
-      std::uint32_t km_id;
-      std::uint32_t km_part;
-      std::uint64_t km_first;
-      std::uint64_t km_window;
-
-      std::string index_path = fmt::format("{}/{}", m_index->path(), m_to_merge[0]);
-      std::ifstream inf(fmt::format("{}/matrices/matrix_{}.cmbf", index_path, p), std::ios::binary);
-
-      inf.read(reinterpret_cast<char*>(&km_magic), sizeof(km_magic));
-      inf.read(reinterpret_cast<char*>(&km_version), sizeof(km_version));
-      inf.read(reinterpret_cast<char*>(&km_compress), sizeof(km_compress));
-      inf.read(reinterpret_cast<char*>(&km_matrix_magic), sizeof(km_matrix_magic));
-      inf.read(reinterpret_cast<char*>(&km_bits), sizeof(km_bits));
-      inf.read(reinterpret_cast<char*>(&km_id), sizeof(km_id));
-      inf.read(reinterpret_cast<char*>(&km_part), sizeof(km_part));
-      inf.read(reinterpret_cast<char*>(&km_first), sizeof(km_first));
-      inf.read(reinterpret_cast<char*>(&km_window), sizeof(km_window));
-
-      out.write(reinterpret_cast<char*>(&km_magic), sizeof(km_magic));
-      out.write(reinterpret_cast<char*>(&km_version), sizeof(km_version));
-      out.write(reinterpret_cast<char*>(&km_compress), sizeof(km_compress));
-      out.write(reinterpret_cast<char*>(&km_matrix_magic), sizeof(km_matrix_magic));
-      out.write(reinterpret_cast<char*>(&km_bits), sizeof(km_bits));
-      out.write(reinterpret_cast<char*>(&km_id), sizeof(km_id));
-      out.write(reinterpret_cast<char*>(&km_part), sizeof(km_part));
-      out.write(reinterpret_cast<char*>(&km_first), sizeof(km_first));
-      out.write(reinterpret_cast<char*>(&km_window), sizeof(km_window));
-    }
+    if (!order.empty() && order.size() != bytes_per_row * 8)
+      throw kmq_error(fmt::format("Column order of size {}, expected {}.", order.size(), bytes_per_row * 8));
 
-    m_buffer[p].resize(((m_nb_samples * m_bw) + 7) / 8, 0);
+    // A compressor takes the rows of a partition in order: partitions are merged in parallel,
+    // each one by ranges of one block.
+    pool.parallel_for(0, m_nb_parts, [this, &config_path, &order, bytes_per_row](int, std::size_t p){
+      partition_io io;
+      open_sources(p, io);
 
-    auto& buf = m_buffer[p];
-   
-    for (std::size_t i = 0; i < m_psize; ++i)
-    {
-      std::size_t bytes_per_line = ((partitions[0].second * m_bw) + 7) / 8;
-      std::size_t bits_per_line = bytes_per_line * 8;
-      
-      std::memcpy(
-        &buf[0],
-        partitions[0].first.begin() + (bytes_per_line * i),
-        bytes_per_line
-      );
-      
-      std::size_t current = partitions[0].second * m_bw;
+      std::string path = fmt::format("{}/matrices/blocks{}", m_new_path, p);
+      BlockCompressorZSTD bc(path, path + ".ef", config_path);
+      bc.write_header(io.sources[0].first.data(), matrix_header);
 
-      for (std::size_t j = 1; j < partitions.size(); ++j)
+      std::size_t block = bc.get_block_size() / bytes_per_row;
+      std::vector<std::uint8_t> rows((block + 7) / 8 * 8 * bytes_per_row);
+      std::vector<std::uint8_t> transposed(order.empty() ? 0 : rows.size());
+
+      for (std::size_t first = 0; first < m_psize; first += block)
       {
-        auto& p_ = partitions[j];
-
-        bytes_per_line = ((p_.second * m_bw) + 7) / 8;
-        bits_per_line = bytes_per_line * 8;
-
-        auto s = nonstd::span<const std::uint8_t>(
-            reinterpret_cast<std::uint8_t*>(&p_.first[0]), bytes_per_line * m_psize);
-        for (std::size_t k = 0; k < p_.second; ++k)
-        {
-          bitpacker::insert(
-            buf,
-            current,
-            m_bw,
-            bitpacker::extract<std::uint8_t>(s, (k * m_bw) + bits_per_line * i, m_bw)
-          );
-
-          current += m_bw;
-        }
+        std::size_t n = std::min(block, m_psize - first);
+        merge_range(io, first, n, rows.data());
+
+        if (!order.empty())
+          permute_columns(rows.data(), transposed.data(), n, bytes_per_row, order);
+        bc.append_block(rows.data(), n * bytes_per_row);
       }
-      out.write(reinterpret_cast<char*>(buf.data()), buf.size());
-      zero(p);
-    }
+      bc.close();
 
-    remove_old(p);
+      io.sources.clear();
+      remove_old(p);
+    });
   }
+#endif
 
-  void index_merger_abs::merge(ThreadPool& pool) const
+  index_merger_pa::index_merger_pa(index* gindex,
+                                   const std::vector<std::string>& to_merge,
+                                   const std::string& new_path,
+                                   const std::string& new_name,
+                                   rename_mode mode,
+                                   bool rm)
+    : index_merger(gindex, to_merge, new_path, new_name, mode, 1, rm)
   {
-    copy_trees();
 
-    for (std::size_t p = 0; p < m_nb_parts; ++p)
-    {
-      pool.add_task([this, p](int i){
-        unused(i);
-        this->merge_one(p);
-      });
-    }
+  }
 
-    pool.join_all();
+
+  void index_merger_pa::append_rows(std::uint8_t* dst,
+                                    std::size_t bytes_per_row,
+                                    std::size_t offset,
+                                    const std::uint8_t* src,
+                                    std::size_t nb_samples,
+                                    std::size_t n) const
+  {
+    std::size_t bytes_per_line = (nb_samples + 7) / 8;
+
+    for (std::size_t i = 0; i < n; ++i)
+      append_bits(dst + i * bytes_per_row, offset, src + i * bytes_per_line, nb_samples);
+  }
+
+  index_merger_abs::index_merger_abs(index* gindex,
+                                   const std::vector<std::string>& to_merge,
+                                   const std::string& new_path,
+                                   const std::string& new_name,
+                                   rename_mode mode,
+                                   bool rm,
+                                   std::size_t bw)
+    : index_merger(gindex, to_merge, new_path, new_name, mode, bw, rm)
+  {
+
+  }
+
+
+  void index_merger_abs::append_rows(std::uint8_t* dst,
+                                     std::size_t bytes_per_row,
+                                     std::size_t offset,
+                                     const std::uint8_t* src,
+                                     std::size_t nb_samples,
+                                     std::size_t n) const
+  {
+    runtime_dispatch<32, 1, 1, std::equal_to<std::size_t>>::execute<abs_rows_appender>(
+      m_bw, dst, bytes_per_row, offset, src, nb_samples, n);
   }
 
 
@@ -0,0 +1,191 @@
+#include <kmindex/index/partition_cache.hpp>
+#include <kmindex/exceptions.hpp>
+
+#include <fmt/format.h>
+
+namespace kmq {
+
+  cache_policy str_to_cache_policy(const std::string& s)
+  {
+    if (s == "lru")
+      return cache_policy::lru;
+    else if (s == "lfu")
+      return cache_policy::lfu;
+    throw kmq_error(fmt::format("Unknown cache policy '{}'.", s));
+  }
+
+  partition_cache::partition_cache(std::size_t capacity, cache_policy policy)
+    : m_capacity(capacity), m_policy(policy)
+  {
+  }
+
+  void partition_cache::solve(const index_infos& infos, batch_query& bq, std::size_t p)
+  {
+    auto& smers = bq.partition(p);
+    auto& responses = bq.response();
+
+    entry_t e = get(infos, p);
+
+    std::unique_lock<std::mutex> lock(e->lock, std::defer_lock);
+    if (e->exclusive)
+      lock.lock();
+
+    for (auto& [mer, qid] : smers)
+      e->part->query(mer.h, responses[qid]->get(mer.i));
+  }
+
+  partition_cache::entry_t partition_cache::get(const index_infos& infos, std::size_t p)
+  {
+    std::string key = infos.get_partition(p);
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      auto it = m_entries.find(key);
+      if (it != m_entries.end())
+      {
+        entry_t e = it->second;
+        touch(key, *e);
+        m_hits++;
+        return e;
+      }
+    }
+
+    // Opened without the lock, a concurrent miss on the same partition keeps the first one.
+    auto e = std::make_shared<entry>();
+    e->part = make_partition(infos, p);
+    e->bytes = e->part->memory();
+    e->exclusive = infos.is_compressed_index();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto [it, inserted] = m_entries.emplace(key, e);
+    if (!inserted)
+    {
+      touch(key, *it->second);
+      m_hits++;
+      return it->second;
+    }
+
+    m_misses++;
+    m_order.push_front(key);
+    e->pos = m_order.begin();
+    e->uses = 1;
+    if (m_policy == cache_policy::lfu)
+    {
+      auto& bucket = m_buckets[e->uses];
+      bucket.push_front(key);
+      e->bucket_pos = bucket.begin();
+    }
+    m_bytes += e->bytes;
+    evict();
+    return e;
+  }
+
+  void partition_cache::touch(const std::string& key, entry& e)
+  {
+    m_order.splice(m_order.begin(), m_order, e.pos);
+
+    if (m_policy == cache_policy::lfu)
+    {
+      auto from = m_buckets.find(e.uses);
+      auto& to = m_buckets[e.uses + 1];
+      to.splice(to.begin(), from->second, e.bucket_pos);
+      if (from->second.empty())
+        m_buckets.erase(from);
+    }
+    e.uses++;
+  }
+
+  void partition_cache::unlink(entry& e)
+  {
+    m_order.erase(e.pos);
+
+    if (m_policy == cache_policy::lfu)
+    {
+      auto bucket = m_buckets.find(e.uses);
+      bucket->second.erase(e.bucket_pos);
+      if (bucket->second.empty())
+        m_buckets.erase(bucket);
+    }
+  }
+
+  void partition_cache::halve_uses()
+  {
+    // Rebuilt from the recency order, so that ties are still broken by recency.
+    m_buckets.clear();
+    for (auto it = m_order.rbegin(); it != m_order.rend(); ++it)
+    {
+      entry& e = *m_entries[*it];
+      e.uses /= 2;
+      auto& bucket = m_buckets[e.uses];
+      bucket.push_front(*it);
+      e.bucket_pos = bucket.begin();
+    }
+  }
+
+  void partition_cache::evict()
+  {
+    // The most recent entry is kept, even if larger than the budget.
+    while (m_bytes > m_capacity && m_entries.size() > 1)
+    {
+      auto victim = std::prev(m_order.end());
+
+      if (m_policy == cache_policy::lfu)
+      {
+        auto bucket = m_buckets.begin();
+        auto last = std::prev(bucket->second.end());
+        // Alone in the least used bucket, the most recent entry is skipped.
+        if (*last == m_order.front())
+          last = std::prev(std::next(bucket)->second.end());
+        victim = m_entries[*last]->pos;
+      }
+
+      auto it = m_entries.find(*victim);
+      entry_t e = it->second;
+      unlink(*e);
+      m_entries.erase(it);
+      m_bytes -= e->bytes;
+
+      // Current users keep the partition open until they are done.
+      if (e.use_count() == 1)
+        e->part->release();
+
+      // Halve counts so that partitions hot in the past do not stay forever.
+      if (++m_evictions % 1024 == 0 && m_policy == cache_policy::lfu)
+        halve_uses();
+    }
+  }
+
+  void partition_cache::drop(const index_infos& infos)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (std::size_t p = 0; p < infos.nb_partitions(); ++p)
+    {
+      auto it = m_entries.find(infos.get_partition(p));
+      if (it == m_entries.end())
+        continue;
+
+      entry_t e = it->second;
+      unlink(*e);
+      m_entries.erase(it);
+      m_bytes -= e->bytes;
+
+      if (e.use_count() == 1)
+        e->part->release();
+    }
+  }
+
+  partition_cache_stats partition_cache::stats() const
+  {
+    partition_cache_stats s;
+    s.hits = m_hits.load();
+    s.misses = m_misses.load();
+    s.evictions = m_evictions.load();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    s.bytes = m_bytes;
+    s.capacity = m_capacity;
+    s.entries = m_entries.size();
+    return s;
+  }
+
+}
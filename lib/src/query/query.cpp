@@ -32,6 +32,24 @@ namespace kmq {
   void query_response::free()
   {
     free_container(m_responses);
+    free_container(m_unresolved);
+  }
+
+  void query_response::unresolve(std::size_t mer_pos)
+  {
+    if (m_unresolved.empty())
+      m_unresolved.resize(nbk(), false);
+    m_unresolved[mer_pos] = true;
+  }
+
+  bool query_response::resolved(std::size_t mer_pos) const
+  {
+    return m_unresolved.empty() || !m_unresolved[mer_pos];
+  }
+
+  bool query_response::complete() const
+  {
+    return m_unresolved.empty();
   }
 
 }
@@ -10,8 +10,10 @@
 namespace kmq {
 
   query_result::query_result(query_response_t&& qr, std::size_t z, const index_infos& infos, bool pos)
-    : m_qr(std::move(qr)), m_z(z), m_infos(infos), m_nbk(m_qr->nbk() - z)
+    : m_qr(std::move(qr)), m_z(z), m_infos(infos), m_nbk(m_qr->nbk() - z), m_nbk_resolved(m_nbk)
   {
+    count_resolved();
+
     m_ratios.resize(m_infos.nb_samples(), 0);
     m_counts.resize(m_infos.nb_samples(), 0);
 
@@ -34,6 +36,31 @@ namespace kmq {
     }
   }
 
+  // Unresolved s-mers have no bit set, they only change the number of k-mers to divide by.
+  void query_result::count_resolved()
+  {
+    if (m_qr->complete())
+      return;
+
+    // Unresolved s-mers in the window of the current k-mer.
+    std::size_t unresolved = 0;
+    for (std::size_t i = 0; i < m_z; ++i)
+      unresolved += !m_qr->resolved(i);
+
+    m_nbk_resolved = 0;
+    for (std::size_t i = 0; i < m_nbk; ++i)
+    {
+      unresolved += !m_qr->resolved(i + m_z);
+      m_nbk_resolved += unresolved == 0;
+      unresolved -= !m_qr->resolved(i);
+    }
+  }
+
+  double query_result::ratio(double count) const
+  {
+    return m_nbk_resolved ? count / static_cast<double>(m_nbk_resolved) : 0.0;
+  }
+
   void query_result::compute_ratios()
   {
     const uint8_t* data = m_qr->get(0);
@@ -64,7 +91,7 @@ namespace kmq {
 
     for (std::size_t i = 0; i < m_ratios.size(); ++i)
     {
-      m_ratios[i] = m_counts[i] / static_cast<double>(m_nbk);
+      m_ratios[i] = ratio(m_counts[i]);
     }
 
     m_qr->free();
@@ -105,7 +132,7 @@ namespace kmq {
 
     for (std::size_t i = 0; i < m_ratios.size(); ++i)
     {
-      m_ratios[i] = m_counts[i] / static_cast<double>(m_nbk);
+      m_ratios[i] = ratio(m_counts[i]);
     }
 
     m_qr->free();
@@ -150,8 +177,8 @@ namespace kmq {
 
     for (std::size_t i = 0; i < m_ratios.size(); ++i)
     {
-      m_counts[i] = m_counts[i] / m_nbk;
-      m_ratios[i] = m_ratios[i] / static_cast<double>(m_nbk);
+      m_counts[i] = m_nbk_resolved ? m_counts[i] / m_nbk_resolved : 0;
+      m_ratios[i] = ratio(m_ratios[i]);
     }
 
   }
@@ -191,16 +218,26 @@ namespace kmq {
 
     for (std::size_t i = 0; i < m_ratios.size(); ++i)
     {
-      m_counts[i] = m_counts[i] / m_nbk;
-      m_ratios[i] = m_ratios[i] / static_cast<double>(m_nbk);
+      m_counts[i] = m_nbk_resolved ? m_counts[i] / m_nbk_resolved : 0;
+      m_ratios[i] = ratio(m_ratios[i]);
     }
   }
 
   std::size_t query_result::nbk() const
+  {
+    return m_nbk_resolved;
+  }
+
+  std::size_t query_result::nbk_total() const
   {
     return m_nbk;
   }
 
+  double query_result::coverage() const
+  {
+    return m_nbk ? m_nbk_resolved / static_cast<double>(m_nbk) : 0.0;
+  }
+
   const std::vector<std::uint32_t>& query_result::counts() const
   {
     return m_counts;
@@ -258,6 +295,15 @@ namespace kmq {
     std::ofstream out(
       fmt::format("{}/{}.{}", output_dir, infos.name(), format_to_fext(f)));
 
+    output(infos, out, f, qname, threshold);
+  }
+
+  void query_result_agg::output(const index_infos& infos,
+                                std::ostream& out,
+                                enum format f,
+                                const std::string& qname,
+                                double threshold)
+  {
     auto formatter = make_formatter(f, threshold, infos.bw());
 
     if (qname.size() > 0)
@@ -2,67 +2,311 @@
 
 namespace kmq {
 
-  ThreadPool::ThreadPool(size_type threads)
+  namespace {
+    thread_local ThreadPool* tl_pool {nullptr};
+    thread_local int tl_worker {-1};
+  }
+
+  void task_group::set_error(std::exception_ptr e)
+  {
+    std::unique_lock<spinlock> lock(m_error_lock);
+    if (!m_error)
+      m_error = e;
+  }
+
+  void task_group::finish()
   {
-    if (threads < _n) _n = threads;
-    for (size_t i = 0; i < _n; i++)
+    // m_finishing keeps waiters from returning, and possibly destroying the group,
+    // while the last task is still notifying.
+    m_finishing.fetch_add(1, std::memory_order_acq_rel);
+    if (m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
     {
-      _pool.push_back(std::thread(&ThreadPool::worker, this, i));
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.notify_all();
     }
+    m_finishing.fetch_sub(1, std::memory_order_acq_rel);
+  }
+
+  work_queue::work_queue()
+  {
+    m_buffer.resize(256);
+  }
+
+  void work_queue::grow()
+  {
+    std::vector<task> buffer(m_buffer.size() * 2);
+    std::size_t n = m_count.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < n; ++i)
+      buffer[i] = std::move(m_buffer[(m_head + i) & (m_buffer.size() - 1)]);
+    m_buffer.swap(buffer);
+    m_head = 0;
+  }
+
+  void work_queue::push(task&& t)
+  {
+    std::unique_lock<spinlock> lock(m_lock);
+    std::size_t n = m_count.load(std::memory_order_relaxed);
+    if (n == m_buffer.size())
+      grow();
+    m_buffer[(m_head + n) & (m_buffer.size() - 1)] = std::move(t);
+    m_count.store(n + 1, std::memory_order_relaxed);
+  }
+
+  bool work_queue::pop(task& t)
+  {
+    if (empty())
+      return false;
+
+    std::unique_lock<spinlock> lock(m_lock);
+    std::size_t n = m_count.load(std::memory_order_relaxed);
+    if (n == 0)
+      return false;
+    t = std::move(m_buffer[(m_head + n - 1) & (m_buffer.size() - 1)]);
+    m_count.store(n - 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool work_queue::steal(task& t)
+  {
+    if (empty())
+      return false;
+
+    std::unique_lock<spinlock> lock(m_lock, std::try_to_lock);
+    if (!lock.owns_lock())
+      return false;
+    std::size_t n = m_count.load(std::memory_order_relaxed);
+    if (n == 0)
+      return false;
+    t = std::move(m_buffer[m_head]);
+    m_head = (m_head + 1) & (m_buffer.size() - 1);
+    m_count.store(n - 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  ThreadPool::ThreadPool(size_type threads, std::size_t spin)
+    : m_spin(spin)
+  {
+    if (threads < m_n) m_n = threads;
+    if (m_n == 0) m_n = 1;
+    start();
+  }
+
+  void ThreadPool::start()
+  {
+    m_queues.clear();
+    for (std::size_t i = 0; i < m_n; i++)
+      m_queues.push_back(std::make_unique<work_queue>());
+
+    m_pool.clear();
+    for (std::size_t i = 0; i < m_n; i++)
+      m_pool.push_back(std::thread(&ThreadPool::worker, this, i));
   }
 
   void ThreadPool::restart(size_type threads)
   {
-    _n = threads ? threads : _n;
-    _stop = false;
-    _pool.clear();
-    for (size_t i = 0; i < _n; i++)
-    {
-      _pool.push_back(std::thread(&ThreadPool::worker, this, i));
-    }
+    m_n = threads ? threads : m_n;
+    m_stop = false;
+    m_error = nullptr;
+    start();
   }
 
   ThreadPool::~ThreadPool()
   {
     {
-      std::unique_lock<std::mutex> lock(_queue_mutex);
-      _stop = true;
+      std::unique_lock<std::mutex> lock(m_park_mutex);
+      m_stop = true;
     }
-    _condition.notify_all();
-    for (std::thread& t : _pool)
+    m_condition.notify_all();
+    for (std::thread& t : m_pool)
       if (t.joinable()) t.join();
   }
 
   void ThreadPool::join_all()
   {
     {
-      std::unique_lock<std::mutex> lock(_queue_mutex);
-      _stop = true;
+      std::unique_lock<std::mutex> lock(m_park_mutex);
+      m_stop = true;
+    }
+    m_condition.notify_all();
+    for (std::thread& t : m_pool)
+      if (t.joinable()) t.join();
+
+    std::exception_ptr e;
+    {
+      std::unique_lock<spinlock> lock(m_error_lock);
+      std::swap(e, m_error);
     }
-    _condition.notify_all();
-    for (std::thread& t : _pool) t.join();
+    if (e)
+      std::rethrow_exception(e);
   }
 
   void ThreadPool::join(int i)
   {
-    if (_pool[i].joinable()) _pool[i].join();
+    if (m_pool[i].joinable()) m_pool[i].join();
+  }
+
+  int ThreadPool::current_worker() noexcept
+  {
+    return tl_worker;
+  }
+
+  void ThreadPool::push(task&& t)
+  {
+    if (tl_pool == this)
+    {
+      m_queued.fetch_add(1);
+      m_queues[tl_worker]->push(std::move(t));
+    }
+    else
+    {
+      if (m_stop.load(std::memory_order_relaxed))
+      {
+        if (t.group())
+          t.group()->finish();
+        throw std::runtime_error("Push on stopped Pool.");
+      }
+      m_queued.fetch_add(1);
+      std::size_t i = m_next.fetch_add(1, std::memory_order_relaxed) % m_n;
+      m_queues[i]->push(std::move(t));
+    }
+
+    if (m_parked.load() > 0)
+    {
+      std::unique_lock<std::mutex> lock(m_park_mutex);
+      m_condition.notify_one();
+    }
+  }
+
+  bool ThreadPool::find_task(int i, task& t)
+  {
+    if (i >= 0 && m_queues[i]->pop(t))
+    {
+      m_queued.fetch_sub(1);
+      return true;
+    }
+
+    std::size_t n = m_queues.size();
+    std::size_t start = i >= 0 ? static_cast<std::size_t>(i) + 1 : m_next.load(std::memory_order_relaxed);
+
+    for (std::size_t k = 0; k < n; ++k)
+    {
+      std::size_t victim = (start + k) % n;
+      if (static_cast<int>(victim) == i)
+        continue;
+      if (m_queues[victim]->steal(t))
+      {
+        m_queued.fetch_sub(1);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void ThreadPool::execute(task& t, int i)
+  {
+    task_group* group = t.group();
+    try {
+      t(i);
+    } catch (...) {
+      if (group)
+      {
+        group->set_error(std::current_exception());
+      }
+      else
+      {
+        std::unique_lock<spinlock> lock(m_error_lock);
+        if (!m_error)
+          m_error = std::current_exception();
+      }
+    }
+    t.reset();
+    if (group)
+      group->finish();
+  }
+
+  void ThreadPool::wait(task_group& group)
+  {
+    if (tl_pool == this)
+    {
+      std::size_t n = 0;
+      task t;
+      while (!group.done())
+      {
+        if (find_task(tl_worker, t))
+        {
+          execute(t, tl_worker);
+          n = 0;
+        }
+        else if (n++ < spin())
+        {
+          CPU_PAUSE();
+        }
+        else
+        {
+          std::this_thread::yield();
+        }
+      }
+    }
+    else
+    {
+      std::unique_lock<std::mutex> lock(group.m_mutex);
+      group.m_cv.wait(lock, [&group]{ return group.done(); });
+    }
+
+    while (group.m_finishing.load(std::memory_order_acquire) > 0)
+      CPU_PAUSE();
+
+    std::exception_ptr e;
+    {
+      std::unique_lock<spinlock> lock(group.m_error_lock);
+      std::swap(e, group.m_error);
+    }
+    if (e)
+      std::rethrow_exception(e);
   }
 
   void ThreadPool::worker(int i)
   {
+    tl_pool = this;
+    tl_worker = i;
+
+    task t;
     while (true)
     {
-      std::function<void(int)> task;
+      if (find_task(i, t))
+      {
+        execute(t, i);
+        continue;
+      }
+
+      bool found = false;
+      for (std::size_t s = 0, n = spin(); s < n; ++s)
       {
-        std::unique_lock<std::mutex> lock(this->_queue_mutex);
-        this->_condition.wait(lock, [this] { return this->_stop || !this->_queue.empty(); });
-        if (this->_stop && this->_queue.empty()) return;
-        task = std::move(this->_queue.front());
-        this->_queue.pop();
+        if (m_queued.load(std::memory_order_relaxed) > 0 && find_task(i, t))
+        {
+          found = true;
+          break;
+        }
+        CPU_PAUSE();
       }
-      task(i);
+
+      if (found)
+      {
+        execute(t, i);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(m_park_mutex);
+      m_parked.fetch_add(1);
+      m_condition.wait(lock, [this]{ return m_stop.load() || m_queued.load() > 0; });
+      m_parked.fetch_sub(1);
+
+      if (m_stop.load() && m_queued.load() == 0)
+        break;
     }
-  }
 
-} // end of namespace kmdiff
+    tl_pool = nullptr;
+    tl_worker = -1;
+  }
 
+} // end of namespace kmq
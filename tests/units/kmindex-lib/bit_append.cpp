@@ -0,0 +1,77 @@
+#include <climits>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <kmindex/utils.hpp>
+#include <kmindex/index/bit_append.hpp>
+
+TEST(kmindex_lib_bit_append, append_bits)
+{
+  std::mt19937_64 gen(42);
+
+  for (std::size_t prefix : {0, 3, 8, 13, 64, 67, 130})
+  {
+    for (std::size_t nbits : {0, 1, 7, 8, 9, 63, 64, 65, 200, 517})
+    {
+      std::size_t size = (prefix + nbits + 7) / 8;
+      std::vector<std::uint8_t> src((nbits + 7) / 8);
+      for (auto& b : src)
+        b = gen();
+
+      std::vector<std::uint8_t> expected(size, 0);
+      for (std::size_t k = 0; k < prefix; ++k)
+        if (gen() & 1)
+          BITSET(expected, k);
+
+      // Bits before 'prefix' are kept, bits of 'src' beyond 'nbits' are ignored.
+      std::vector<std::uint8_t> merged = expected;
+      kmq::append_bits(merged.data(), prefix, src.data(), nbits);
+
+      for (std::size_t k = 0; k < nbits; ++k)
+        if (BITCHECK(src, k))
+          BITSET(expected, prefix + k);
+
+      EXPECT_EQ(merged, expected) << "prefix=" << prefix << " nbits=" << nbits;
+    }
+  }
+}
+
+TEST(kmindex_lib_bit_append, append_bits_msb)
+{
+  std::mt19937_64 gen(42);
+
+  // bitpacker order: bit k is the (k % 8)-th most significant bit of byte k / 8.
+  auto msb_check = [](const std::vector<std::uint8_t>& v, std::size_t k) {
+    return (v[k / 8] >> (7 - k % 8)) & 1;
+  };
+  auto msb_set = [](std::vector<std::uint8_t>& v, std::size_t k) {
+    v[k / 8] |= 0x80 >> (k % 8);
+  };
+
+  for (std::size_t prefix : {0, 3, 8, 13, 64, 67, 130})
+  {
+    for (std::size_t nbits : {0, 1, 7, 8, 9, 63, 64, 65, 200, 517})
+    {
+      std::size_t size = (prefix + nbits + 7) / 8;
+      std::vector<std::uint8_t> src((nbits + 7) / 8);
+      for (auto& b : src)
+        b = gen();
+
+      std::vector<std::uint8_t> expected(size, 0);
+      for (std::size_t k = 0; k < prefix; ++k)
+        if (gen() & 1)
+          msb_set(expected, k);
+
+      std::vector<std::uint8_t> merged = expected;
+      kmq::append_bits_msb(merged.data(), prefix, src.data(), nbits);
+
+      for (std::size_t k = 0; k < nbits; ++k)
+        if (msb_check(src, k))
+          msb_set(expected, prefix + k);
+
+      EXPECT_EQ(merged, expected) << "prefix=" << prefix << " nbits=" << nbits;
+    }
+  }
+}
@@ -0,0 +1,113 @@
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <kmindex/exceptions.hpp>
+#include <kmindex/fastx.hpp>
+
+using kmq::fastx_record_view;
+using kmq::fastx_type;
+
+namespace {
+
+  std::vector<std::pair<std::string, std::string>> parse(std::string& s,
+                                                         fastx_type type,
+                                                         bool multiline = false,
+                                                         bool* ok = nullptr)
+  {
+    std::vector<fastx_record_view> records;
+    bool r = kmq::parse_fastx(s.data(), s.data() + s.size(), type, records, multiline);
+    if (ok)
+      *ok = r;
+
+    std::vector<std::pair<std::string, std::string>> out;
+    for (auto& rec : records)
+      out.emplace_back(rec.name, rec.seq);
+    return out;
+  }
+
+  using records_t = std::vector<std::pair<std::string, std::string>>;
+}
+
+TEST(kmindex_lib_fastx, guess_fastx_type)
+{
+  std::string fa = "\n  >r1\nACGT\n";
+  std::string fq = "@r1\nACGT\n+\nIIII\n";
+  std::string bad = "ACGT\n";
+
+  EXPECT_EQ(kmq::guess_fastx_type(fa.data(), fa.data() + fa.size()), fastx_type::fasta);
+  EXPECT_EQ(kmq::guess_fastx_type(fq.data(), fq.data() + fq.size()), fastx_type::fastq);
+  EXPECT_THROW(kmq::guess_fastx_type(bad.data(), bad.data() + bad.size()), kmq::kmq_io_error);
+  EXPECT_THROW(kmq::guess_fastx_type(bad.data(), bad.data()), kmq::kmq_io_error);
+}
+
+TEST(kmindex_lib_fastx, next_fastx_record)
+{
+  // The quality of r1 starts with '@'.
+  std::string fq = "@r1\nACGT\n+\n@III\n@r2\nAC\n+\nII\n";
+  const char* b = fq.data();
+  const char* e = b + fq.size();
+
+  EXPECT_EQ(kmq::next_fastx_record(b, e, b, fastx_type::fastq), b);
+  EXPECT_EQ(kmq::next_fastx_record(b, e, b + 1, fastx_type::fastq), b + fq.find("@r2"));
+  EXPECT_EQ(kmq::next_fastx_record(b, e, b + fq.find("@III"), fastx_type::fastq), b + fq.find("@r2"));
+  EXPECT_EQ(kmq::next_fastx_record(b, e, b + fq.find("@r2") + 1, fastx_type::fastq), e);
+
+  std::string fa = ">r1\nAC\nGT\n>r2\nTT";
+  b = fa.data();
+  e = b + fa.size();
+  EXPECT_EQ(kmq::next_fastx_record(b, e, b + 2, fastx_type::fasta), b + fa.find(">r2"));
+  EXPECT_EQ(kmq::next_fastx_record(b, e, b + fa.find(">r2") + 1, fastx_type::fasta), e);
+}
+
+TEST(kmindex_lib_fastx, is_four_line_fastq)
+{
+  std::string four = "@r1\nACGT\n+\n@III\n@r2\nAC\n+\nII\n";
+  std::string multi = "@r1\nAC\nGT\n+\nII\nII\n";
+  std::string late = four + multi;
+
+  EXPECT_TRUE(kmq::is_four_line_fastq(four.data(), four.data() + four.size()));
+  EXPECT_FALSE(kmq::is_four_line_fastq(multi.data(), multi.data() + multi.size()));
+  EXPECT_FALSE(kmq::is_four_line_fastq(late.data(), late.data() + late.size()));
+  // Only the first records are sampled, a record cut by 'end' is not checked.
+  EXPECT_TRUE(kmq::is_four_line_fastq(late.data(), late.data() + late.size(), 2));
+  EXPECT_TRUE(kmq::is_four_line_fastq(multi.data(), multi.data() + 7));
+}
+
+TEST(kmindex_lib_fastx, parse_fasta)
+{
+  std::string fa = ">r1 desc\nAC\r\nGT\r\n\n>r2\nTTT";
+  EXPECT_EQ(parse(fa, fastx_type::fasta), (records_t {{"r1", "ACGT"}, {"r2", "TTT"}}));
+
+  std::string bad = "ACGT\n>r1\nAC\n";
+  EXPECT_THROW(parse(bad, fastx_type::fasta), kmq::kmq_io_error);
+}
+
+TEST(kmindex_lib_fastx, parse_fastq)
+{
+  bool ok = false;
+
+  // Quality starting with '@', CRLF and no final newline.
+  std::string fq = "@r1 desc\r\nACGT\r\n+\r\n@III\r\n@r2\nAC\n+r2\nII";
+  EXPECT_EQ(parse(fq, fastx_type::fastq, false, &ok), (records_t {{"r1", "ACGT"}, {"r2", "AC"}}));
+  EXPECT_TRUE(ok);
+
+  // Multi-line records are left to the caller, or parsed with 'multiline'.
+  std::string multi = "@r1\nACGT\n+\nIIII\n@r2\nAC\nGT\n+\n@I\nII\n@r3\nA\n+\nI\n";
+  std::string copy = multi;
+  EXPECT_EQ(parse(copy, fastx_type::fastq, false, &ok), (records_t {{"r1", "ACGT"}}));
+  EXPECT_FALSE(ok);
+  EXPECT_EQ(parse(multi, fastx_type::fastq, true, &ok),
+            (records_t {{"r1", "ACGT"}, {"r2", "ACGT"}, {"r3", "A"}}));
+  EXPECT_TRUE(ok);
+
+  // A record cut by the end of the region.
+  std::string cut = "@r1\nACGT\n+\nIIII\n@r2\nAC\n";
+  copy = cut;
+  EXPECT_EQ(parse(copy, fastx_type::fastq, false, &ok), (records_t {{"r1", "ACGT"}}));
+  EXPECT_FALSE(ok);
+  EXPECT_THROW(parse(cut, fastx_type::fastq, true), kmq::kmq_io_error);
+
+  std::string short_qual = "@r1\nACGT\n+\nII\n";
+  EXPECT_THROW(parse(short_qual, fastx_type::fastq, true), kmq::kmq_io_error);
+}
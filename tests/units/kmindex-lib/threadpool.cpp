@@ -0,0 +1,57 @@
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <kmindex/threadpool.hpp>
+
+TEST(kmindex_lib_threadpool, parallel_for)
+{
+  kmq::ThreadPool pool(4);
+
+  std::vector<std::size_t> v(10000, 0);
+  pool.parallel_for(0, v.size(), [&v](int, std::size_t i){ v[i] = i * 2; }, 0);
+
+  for (std::size_t i = 0; i < v.size(); ++i)
+    EXPECT_EQ(v[i], i * 2);
+}
+
+TEST(kmindex_lib_threadpool, nested_groups)
+{
+  kmq::ThreadPool pool(4);
+
+  std::atomic<std::size_t> count {0};
+  pool.parallel_for(0, 32, [&pool, &count](int, std::size_t){
+    pool.parallel_for(0, 64, [&count](int, std::size_t){ count++; });
+  });
+
+  EXPECT_EQ(count.load(), 32 * 64);
+}
+
+TEST(kmindex_lib_threadpool, join_all)
+{
+  kmq::ThreadPool pool(2);
+
+  std::atomic<std::size_t> count {0};
+  for (std::size_t i = 0; i < 1000; ++i)
+    pool.add_task([&count, &pool](int){
+      count++;
+      pool.add_task([&count](int){ count++; });
+    });
+  pool.join_all();
+
+  EXPECT_EQ(count.load(), 2000);
+}
+
+TEST(kmindex_lib_threadpool, exceptions)
+{
+  kmq::ThreadPool pool(2);
+
+  EXPECT_THROW(
+    pool.parallel_for(0, 100, [](int, std::size_t i){ if (i == 42) throw std::runtime_error("42"); }),
+    std::runtime_error
+  );
+
+  pool.add_task([](int){ throw std::runtime_error("task"); });
+  EXPECT_THROW(pool.join_all(), std::runtime_error);
+}
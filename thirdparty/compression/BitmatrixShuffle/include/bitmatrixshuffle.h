@@ -47,6 +47,9 @@ namespace bms
     //Reorder matrix columns (bit-swapping on memory-mapped file)
     void reorder_matrix_columns_and_compress(const std::string& MATRIX_PATH, const std::string& OUTPUT_PATH, const std::string& OUTPUT_EF_PATH, const std::string& CONFIG_PATH, const unsigned HEADER, const std::size_t NB_COLS, const std::size_t NB_ROWS, const std::vector<std::uint64_t>& ORDER, const std::size_t BLOCK_TARGET_SIZE);
 
+    //Transpose a bit matrix (rows and columns multiples of 8), MSB first
+    void __sse2_trans(std::uint8_t const *inp, std::uint8_t *out, long nrows, long ncols);
+
     //Reorder matrix rows (row-swapping on memory-mapped file)
     void reorder_matrix_rows(char* mapped_file, const unsigned HEADER, const std::size_t ROW_LENGTH, const std::vector<std::uint64_t>& ORDER);
 